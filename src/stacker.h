@@ -10,7 +10,7 @@
 #include "stacker_diagnostics.h"
 #include "stacker_message.h"
 
-namespace urlcache { class UrlCache; struct ParsedUrl; enum UrlFetchPriority; }
+namespace urlcache { class UrlCache; struct ParsedUrl; enum UrlFetchPriority : int; }
 
 namespace stkr {
 
@@ -22,6 +22,7 @@ struct Node;
 struct Box;
 struct View;
 struct Rule;
+struct CompiledSelector;
 
 enum Axis { AXIS_H, AXIS_V };
 
@@ -64,6 +65,7 @@ enum NodeFlag {
 	NFLAG_REBUILD_BOXES                = 1 << 4,  // This node's box must be recreated.
 	NFLAG_RECONSTRUCT_PARAGRAPH        = 1 << 5,  // Rebuild paragraph elements from children if this is an inline container.
 	NFLAG_REMEASURE_PARAGRAPH_ELEMENTS = 1 << 6,  // Update text advances if this is an inline container. 
+	NFLAG_DIRTY_DESCENDANTS            = 1 << 7,  // One or more descendants have update bits set.
 	NFLAG_RECOMPOSE_CHILD_BOXES        = 1 << 8,  // Node child boxes have changed, and should be rearranged within the parent.
 	NFLAG_UPDATE_RULE_KEYS             = 1 << 9,  // The set of keys used to match rules for this node must be recalculated.
 	NFLAG_UPDATE_MATCHED_RULES         = 1 << 10, // The node's match rule list must be recalculated.
@@ -138,13 +140,16 @@ enum DocumentFlag {
 	DOCFLAG_DEBUG_FULL_LAYOUT       = 1 << 10, // Send layout diagnostics to the dump function.
 	DOCFLAG_DEBUG_PARAGRAPHS        = 1 << 11, // Dump paragraph breakpoint info.
 	DOCFLAG_DEBUG_SELECTION         = 1 << 12, // Print selection hit testing messages.
+	DOCFLAG_PARALLEL_PARSE          = 1 << 13, // Parse large inputs on worker threads.
+	DOCFLAG_SHARE_SOURCE_TEXT       = 1 << 15, // Text nodes refer to the kept source, or without DOCFLAG_KEEP_SOURCE, to the caller's input, which must outlive them.
 
 	/* Internal, do not use. */
-	DOCFLAG_UPDATE_REMATCH_RULES    = 1 << 14  // Assume rule tables have changed during the current update.
+	DOCFLAG_UPDATE_REMATCH_RULES    = 1 << 14, // Assume rule tables have changed during the current update.
+	DOCFLAG_RULE_LOG_INVALID        = 1 << 16  // Rule changes since the last update aren't all in the rule change logs.
 };
 
 /* The status of a document's attempt to navigate to a URL. */
-enum NavigationState {
+enum NavigationState : int {
 	DOCNAV_IDLE,
 	DOCNAV_IN_PROGRESS,
 	DOCNAV_FAILED,
@@ -181,6 +186,8 @@ enum SystemFlag {
 };
 
 enum Code {
+	STKR_FILE_ERROR                     = -28,
+	STKR_INVALID_BINARY                 = -27,
 	STKR_CANNOT_FOLD                    = -26,
 	STKR_INVALID_SET_LITERAL            = -25,
 	STKR_INVALID_OPERATION              = -24,
@@ -241,8 +248,84 @@ struct ParsedSelector {
 	unsigned keys_per_clause[MAX_SELECTOR_CLAUSES];
 };
 
+/* One of a batch of rules to be created by add_rules(). */
+struct RuleDefinition {
+	const char *selector;
+	int selector_length; // Negative if the selector is null terminated.
+	const AttributeAssignment *attributes;
+	unsigned num_attributes;
+	unsigned flags;
+	int priority;
+};
+
 typedef void (*DumpCallback)(void *data, const char *fmt, va_list args);
 
+/* Receives one Chrome trace event, a JSON object, per call. Clients write the
+ * events into a JSON array to make a file that can be loaded by 
+ * chrome://tracing or Perfetto. */
+typedef void (*TraceCallback)(void *data, const char *event, unsigned length);
+
+/* Passes of a document update, reported to the update stage callback as each
+ * one begins. */
+enum UpdateStage {
+	USTG_PRE_LAYOUT,            // Node updates before layout.
+	USTG_LAYOUT_UPDATE_INFO,    // Layout: update dependency flags.
+	USTG_LAYOUT_COMPUTE_SIZES,  // Layout: multi-pass box sizing.
+	USTG_LAYOUT_COMPUTE_BOUNDS, // Layout: update box bounds.
+	USTG_LAYOUT_UPDATE_CLIP,    // Layout: update clip boxes and depth.
+	USTG_POST_LAYOUT,           // Node updates after layout.
+	USTG_COMPLETE,              // The update has finished.
+	NUM_UPDATE_STAGES
+};
+
+typedef void (*UpdateStageCallback)(void *data, const Document *document, 
+	UpdateStage stage);
+
+/* Work counters for the most recent document update. The counters are reset
+ * when update_document() begins a new update, and draw commands built by
+ * update_view() are added to the totals for the update that preceded it. */
+struct UpdateStats {
+	unsigned pre_layout_nodes_visited;  // Nodes visited before layout.
+	unsigned post_layout_nodes_visited; // Nodes visited after layout.
+	unsigned rules_matched;             // Selectors matched by match_rules().
+	unsigned rules_rejected;            // Candidate selectors that failed.
+	unsigned rules_filtered;            // Rejected by the ancestor filter.
+	unsigned rules_shared;              // Nodes that copied a sibling's matched rules.
+	unsigned rules_invalidated;         // Nodes marked by logged rule changes.
+	unsigned attribute_folds;           // Nodes whose attributes were refolded.
+	unsigned folds_shared;              // Nodes that copied a sibling's folded style.
+	unsigned folds_cached;              // Nodes that found their folded style in the style cache.
+	unsigned boxes_created;
+	unsigned boxes_destroyed;
+	unsigned sizing_frame_pushes;
+	unsigned text_measurements;         // Calls to the back end's measure_text.
+	unsigned characters_measured;       // Code units passed to measure_text.
+	unsigned breakpoints_evaluated;     // Line break candidates scored.
+	unsigned lines_rebuilt;             // Line boxes rebuilt by box update.
+	unsigned grid_inserts;
+	unsigned grid_removals;
+	unsigned draw_commands;             // Commands built by update_view().
+};
+
+/* The allocation pools owned by a document. */
+enum DocumentPool {
+	DPOOL_NODES,
+	DPOOL_BOXES,
+	DPOOL_LAYERS,
+	NUM_DOCUMENT_POOLS
+};
+
+/* Allocator counters for a document pool. The counters restart when the pool
+ * is released by reset_document(). */
+struct PoolStats {
+	unsigned live_blocks; // Blocks currently allocated.
+	unsigned peak_blocks; // Most blocks allocated at once.
+	unsigned chunks;      // Chunks held by the pool.
+	unsigned allocations;
+	unsigned recycled;    // Allocations served from a free list.
+	unsigned heap_blocks; // Allocations too large for any size class.
+};
+
 /*
  * Node
  */
@@ -348,6 +431,12 @@ int add_rule(
 	unsigned num_attributes = 0,
 	unsigned flags = RFLAG_ENABLED, 
 	int priority = 0);
+int add_rules(
+	Rule **results,
+	System *system, 
+	Document *document, 
+	const RuleDefinition *definitions,
+	unsigned num_rules);
 void destroy_rule(Rule *rule);
 unsigned get_rule_flags(const Rule *rule);
 void set_rule_flags(Rule *rule, unsigned mask, bool value);
@@ -369,6 +458,14 @@ int match_nodes(const Document *document, const Node *root,
 	const char *selector, int selector_length = -1, 
 	const Node **matched_nodes = 0, unsigned max_matched = 0,
 	int max_depth = -1);
+int compile_selector(CompiledSelector **result, System *system, 
+	const char *selector, int length = -1);
+void release_selector(System *system, CompiledSelector *selector);
+int node_matches_selector(const Document *document, const Node *node, 
+	const CompiledSelector *selector);
+int match_nodes(const Document *document, const Node *root, 
+	const CompiledSelector *selector, const Node **matched_nodes = 0, 
+	unsigned max_matched = 0, int max_depth = -1);
 
 /*
  * Box
@@ -398,7 +495,14 @@ float get_root_dimension(const Document *document, Axis axis);
 void set_root_dimension(Document *document, Axis axis, unsigned dimension);
 void set_layout_dump_callback(Document *document, DumpCallback layout_dump, 
 	void *layout_dump_data = 0);
+void set_update_stage_callback(Document *document, 
+	UpdateStageCallback stage_callback, void *stage_callback_data = 0);
+void set_trace_callback(Document *document, TraceCallback trace, 
+	void *trace_data = 0);
 bool update_document(Document *document, uintptr_t timeout = 0);
+const UpdateStats *get_update_stats(const Document *document);
+void get_pool_stats(const Document *document, DocumentPool pool, 
+	PoolStats *stats);
 Node *get_root(Document *document);
 const Node *get_root(const Document  *document);
 unsigned get_hit_clock(const Document *document);
@@ -439,6 +543,10 @@ void view_handle_keyboard_event(View *view, MessageType type,
  */
 int parse(System *system, Document *document, Node *root, const char *input, 
 	unsigned length, void *error_buffer = 0, unsigned error_buffer_size = 0);
+int reparse(System *system, Document *document, const char *input, 
+	unsigned length, unsigned edit_start, unsigned edit_old_end, 
+	unsigned edit_new_end, void *error_buffer = 0, 
+	unsigned error_buffer_size = 0);
 int create_node_from_markup(
 	Node **out_node, 
 	Document *document, 
@@ -447,6 +555,17 @@ int create_node_from_markup(
 	char *error_buffer = 0, 
 	unsigned error_buffer_size = 0);
 
+/*
+ * Compiled Documents
+ */
+int compile_document(const Document *document, const Node *root,
+	char **out_data, unsigned *out_size);
+int save_compiled_document(const Document *document, const Node *root,
+	const char *path);
+int load_compiled_document(Document *document, Node *root, const void *data,
+	unsigned size);
+int load_compiled_document(Document *document, Node *root, const char *path);
+
 /*
  * Utilities
  */
@@ -0,0 +1,163 @@
+#include "stacker_arena.h"
+
+#include <cstring>
+
+#include "stacker_shared.h"
+
+namespace stkr {
+
+/* Block sizes for each size class. Each is a multiple of 16. Small classes
+ * step by 16 bytes so that small fixed-size objects waste little, and larger
+ * ones grow by a factor of about 1.5 to bound waste. In an arena used for a
+ * single class that is a multiple of ARENA_ALIGNMENT, like the box arena,
+ * every block is aligned to a cache line. */
+static const unsigned ARENA_CLASS_SIZES[NUM_ARENA_SIZE_CLASSES] = {
+	32, 48, 64, 80, 96, 128, 192, 256, 384, 512, 
+	768, 1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384
+};
+
+static const unsigned ARENA_CHUNK_HEADER_SIZE =
+	(sizeof(ArenaChunk) + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+void arena_init(Arena *arena)
+{
+	arena->chunks = NULL;
+	arena->top = NULL;
+	arena->end = NULL;
+	memset(arena->free_blocks, 0, sizeof(arena->free_blocks));
+	arena->live_blocks = 0;
+	arena->peak_blocks = 0;
+	arena->num_chunks = 0;
+	arena->num_allocations = 0;
+	arena->num_recycled = 0;
+	arena->num_heap_blocks = 0;
+}
+
+/* Releases all chunks at once. Blocks allocated from the arena must not be
+ * used afterwards. Heap blocks are not tracked, and must be freed by the
+ * caller first. */
+void arena_clear(Arena *arena)
+{
+	ArenaChunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		ArenaChunk *next = chunk->next;
+		delete [] chunk->memory;
+		chunk = next;
+	}
+	arena_init(arena);
+}
+
+/* Returns the smallest size class that can hold a block of 'size' bytes, or
+ * ARENA_HEAP_CLASS if the block is too large for any class. */
+unsigned arena_size_class(unsigned size)
+{
+	for (unsigned i = 0; i < NUM_ARENA_SIZE_CLASSES; ++i)
+		if (size <= ARENA_CLASS_SIZES[i])
+			return i;
+	return ARENA_HEAP_CLASS;
+}
+
+static void arena_push_free_block(Arena *arena, void *block,
+	unsigned size_class)
+{
+	*(void **)block = arena->free_blocks[size_class];
+	arena->free_blocks[size_class] = block;
+}
+
+/* Moves whatever is left of the current chunk onto the free lists, largest
+ * class first, so that it isn't wasted when a new chunk is started. */
+static void arena_retire_chunk_tail(Arena *arena)
+{
+	for (unsigned i = NUM_ARENA_SIZE_CLASSES; i-- != 0; ) {
+		unsigned size = ARENA_CLASS_SIZES[i];
+		while ((unsigned)(arena->end - arena->top) >= size) {
+			arena_push_free_block(arena, arena->top, i);
+			arena->top += size;
+		}
+	}
+}
+
+static void arena_add_chunk(Arena *arena)
+{
+	arena_retire_chunk_tail(arena);
+	char *memory = new char[ARENA_CHUNK_SIZE + ARENA_ALIGNMENT];
+	char *aligned = (char *)(((uintptr_t)memory + ARENA_ALIGNMENT - 1) & 
+		~(uintptr_t)(ARENA_ALIGNMENT - 1));
+	ArenaChunk *chunk = (ArenaChunk *)aligned;
+	chunk->next = arena->chunks;
+	chunk->memory = memory;
+	arena->chunks = chunk;
+	arena->top = aligned + ARENA_CHUNK_HEADER_SIZE;
+	arena->end = aligned + ARENA_CHUNK_SIZE;
+	arena->num_chunks++;
+}
+
+/* Allocates a block of at least 'size' bytes in the specified size class,
+ * which must be the one returned by arena_size_class(size). */
+void *arena_allocate(Arena *arena, unsigned size_class, unsigned size)
+{
+	arena->num_allocations++;
+	if (++arena->live_blocks > arena->peak_blocks)
+		arena->peak_blocks = arena->live_blocks;
+	if (size_class == ARENA_HEAP_CLASS) {
+		arena->num_heap_blocks++;
+		return new char[size];
+	}
+	assertb(size <= ARENA_CLASS_SIZES[size_class]);
+	void *block = arena->free_blocks[size_class];
+	if (block != NULL) {
+		arena->free_blocks[size_class] = *(void **)block;
+		arena->num_recycled++;
+		return block;
+	}
+	unsigned class_size = ARENA_CLASS_SIZES[size_class];
+	if ((unsigned)(arena->end - arena->top) < class_size)
+		arena_add_chunk(arena);
+	block = arena->top;
+	arena->top += class_size;
+	return block;
+}
+
+/* Moves all of the chunks and free blocks of 'source' into 'dest', leaving
+ * 'source' empty. Blocks allocated from 'source' can then be freed to 'dest'.
+ * The remainder of the source's current chunk is split into free blocks. */
+void arena_merge(Arena *dest, Arena *source)
+{
+	arena_retire_chunk_tail(source);
+	ArenaChunk *chunk = source->chunks;
+	while (chunk != NULL) {
+		ArenaChunk *next = chunk->next;
+		chunk->next = dest->chunks;
+		dest->chunks = chunk;
+		chunk = next;
+	}
+	for (unsigned i = 0; i < NUM_ARENA_SIZE_CLASSES; ++i) {
+		void *block = source->free_blocks[i];
+		while (block != NULL) {
+			void *next = *(void **)block;
+			arena_push_free_block(dest, block, i);
+			block = next;
+		}
+	}
+	dest->live_blocks += source->live_blocks;
+	if (dest->live_blocks > dest->peak_blocks)
+		dest->peak_blocks = dest->live_blocks;
+	dest->num_chunks += source->num_chunks;
+	dest->num_allocations += source->num_allocations;
+	dest->num_recycled += source->num_recycled;
+	dest->num_heap_blocks += source->num_heap_blocks;
+	arena_init(source);
+}
+
+/* Returns a block to its size class's free list. */
+void arena_free(Arena *arena, void *block, unsigned size_class)
+{
+	assertb(arena->live_blocks != 0);
+	arena->live_blocks--;
+	if (size_class == ARENA_HEAP_CLASS)
+		delete [] (char *)block;
+	else
+		arena_push_free_block(arena, block, size_class);
+}
+
+} // namespace stkr
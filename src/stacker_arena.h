@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+
+namespace stkr {
+
+/* A block allocator for objects with document lifetime. Blocks are carved
+ * from large chunks and recycled through one free list per size class, so
+ * that building a large document doesn't make a heap allocation per object.
+ * Requests larger than the largest size class go to the heap. Chunks are
+ * aligned to cache lines, and blocks to 16 bytes. */
+
+const unsigned ARENA_CHUNK_SIZE       = 64 * 1024;
+const unsigned ARENA_ALIGNMENT        = 64;
+const unsigned NUM_ARENA_SIZE_CLASSES = 20;
+const unsigned ARENA_HEAP_CLASS       = NUM_ARENA_SIZE_CLASSES;
+
+struct ArenaChunk {
+	ArenaChunk *next;
+	char *memory;
+};
+
+struct Arena {
+	ArenaChunk *chunks;
+	char *top;
+	char *end;
+	void *free_blocks[NUM_ARENA_SIZE_CLASSES];
+	unsigned live_blocks;
+	unsigned peak_blocks;
+	unsigned num_chunks;
+	unsigned num_allocations;
+	unsigned num_recycled;
+	unsigned num_heap_blocks;
+};
+
+void arena_init(Arena *arena);
+void arena_clear(Arena *arena);
+unsigned arena_size_class(unsigned size);
+void *arena_allocate(Arena *arena, unsigned size_class, unsigned size);
+void arena_free(Arena *arena, void *block, unsigned size_class);
+void arena_merge(Arena *dest, Arena *source);
+
+} // namespace stkr
@@ -1592,16 +1592,22 @@ static int store_validated_attribute(AttributeBuffer *abuf, int name, int mode,
 		entry = abuf_create_attribute(abuf, name, mode, vr->storage, op, 
 			stored_size);
 	} else {
-		/* Reallocate memory for the attribute. */
-		entry = abuf_allocate_replace(abuf, name, mode, vr->storage, 
-			op, stored_size);
-		/* Is the new value different from the old? */
-		if (mode == (int)entry->header.mode &&
+		/* Is the new value different from the old? This must be checked
+		 * before reallocation, which overwrites the existing entry. */
+		entry = (BufferEntry *)abuf->buffer;
+		BufferEntry *end = abuf_end(abuf);
+		while (entry != end && entry->header.name != name)
+			entry = abuf_next_entry(entry);
+		if (entry != end &&
+			mode == (int)entry->header.mode &&
 			op == (AttributeOperator)entry->header.op &&
 			entry->header.size == stored_size &&
 			(0 == memcmp(&entry->data, vr->data, vr->size))) {
 			return false;
 		}
+		/* Reallocate memory for the attribute. */
+		entry = abuf_allocate_replace(abuf, name, mode, vr->storage,
+			op, stored_size);
 	}
 
 	/* Copy the validated data into the attribute and pad with the specified
@@ -0,0 +1,812 @@
+#if defined(STACKER_BENCH)
+
+/* Layout benchmark. Loads a set of .stacker documents and reports the time
+ * spent in each pass of the update pipeline as JSON, for several scenarios:
+ *
+ *   cold_start     A new system and document per run: parse, update, build
+ *                  view commands.
+ *   warm_relayout  The same document with every node marked for restyling and
+ *                  box reconstruction, so fonts and rule tables are warm.
+ *   resize         A sweep of set_root_dimension() widths.
+ *   mutation       A single attribute toggled on one node.
+ *
+ * Usage: stacker_bench [-i iterations] [-w width] [-d directory]
+ *                      [-o output.json] [files...]
+ *        stacker_bench -s parameter|all [-n max_nodes] [-i iterations]
+ *                      [-w width] [-o output.json]
+ *
+ * Common options:
+ *   -u slice_us    Pass a timeout to update_document() and call it repeatedly
+ *                  until the update completes.
+ *   -t trace.json  Write a Chrome trace of every update.
+ *   -p 0|1         Set DOCFLAG_PARALLEL_PARSE, so that inputs large enough
+ *                  are parsed on up to one thread per hardware thread. 
+ *                  Compare parse_us with and without it on a large input, 
+ *                  e.g. one written by stacker_generate -nodes 100000.
+ *
+ * If no files are given, every .stacker file in the directory (data/samples by
+ * default) is loaded.
+ *
+ * With -s, the benchmark instead generates synthetic documents, varying one
+ * generator parameter at a time from the defaults, and reports the cold start
+ * time and the memory allocated against each value of the parameter. The
+ * -n option sets the largest document in the node count sweep. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+
+#include <new>
+
+#include <dirent.h>
+
+#include "stacker.h"
+#include "stacker_platform.h"
+#include "stacker_generator.h"
+
+/* Allocation accounting for the scaling sweep. Every allocation is prefixed
+ * with its size so that the live and peak totals can be maintained. The 
+ * totals are atomic because parser worker threads allocate too. */
+static const size_t ALLOCATION_HEADER_SIZE = 16;
+static std::atomic<size_t> g_live_bytes(0);
+static std::atomic<size_t> g_peak_bytes(0);
+
+static void *counted_malloc(size_t size)
+{
+	char *block = (char *)malloc(size + ALLOCATION_HEADER_SIZE);
+	if (block == NULL)
+		throw std::bad_alloc();
+	*(size_t *)block = size;
+	size_t live = g_live_bytes.fetch_add(size) + size;
+	size_t peak = g_peak_bytes.load();
+	while (live > peak) {
+		if (g_peak_bytes.compare_exchange_weak(peak, live))
+			break;
+	}
+	return block + ALLOCATION_HEADER_SIZE;
+}
+
+static void counted_free(void *p)
+{
+	if (p == NULL)
+		return;
+	char *block = (char *)p - ALLOCATION_HEADER_SIZE;
+	g_live_bytes -= *(size_t *)block;
+	free(block);
+}
+
+/* Each form calls malloc() and free() directly rather than another form, so
+ * that new[] is never paired with scalar delete. */
+void *operator new(size_t size) { return counted_malloc(size); }
+void *operator new[](size_t size) { return counted_malloc(size); }
+void operator delete(void *p) noexcept { counted_free(p); }
+void operator delete[](void *p) noexcept { counted_free(p); }
+void operator delete(void *p, size_t) noexcept { counted_free(p); }
+void operator delete[](void *p, size_t) noexcept { counted_free(p); }
+
+namespace stkr {
+
+typedef std::chrono::steady_clock BenchClock;
+
+const unsigned DEFAULT_ITERATIONS   = 20;
+const unsigned DEFAULT_ROOT_WIDTH   = 800;
+const unsigned DEFAULT_VIEW_HEIGHT  = 600;
+const unsigned RESIZE_SWEEP_MIN     = 320;
+const unsigned RESIZE_SWEEP_MAX     = 1280;
+const unsigned RESIZE_SWEEP_STEP    = 80;
+const char * const DEFAULT_SAMPLE_DIRECTORY = "data/samples";
+const unsigned DEFAULT_SCALING_ITERATIONS = 3;
+const unsigned DEFAULT_SCALING_MAX_NODES  = 8000;
+const unsigned MAX_SWEEP_VALUES = 8;
+
+/* Values taken by each parameter in the scaling sweep. A zero after the first
+ * entry ends the list. The node count sweep doubles from its first value up to
+ * the -n limit instead. */
+struct ParameterSweep {
+	const char *name;
+	unsigned values[MAX_SWEEP_VALUES];
+};
+
+static const ParameterSweep PARAMETER_SWEEPS[] = {
+	{ "nodes",            { 250 } },
+	{ "depth",            { 2, 4, 8, 16, 32 } },
+	{ "fan-out",          { 2, 4, 8, 16, 32, 64 } },
+	{ "hbox",             { 0, 1, 2, 4, 8, 16 } },
+	{ "p",                { 1, 2, 4, 8, 16, 32 } },
+	{ "rules",            { 0, 10, 20, 40, 80, 160, 320 } },
+	{ "classes-per-node", { 0, 1, 2, 4, 8, 16 } },
+	{ "words",            { 10, 30, 90, 270, 810 } },
+	{ "images",           { 0, 10, 100, 1000 } }
+};
+static const unsigned NUM_PARAMETER_SWEEPS =
+	sizeof(PARAMETER_SWEEPS) / sizeof(PARAMETER_SWEEPS[0]);
+
+/* Names reported for each update stage, after the internal stage enums. */
+static const char * const STAGE_NAMES[NUM_UPDATE_STAGES] = {
+	"DUS_PRE_LAYOUT",
+	"LSTG_UPDATE_INFO",
+	"LSTG_COMPUTE_SIZES",
+	"LSTG_COMPUTE_BOUNDS",
+	"LSTG_UPDATE_CLIP",
+	"DUS_POST_LAYOUT",
+	"DUS_COMPLETE"
+};
+
+/* Accumulated timings for one scenario. */
+struct ScenarioTimings {
+	unsigned runs;
+	double parse_us;
+	double stage_us[NUM_UPDATE_STAGES];
+	double view_us;
+	double total_us;
+	double min_total_us;
+};
+
+/* Records stage transitions reported by the document update. */
+struct StageTimer {
+	ScenarioTimings *timings;
+	int current_stage;
+	BenchClock::time_point stage_start;
+};
+
+struct BenchOptions {
+	unsigned iterations;
+	unsigned width;
+	const char *directory;
+	const char *output_path;
+	const char *sweep;
+	unsigned max_nodes;
+	unsigned slice_us;
+	const char *trace_path;
+	bool parallel_parse;
+};
+
+/* Collects trace events into a JSON array. */
+struct TraceWriter {
+	FILE *os;
+	bool first;
+};
+
+static TraceWriter g_trace_writer = { NULL, true };
+
+static void trace_callback(void *data, const char *event, unsigned length)
+{
+	TraceWriter *tw = (TraceWriter *)data;
+	fputs(tw->first ? "[\n" : ",\n", tw->os);
+	fwrite(event, 1, length, tw->os);
+	tw->first = false;
+}
+
+static void close_trace(TraceWriter *tw)
+{
+	if (tw->os == NULL)
+		return;
+	fputs(tw->first ? "[]\n" : "\n]\n", tw->os);
+	fclose(tw->os);
+	tw->os = NULL;
+}
+
+static double elapsed_us(BenchClock::time_point start,
+	BenchClock::time_point end)
+{
+	return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+static void stage_callback(void *data, const Document *, UpdateStage stage)
+{
+	StageTimer *st = (StageTimer *)data;
+	BenchClock::time_point now = BenchClock::now();
+	if (st->current_stage >= 0 && st->timings != NULL)
+		st->timings->stage_us[st->current_stage] += elapsed_us(st->stage_start, now);
+	st->current_stage = (stage != USTG_COMPLETE) ? (int)stage : -1;
+	st->stage_start = now;
+}
+
+static void timings_init(ScenarioTimings *t)
+{
+	memset(t, 0, sizeof(ScenarioTimings));
+	t->min_total_us = -1.0;
+}
+
+static void timings_add_run(ScenarioTimings *t, double total_us)
+{
+	t->runs++;
+	t->total_us += total_us;
+	if (t->min_total_us < 0.0 || total_us < t->min_total_us)
+		t->min_total_us = total_us;
+}
+
+static bool load_file(const char *path, char **buffer, unsigned *size)
+{
+	FILE *f = fopen(path, "rb");
+	if (f == NULL)
+		return false;
+	fseek(f, 0, SEEK_END);
+	long s = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *b = new char[s + 1];
+	s = (long)fread(b, 1, s, f);
+	fclose(f);
+	b[s] = '\0';
+	*buffer = b;
+	*size = (unsigned)s;
+	return true;
+}
+
+/* Collects the paths of .stacker files in a directory in name order. */
+static void list_samples(const char *directory, std::vector<std::string> *paths)
+{
+	static const char EXTENSION[] = ".stacker";
+	static const unsigned EXTENSION_LENGTH = sizeof(EXTENSION) - 1;
+
+	DIR *dir = opendir(directory);
+	if (dir == NULL)
+		return;
+	std::vector<std::string> names;
+	while (struct dirent *entry = readdir(dir)) {
+		unsigned length = strlen(entry->d_name);
+		if (length > EXTENSION_LENGTH && 0 == strcmp(entry->d_name +
+			length - EXTENSION_LENGTH, EXTENSION))
+			names.push_back(entry->d_name);
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+	for (unsigned i = 0; i < names.size(); ++i)
+		paths->push_back(std::string(directory) + "/" + names[i]);
+}
+
+/* State for a document under test. */
+struct BenchDocument {
+	System *system;
+	Document *document;
+	View *view;
+	StageTimer timer;
+	unsigned slice_us;
+};
+
+static void bench_document_init(BenchDocument *bd, BackEnd *back_end,
+	System *system, const BenchOptions *options)
+{
+	unsigned width = options->width;
+	bd->system = system != NULL ? system : create_system(0, back_end);
+	bd->document = create_document(bd->system, 0);
+	bd->timer.timings = NULL;
+	bd->timer.current_stage = -1;
+	set_update_stage_callback(bd->document, &stage_callback, &bd->timer);
+	if (g_trace_writer.os != NULL)
+		set_trace_callback(bd->document, &trace_callback, &g_trace_writer);
+	bd->slice_us = options->slice_us;
+	set_document_flags(bd->document, DOCFLAG_CONSTRAIN_WIDTH, true);
+	set_document_flags(bd->document, DOCFLAG_PARALLEL_PARSE, 
+		options->parallel_parse);
+	set_root_dimension(bd->document, AXIS_H, width);
+	bd->view = create_view(bd->document, 0);
+	set_view_bounds(bd->view, 0.0f, (float)width, 0.0f,
+		(float)DEFAULT_VIEW_HEIGHT);
+}
+
+static void bench_document_deinit(BenchDocument *bd, bool destroy_system_too)
+{
+	destroy_view(bd->view);
+	destroy_document(bd->document);
+	if (destroy_system_too)
+		destroy_system(bd->system);
+}
+
+static int bench_parse(BenchDocument *bd, ScenarioTimings *t,
+	const char *source, unsigned length)
+{
+	BenchClock::time_point start = BenchClock::now();
+	int code = parse(bd->system, bd->document, get_root(bd->document),
+		source, length);
+	t->parse_us += elapsed_us(start, BenchClock::now());
+	return code;
+}
+
+/* Runs an update and rebuilds the view's draw commands, returning the total
+ * time taken. */
+static double bench_update(BenchDocument *bd, ScenarioTimings *t)
+{
+	bd->timer.timings = t;
+	BenchClock::time_point start = BenchClock::now();
+	while (!update_document(bd->document, bd->slice_us))
+		continue;
+	BenchClock::time_point view_start = BenchClock::now();
+	update_view(bd->view);
+	BenchClock::time_point end = BenchClock::now();
+	bd->timer.timings = NULL;
+	t->view_us += elapsed_us(view_start, end);
+	return elapsed_us(start, end);
+}
+
+/* Marks every node for rule matching, restyling and box reconstruction. */
+static void invalidate_all_nodes(Document *document)
+{
+	static const unsigned INVALIDATE_MASK = NFLAG_UPDATE_MATCHED_RULES |
+		NFLAG_FOLD_ATTRIBUTES | NFLAG_REBUILD_BOXES |
+		NFLAG_RECONSTRUCT_PARAGRAPH;
+
+	Node *root = get_root(document);
+	Node *node = root;
+	while (node != NULL) {
+		set_node_flags(document, node, INVALIDATE_MASK, true);
+		Node *next = first_child(node);
+		while (next == NULL && node != root) {
+			next = next_sibling(node);
+			node = parent(node);
+		}
+		node = next;
+	}
+}
+
+/* Chooses a node whose attributes the mutation scenario toggles: the first
+ * paragraph or heading, or failing that the last non-text node. */
+static Node *choose_mutation_target(Document *document)
+{
+	Node *root = get_root(document);
+	Node *fallback = root;
+	Node *node = root;
+	while (node != NULL) {
+		NodeType type = get_type(node);
+		if (type == LNODE_PARAGRAPH || type == LNODE_HEADING)
+			return node;
+		if (type != LNODE_TEXT)
+			fallback = node;
+		Node *next = first_child(node);
+		while (next == NULL && node != root) {
+			next = next_sibling(node);
+			node = parent(node);
+		}
+		node = next;
+	}
+	return fallback;
+}
+
+static void run_cold_start(BackEnd *back_end, const BenchOptions *options,
+	const char *source, unsigned length, ScenarioTimings *t)
+{
+	for (unsigned i = 0; i < options->iterations; ++i) {
+		BenchDocument bd;
+		BenchClock::time_point start = BenchClock::now();
+		bench_document_init(&bd, back_end, NULL, options);
+		bench_parse(&bd, t, source, length);
+		bench_update(&bd, t);
+		timings_add_run(t, elapsed_us(start, BenchClock::now()));
+		bench_document_deinit(&bd, true);
+	}
+}
+
+static void run_warm_relayout(BenchDocument *bd, const BenchOptions *options,
+	ScenarioTimings *t)
+{
+	for (unsigned i = 0; i < options->iterations; ++i) {
+		invalidate_all_nodes(bd->document);
+		timings_add_run(t, bench_update(bd, t));
+	}
+}
+
+static void run_resize(BenchDocument *bd, const BenchOptions *options,
+	ScenarioTimings *t)
+{
+	for (unsigned i = 0; i < options->iterations; ++i) {
+		for (unsigned width = RESIZE_SWEEP_MIN; width <= RESIZE_SWEEP_MAX;
+			width += RESIZE_SWEEP_STEP) {
+			set_root_dimension(bd->document, AXIS_H, width);
+			set_view_bounds(bd->view, 0.0f, (float)width, 0.0f,
+				(float)DEFAULT_VIEW_HEIGHT);
+			timings_add_run(t, bench_update(bd, t));
+		}
+	}
+	set_root_dimension(bd->document, AXIS_H, options->width);
+	set_view_bounds(bd->view, 0.0f, (float)options->width, 0.0f,
+		(float)DEFAULT_VIEW_HEIGHT);
+	update_document(bd->document);
+	update_view(bd->view);
+}
+
+static void run_mutation(BenchDocument *bd, const BenchOptions *options,
+	ScenarioTimings *t)
+{
+	Node *target = choose_mutation_target(bd->document);
+	for (unsigned i = 0; i < options->iterations; ++i) {
+		set_integer_attribute(bd->document, target, TOKEN_BOLD,
+			VSEM_BOOLEAN, (i & 1) == 0);
+		timings_add_run(t, bench_update(bd, t));
+	}
+}
+
+static void json_string(FILE *os, const char *s)
+{
+	fputc('"', os);
+	for (; *s != '\0'; ++s) {
+		if (*s == '"' || *s == '\\')
+			fputc('\\', os);
+		if ((unsigned char)*s < 0x20)
+			fprintf(os, "\\u%04x", (unsigned char)*s);
+		else
+			fputc(*s, os);
+	}
+	fputc('"', os);
+}
+
+/* Writes the work counters for an update. */
+static void json_update_stats(FILE *os, const UpdateStats *us)
+{
+	static const struct {
+		const char *name;
+		unsigned UpdateStats::*field;
+	} COUNTERS[] = {
+		{ "pre_layout_nodes_visited",  &UpdateStats::pre_layout_nodes_visited  },
+		{ "post_layout_nodes_visited", &UpdateStats::post_layout_nodes_visited },
+		{ "rules_matched",             &UpdateStats::rules_matched             },
+		{ "rules_rejected",            &UpdateStats::rules_rejected            },
+		{ "rules_filtered",            &UpdateStats::rules_filtered            },
+		{ "rules_shared",              &UpdateStats::rules_shared              },
+		{ "rules_invalidated",         &UpdateStats::rules_invalidated         },
+		{ "attribute_folds",           &UpdateStats::attribute_folds           },
+		{ "folds_shared",              &UpdateStats::folds_shared              },
+		{ "folds_cached",              &UpdateStats::folds_cached              },
+		{ "boxes_created",             &UpdateStats::boxes_created             },
+		{ "boxes_destroyed",           &UpdateStats::boxes_destroyed           },
+		{ "sizing_frame_pushes",       &UpdateStats::sizing_frame_pushes       },
+		{ "text_measurements",         &UpdateStats::text_measurements         },
+		{ "characters_measured",       &UpdateStats::characters_measured       },
+		{ "breakpoints_evaluated",     &UpdateStats::breakpoints_evaluated     },
+		{ "lines_rebuilt",             &UpdateStats::lines_rebuilt             },
+		{ "grid_inserts",              &UpdateStats::grid_inserts              },
+		{ "grid_removals",             &UpdateStats::grid_removals             },
+		{ "draw_commands",             &UpdateStats::draw_commands             }
+	};
+	static const unsigned NUM_COUNTERS = sizeof(COUNTERS) / sizeof(COUNTERS[0]);
+	fprintf(os, "{");
+	for (unsigned i = 0; i < NUM_COUNTERS; ++i) {
+		fprintf(os, "%s\"%s\": %u", i != 0 ? ", " : " ", COUNTERS[i].name,
+			us->*COUNTERS[i].field);
+	}
+	fprintf(os, " }");
+}
+
+/* Writes the allocator counters of each of a document's pools. */
+static void json_pool_stats(FILE *os, const PoolStats *stats)
+{
+	static const char * const POOL_NAMES[NUM_DOCUMENT_POOLS] = {
+		"nodes", "boxes", "layers"
+	};
+	fprintf(os, "{");
+	for (unsigned i = 0; i < NUM_DOCUMENT_POOLS; ++i) {
+		const PoolStats *ps = stats + i;
+		fprintf(os, "%s\"%s\": { \"live_blocks\": %u, \"peak_blocks\": %u, "
+			"\"chunks\": %u, \"allocations\": %u, \"recycled\": %u, "
+			"\"heap_blocks\": %u }", i != 0 ? ", " : " ", POOL_NAMES[i],
+			ps->live_blocks, ps->peak_blocks, ps->chunks, ps->allocations,
+			ps->recycled, ps->heap_blocks);
+	}
+	fprintf(os, " }");
+}
+
+/* Writes the per-run mean of each timing. */
+static void json_scenario(FILE *os, const char *name, const ScenarioTimings *t,
+	bool last)
+{
+	double scale = t->runs != 0 ? 1.0 / t->runs : 0.0;
+	fprintf(os, "        \"%s\": {\n", name);
+	fprintf(os, "          \"runs\": %u,\n", t->runs);
+	fprintf(os, "          \"parse_us\": %.3f,\n", t->parse_us * scale);
+	fprintf(os, "          \"stages_us\": {");
+	for (unsigned i = 0; i < USTG_COMPLETE; ++i) {
+		fprintf(os, "%s\"%s\": %.3f", i != 0 ? ", " : " ", STAGE_NAMES[i],
+			t->stage_us[i] * scale);
+	}
+	fprintf(os, " },\n");
+	fprintf(os, "          \"view_us\": %.3f,\n", t->view_us * scale);
+	fprintf(os, "          \"total_us\": %.3f,\n", t->total_us * scale);
+	fprintf(os, "          \"min_total_us\": %.3f\n",
+		t->min_total_us > 0.0 ? t->min_total_us : 0.0);
+	fprintf(os, "        }%s\n", last ? "" : ",");
+}
+
+/* Runs every scenario on a document and writes a JSON object describing the
+ * results. Returns false if the document could not be parsed. */
+static bool bench_source(FILE *os, BackEnd *back_end,
+	const BenchOptions *options, const char *name, const char *source,
+	unsigned length, bool first)
+{
+	ScenarioTimings cold, warm, resize, mutation;
+	timings_init(&cold);
+	timings_init(&warm);
+	timings_init(&resize);
+	timings_init(&mutation);
+
+	/* The remaining scenarios share a document that has already been laid
+	 * out once. */
+	BenchDocument bd;
+	ScenarioTimings initial;
+	timings_init(&initial);
+	bench_document_init(&bd, back_end, NULL, options);
+	int code = bench_parse(&bd, &initial, source, length);
+	if (code != STKR_OK) {
+		fprintf(stderr, "%s: parse() returned %d.\n", name, code);
+		bench_document_deinit(&bd, true);
+		return false;
+	}
+	bench_update(&bd, &initial);
+	unsigned num_nodes = get_total_nodes(bd.system);
+	unsigned num_boxes = get_total_boxes(bd.system);
+	UpdateStats initial_stats = *get_update_stats(bd.document);
+
+	run_cold_start(back_end, options, source, length, &cold);
+	run_warm_relayout(&bd, options, &warm);
+	run_resize(&bd, options, &resize);
+	run_mutation(&bd, options, &mutation);
+	PoolStats pool_stats[NUM_DOCUMENT_POOLS];
+	for (unsigned i = 0; i < NUM_DOCUMENT_POOLS; ++i)
+		get_pool_stats(bd.document, (DocumentPool)i, pool_stats + i);
+	bench_document_deinit(&bd, true);
+
+	fprintf(os, "%s    {\n", first ? "" : ",\n");
+	fprintf(os, "      \"name\": ");
+	json_string(os, name);
+	fprintf(os, ",\n      \"bytes\": %u,\n", length);
+	fprintf(os, "      \"nodes\": %u,\n", num_nodes);
+	fprintf(os, "      \"boxes\": %u,\n", num_boxes);
+	fprintf(os, "      \"update_stats\": ");
+	json_update_stats(os, &initial_stats);
+	fprintf(os, ",\n");
+	fprintf(os, "      \"pools\": ");
+	json_pool_stats(os, pool_stats);
+	fprintf(os, ",\n");
+	fprintf(os, "      \"scenarios\": {\n");
+	json_scenario(os, "cold_start", &cold, false);
+	json_scenario(os, "warm_relayout", &warm, false);
+	json_scenario(os, "resize", &resize, false);
+	json_scenario(os, "mutation", &mutation, true);
+	fprintf(os, "      }\n    }");
+	return true;
+}
+
+/* Measures cold start time and memory use for one generated document. */
+static void bench_scaling_point(FILE *os, BackEnd *back_end,
+	const BenchOptions *options, const GeneratorParams *params, unsigned value,
+	bool first)
+{
+	unsigned length;
+	char *source = generate_document(params, &length);
+
+	ScenarioTimings t;
+	timings_init(&t);
+	unsigned num_nodes = 0, num_boxes = 0;
+	size_t peak_bytes = 0, retained_bytes = 0;
+	for (unsigned i = 0; i < options->iterations; ++i) {
+		size_t base_bytes = g_live_bytes.load();
+		g_peak_bytes.store(base_bytes);
+		BenchDocument bd;
+		BenchClock::time_point start = BenchClock::now();
+		bench_document_init(&bd, back_end, NULL, options);
+		bench_parse(&bd, &t, source, length);
+		bench_update(&bd, &t);
+		timings_add_run(&t, elapsed_us(start, BenchClock::now()));
+		num_nodes = get_total_nodes(bd.system);
+		num_boxes = get_total_boxes(bd.system);
+		retained_bytes = g_live_bytes.load() - base_bytes;
+		peak_bytes = std::max(peak_bytes, g_peak_bytes.load() - base_bytes);
+		bench_document_deinit(&bd, true);
+	}
+	delete [] source;
+
+	double scale = t.runs != 0 ? 1.0 / t.runs : 0.0;
+	fprintf(os, "%s        { \"value\": %u, \"bytes\": %u, \"nodes\": %u, "
+		"\"boxes\": %u,\n", first ? "" : ",\n", value, length, num_nodes,
+		num_boxes);
+	fprintf(os, "          \"parse_us\": %.3f, \"stages_us\": {",
+		t.parse_us * scale);
+	for (unsigned i = 0; i < USTG_COMPLETE; ++i) {
+		fprintf(os, "%s\"%s\": %.3f", i != 0 ? ", " : " ", STAGE_NAMES[i],
+			t.stage_us[i] * scale);
+	}
+	fprintf(os, " },\n");
+	fprintf(os, "          \"view_us\": %.3f, \"total_us\": %.3f, "
+		"\"min_total_us\": %.3f,\n", t.view_us * scale, t.total_us * scale,
+		t.min_total_us > 0.0 ? t.min_total_us : 0.0);
+	fprintf(os, "          \"peak_memory\": %zu, \"retained_memory\": %zu }",
+		peak_bytes, retained_bytes);
+}
+
+/* Sweeps one generator parameter, holding the others at their defaults. */
+static void bench_sweep(FILE *os, BackEnd *back_end,
+	const BenchOptions *options, const ParameterSweep *sweep, bool first)
+{
+	const GeneratorParameter *parameter = find_generator_parameter(sweep->name);
+	fprintf(os, "%s    {\n      \"parameter\": ", first ? "" : ",\n");
+	json_string(os, sweep->name);
+	fprintf(os, ",\n      \"points\": [\n");
+	bool doubling = (parameter->field == &GeneratorParams::num_nodes);
+	for (unsigned i = 0; i < MAX_SWEEP_VALUES; ++i) {
+		unsigned value = doubling ? sweep->values[0] << i : sweep->values[i];
+		if (doubling ? value > options->max_nodes : (i != 0 && value == 0))
+			break;
+		GeneratorParams params;
+		init_generator_params(&params);
+		params.*parameter->field = value;
+		bench_scaling_point(os, back_end, options, &params, value, i == 0);
+		fflush(os);
+	}
+	fprintf(os, "\n      ]\n    }");
+}
+
+/* Writes the settings shared by every result in a report. */
+static void print_header(FILE *os, const BenchOptions *options)
+{
+	fprintf(os, "{\n  \"iterations\": %u,\n  \"width\": %u,\n",
+		options->iterations, options->width);
+	fprintf(os, "  \"parallel_parse\": %s,\n  \"hardware_threads\": %u,\n",
+		options->parallel_parse ? "true" : "false", 
+		std::thread::hardware_concurrency());
+}
+
+static int bench_scaling(FILE *os, BackEnd *back_end,
+	const BenchOptions *options)
+{
+	bool all = 0 == strcmp(options->sweep, "all");
+	print_header(os, options);
+	fprintf(os, "  \"sweeps\": [\n");
+	bool first = true;
+	for (unsigned i = 0; i < NUM_PARAMETER_SWEEPS; ++i) {
+		if (!all && 0 != strcmp(options->sweep, PARAMETER_SWEEPS[i].name))
+			continue;
+		bench_sweep(os, back_end, options, PARAMETER_SWEEPS + i, first);
+		first = false;
+	}
+	fprintf(os, "\n  ]\n}\n");
+	return first ? 1 : 0;
+}
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: stacker_bench [-i iterations] [-w width] "
+		"[-d directory] [-o output.json] [files...]\n"
+		"       stacker_bench -s parameter|all [-n max_nodes] [-i iterations] "
+		"[-w width] [-o output.json]\n"
+		"Options: [-u slice_us] [-t trace.json] [-p 0|1]\n");
+}
+
+static int bench_main(int argc, char **argv)
+{
+	BenchOptions options;
+	options.iterations = DEFAULT_ITERATIONS;
+	options.width = DEFAULT_ROOT_WIDTH;
+	options.directory = DEFAULT_SAMPLE_DIRECTORY;
+	options.output_path = NULL;
+	options.sweep = NULL;
+	options.max_nodes = DEFAULT_SCALING_MAX_NODES;
+	options.slice_us = 0;
+	options.trace_path = NULL;
+	options.parallel_parse = false;
+	bool iterations_given = false;
+
+	std::vector<std::string> paths;
+	for (int i = 1; i < argc; ++i) {
+		const char *arg = argv[i];
+		if (arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0') {
+			if (i + 1 == argc) {
+				print_usage();
+				return 1;
+			}
+			const char *value = argv[++i];
+			switch (arg[1]) {
+				case 'i':
+					options.iterations = (unsigned)atoi(value);
+					iterations_given = true;
+					break;
+				case 'w':
+					options.width = (unsigned)atoi(value);
+					break;
+				case 'd':
+					options.directory = value;
+					break;
+				case 'o':
+					options.output_path = value;
+					break;
+				case 's':
+					options.sweep = value;
+					break;
+				case 'n':
+					options.max_nodes = (unsigned)atoi(value);
+					break;
+				case 'u':
+					options.slice_us = (unsigned)atoi(value);
+					break;
+				case 't':
+					options.trace_path = value;
+					break;
+				case 'p':
+					options.parallel_parse = atoi(value) != 0;
+					break;
+				default:
+					print_usage();
+					return 1;
+			}
+		} else {
+			paths.push_back(arg);
+		}
+	}
+	if (options.sweep != NULL) {
+		if (!iterations_given)
+			options.iterations = DEFAULT_SCALING_ITERATIONS;
+	} else if (paths.empty()) {
+		list_samples(options.directory, &paths);
+	}
+	if (options.sweep == NULL && paths.empty()) {
+		fprintf(stderr, "No documents found in %s.\n", options.directory);
+		return 1;
+	}
+
+	FILE *os = stdout;
+	if (options.output_path != NULL) {
+		os = fopen(options.output_path, "w");
+		if (os == NULL) {
+			fprintf(stderr, "Can't open %s for writing.\n", options.output_path);
+			return 1;
+		}
+	}
+
+	if (options.trace_path != NULL) {
+		g_trace_writer.os = fopen(options.trace_path, "w");
+		if (g_trace_writer.os == NULL) {
+			fprintf(stderr, "Can't open %s for writing.\n", options.trace_path);
+			return 1;
+		}
+	}
+
+	BackEnd *back_end = headless_init();
+	if (options.sweep != NULL) {
+		int result = bench_scaling(os, back_end, &options);
+		if (result != 0)
+			fprintf(stderr, "Unknown sweep parameter %s.\n", options.sweep);
+		headless_deinit(back_end);
+		close_trace(&g_trace_writer);
+		if (os != stdout)
+			fclose(os);
+		return result;
+	}
+	print_header(os, &options);
+	fprintf(os, "  \"documents\": [\n");
+	bool first = true;
+	int result = 0;
+	for (unsigned i = 0; i < paths.size(); ++i) {
+		char *source;
+		unsigned length;
+		if (!load_file(paths[i].c_str(), &source, &length)) {
+			fprintf(stderr, "Can't read %s.\n", paths[i].c_str());
+			result = 1;
+			continue;
+		}
+		if (bench_source(os, back_end, &options, paths[i].c_str(),
+			source, length, first))
+			first = false;
+		else
+			result = 1;
+		delete [] source;
+	}
+	fprintf(os, "\n  ]\n}\n");
+	headless_deinit(back_end);
+	close_trace(&g_trace_writer);
+
+	if (os != stdout)
+		fclose(os);
+	return result;
+}
+
+} // namespace stkr
+
+int main(int argc, char **argv)
+{
+	return stkr::bench_main(argc, argv);
+}
+
+#endif // defined(STACKER_BENCH)
@@ -462,18 +462,18 @@ void remove_all_children(Document *document, Box *parent)
 	box_notify_child_added_or_removed(document, parent, NULL, true);
 }
 
+/* Boxes are allocated from a document arena that holds nothing else, so 
+ * that boxes created together are contiguous in memory. */
+static const unsigned BOX_SIZE_CLASS = arena_size_class(sizeof(Box));
+
 Box *create_box(Document *document, Node *owner)
 {
 	document->system->total_boxes++;
+	document->update_stats.boxes_created++;
 	
-	Box *box = document->free_boxes;
-	if (box != NULL) {
-		document->free_boxes = box->t.next.box;
-		box->t.next.box = NULL;
-		memset(box, 0, sizeof(Box));
-	} else {
-		box = new Box();
-	}
+	Box *box = (Box *)arena_allocate(&document->box_arena, 
+		BOX_SIZE_CLASS, sizeof(Box));
+	memset(box, 0, sizeof(Box));
 
 	tree_init(&box->t, TREEFLAG_IS_BOX);
 	box->t.counterpart.node = owner;
@@ -544,11 +544,11 @@ static void initialize_dimensions(Document *document, Box *box)
 void destroy_box_internal(Document *document, Box *box)
 {
 	document->system->total_boxes--;
+	document->update_stats.boxes_destroyed++;
 	document_notify_box_destroy(document, box);
 	release_layer_chain(document, VLCHAIN_BOX, box->layers);
 	grid_remove(document, box); 
-	box->t.next.box = document->free_boxes;
-	document->free_boxes = box;
+	arena_free(&document->box_arena, box, BOX_SIZE_CLASS);
 }
 
 void destroy_box_tree(Document *document, Box *box)
@@ -588,10 +588,21 @@ void destroy_box(Document *document, Box *box, bool destroy_children)
 	}
 }
 
+/* True if two box axes differ in any of the edge and limit values that 
+ * configure_container_box() reads from node attributes. */
+static bool edges_or_limits_differ(const BoxAxis *a, const BoxAxis *b)
+{
+	return a->pad_lower != b->pad_lower || a->pad_upper != b->pad_upper ||
+		a->margin_lower != b->margin_lower || 
+		a->margin_upper != b->margin_upper ||
+		a->min != b->min || a->max != b->max;
+}
+
 /* Synchronizes the properties of a block or inline container box with the 
  * attributes of the node that owns it. */
 void configure_container_box(Document *document, Node *node, Axis axis, Box *box)
 {
+	BoxAxis old_axes[2] = { box->axes[AXIS_H], box->axes[AXIS_V] };
 	box->axes[AXIS_H].mode_min          = (unsigned char)read_as_float(node, TOKEN_MIN_WIDTH, &box->axes[AXIS_H].min, 0.0f);
 	box->axes[AXIS_V].mode_min          = (unsigned char)read_as_float(node, TOKEN_MIN_HEIGHT, &box->axes[AXIS_V].min, 0.0f);
 	box->axes[AXIS_H].mode_max          = (unsigned char)read_as_float(node, TOKEN_MAX_WIDTH, &box->axes[AXIS_H].max, FLT_MAX);
@@ -621,6 +632,12 @@ void configure_container_box(Document *document, Node *node, Axis axis, Box *box
 	set_ideal_size(document, box, AXIS_H, mode_width, ideal_width);
 	set_ideal_size(document, box, AXIS_V, mode_height, ideal_height);
 
+	/* Sizes are computed net of padding and margins and within the limits, so
+	 * they are stale if any of these have changed, even if the ideal hasn't. */
+	for (Axis a = AXIS_H; a <= AXIS_V; a = Axis(a + 1))
+		if (edges_or_limits_differ(old_axes + a, box->axes + a))
+			clear_flags(document, box, a, axisflag(a, AXISFLAG_ALL_VALID_MASK));
+
 	set_box_dimensions_from_image(document, node, box);
 	node->t.flags |= NFLAG_UPDATE_SELECTION_LAYERS | NFLAG_UPDATE_BOX_LAYERS;
 
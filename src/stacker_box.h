@@ -154,31 +154,33 @@ struct BoxAxis {
 	float max;
 };
 
+/* Fields are ordered by how often the layout passes touch them. The tree 
+ * links, flags and axes come first, so that the sizing and bounds passes, 
+ * which visit every box, read as few cache lines as possible. Fields used only
+ * by hit testing, the grid and diagnostics are at the end. */
 struct Box {
+	/* Hot: read by every layout pass. */
 	Tree t;
-
 	unsigned layout_flags;
-
-	unsigned cell_code;
-	Box *cell_prev;
-	Box *cell_next;
-
-	Box *clip_ancestor;
-	float clip[4];
-	float growth[2];
-
 	BoxAxis axes[2];
+	float growth[2];
 
-	uint32_t visibility_stamp;
-	uint32_t mouse_hit_stamp;
+	/* Warm: inline layout, clipping and view building. */
+	unsigned line_number;
+	unsigned first_element;
+	unsigned last_element;
 	uint16_t depth_interval;
 	uint16_t depth;	
-
+	Box *clip_ancestor;
+	float clip[4];
 	struct VisualLayer *layers;
 
-	unsigned line_number;
-	unsigned first_element;
-	unsigned last_element;
+	/* Cold: the grid, hit testing and diagnostics. */
+	unsigned cell_code;
+	uint32_t visibility_stamp;
+	uint32_t mouse_hit_stamp;
+	Box *cell_prev;
+	Box *cell_next;
 
 #if defined(STACKER_DIAGNOSTICS)
 	char debug_info[64];
@@ -0,0 +1,378 @@
+#include "stacker_compiled.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+
+#include "stacker.h"
+#include "stacker_shared.h"
+#include "stacker_attribute_buffer.h"
+#include "stacker_node.h"
+#include "stacker_rule.h"
+#include "stacker_token.h"
+#include "stacker_platform.h"
+#include "stacker_document.h"
+#include "stacker_system.h"
+
+namespace stkr {
+
+/* Rule flags that are carried over to the loaded rule. The table flags are
+ * set again when the rule is added. */
+static const unsigned COMPILED_RULE_FLAGS = RFLAG_ENABLED | RFLAG_MODIFIES_CLASS;
+
+struct CompiledWriter {
+	char *data;
+	unsigned size;
+	unsigned capacity;
+};
+
+inline unsigned compiled_record_size(unsigned size)
+{
+	return (size + 7) & ~7u;
+}
+
+/* Reserves space for a record of 'size' bytes at the end of the output and
+ * returns a pointer to it. The padding is zeroed so that equal documents
+ * compile to equal bytes. */
+static char *compiled_append(CompiledWriter *writer, unsigned size)
+{
+	unsigned padded = compiled_record_size(size);
+	unsigned required = writer->size + padded;
+	if (required > writer->capacity) {
+		unsigned new_capacity = writer->capacity != 0 ? writer->capacity : 4096;
+		while (new_capacity < required)
+			new_capacity *= 2;
+		char *new_data = new char[new_capacity];
+		if (writer->data != NULL) {
+			memcpy(new_data, writer->data, writer->size);
+			delete [] writer->data;
+		}
+		writer->data = new_data;
+		writer->capacity = new_capacity;
+	}
+	char *record = writer->data + writer->size;
+	memset(record + size, 0, padded - size);
+	writer->size = required;
+	return record;
+}
+
+static void write_compiled_rule(CompiledWriter *writer, const Rule *rule)
+{
+	unsigned keys_size = rule->total_keys * sizeof(uint64_t);
+	unsigned clauses_size = rule->num_selectors * sizeof(uint32_t);
+	unsigned attributes_size = (unsigned)rule->attributes.size;
+	unsigned size = sizeof(CompiledRule) + keys_size + clauses_size +
+		attributes_size;
+	char *block = compiled_append(writer, size);
+	CompiledRule *record = (CompiledRule *)block;
+	record->size = compiled_record_size(size);
+	record->priority = get_rule_priority(rule);
+	record->flags = rule->flags & COMPILED_RULE_FLAGS;
+	record->total_keys = rule->total_keys;
+	record->num_clauses = rule->num_selectors;
+	record->attributes_size = attributes_size;
+	record->num_attributes = rule->attributes.num_attributes;
+	block += sizeof(CompiledRule);
+	memcpy(block, rule->keys, keys_size);
+	block += keys_size;
+	for (unsigned i = 0; i < rule->num_selectors; ++i) {
+		uint32_t num_keys = rule->selectors[i].num_keys;
+		memcpy(block, &num_keys, sizeof(uint32_t));
+		block += sizeof(uint32_t);
+	}
+	memcpy(block, rule->attributes.buffer, attributes_size);
+}
+
+static void write_compiled_node(CompiledWriter *writer, const Node *node)
+{
+	unsigned keys_size = node->num_rule_keys * sizeof(uint64_t);
+	unsigned attributes_size = (unsigned)node->attributes.size;
+	unsigned size = sizeof(CompiledNode) + keys_size + attributes_size +
+		node->text_length;
+	char *block = compiled_append(writer, size);
+	CompiledNode *record = (CompiledNode *)block;
+	record->size = compiled_record_size(size);
+	record->num_children = tree_count_children(&node->t);
+	record->type = node->type;
+	record->token = node->token;
+	record->num_rule_keys = node->num_rule_keys;
+	record->attributes_size = attributes_size;
+	record->num_attributes = node->attributes.num_attributes;
+	record->text_length = node->text_length;
+	block += sizeof(CompiledNode);
+	memcpy(block, node->rule_keys, keys_size);
+	block += keys_size;
+	memcpy(block, node->attributes.buffer, attributes_size);
+	block += attributes_size;
+	memcpy(block, node->text, node->text_length);
+}
+
+/* Serializes the children of 'root' and the document's rules. Global rules
+ * live in the system's table and are not included. The result is allocated
+ * with new [] and is 8-byte aligned. */
+int compile_document(const Document *document, const Node *root,
+	char **out_data, unsigned *out_size)
+{
+	CompiledWriter writer = { NULL, 0, 0 };
+	compiled_append(&writer, sizeof(CompiledHeader));
+
+	/* The table has an entry per selector key. Write each rule once, in
+	 * document order, which is descending order of priority key. */
+	std::vector<const Rule *> rules;
+	const RuleTable *table = &document->rules;
+	for (unsigned i = 0; i < table->capacity; ++i) {
+		Selector * const *selectors = rule_table_selectors(table->slots + i);
+		for (unsigned j = 0; j < table->slots[i].count; ++j)
+			rules.push_back(selectors[j]->rule);
+	}
+	struct {
+		bool operator () (const Rule *a, const Rule *b) const
+			{ return a->priority != b->priority ? 
+				a->priority > b->priority : a < b; }
+	} document_order;
+	std::sort(rules.begin(), rules.end(), document_order);
+	rules.erase(std::unique(rules.begin(), rules.end()), rules.end());
+	for (unsigned i = 0; i < rules.size(); ++i)
+		write_compiled_rule(&writer, rules[i]);
+
+	/* Write the nodes in preorder. */
+	unsigned num_nodes = 0;
+	const Tree *tree = root->t.first.tree;
+	while (tree != NULL) {
+		write_compiled_node(&writer, (const Node *)tree);
+		num_nodes++;
+		tree = tree_next(&root->t, tree);
+	}
+
+	CompiledHeader *header = (CompiledHeader *)writer.data;
+	header->magic = COMPILED_MAGIC;
+	header->version = COMPILED_VERSION;
+	header->attribute_header_size = sizeof(Attribute);
+	header->size = writer.size;
+	header->num_rules = (uint32_t)rules.size();
+	header->num_nodes = num_nodes;
+	header->num_top_level_nodes = tree_count_children(&root->t);
+	*out_data = writer.data;
+	*out_size = writer.size;
+	return STKR_OK;
+}
+
+/* Compiles a document into a file. */
+int save_compiled_document(const Document *document, const Node *root,
+	const char *path)
+{
+	char *data = NULL;
+	unsigned size = 0;
+	int rc = compile_document(document, root, &data, &size);
+	if (rc != STKR_OK)
+		return rc;
+	FILE *file = fopen(path, "wb");
+	if (file != NULL) {
+		if (fwrite(data, 1, size, file) != size)
+			rc = STKR_FILE_ERROR;
+		if (fclose(file) != 0)
+			rc = STKR_FILE_ERROR;
+	} else {
+		rc = STKR_FILE_ERROR;
+	}
+	delete [] data;
+	return rc;
+}
+
+/* Checks that a rule record and the keys, clause lengths and attributes it
+ * contains lie within the 'available' bytes that remain in the data. */
+static int check_compiled_rule(const CompiledRule *record, unsigned available)
+{
+	if (available < sizeof(CompiledRule) || record->size > available || 
+		(record->size & 7) != 0)
+		return STKR_INVALID_INPUT;
+	if (record->total_keys > MAX_SELECTOR_KEYS ||
+		record->num_clauses > MAX_SELECTOR_CLAUSES ||
+		record->num_clauses == 0)
+		return STKR_INVALID_INPUT;
+	uint64_t size = sizeof(CompiledRule) +
+		record->total_keys * sizeof(uint64_t) +
+		record->num_clauses * sizeof(uint32_t) + 
+		(uint64_t)record->attributes_size;
+	if (size > record->size)
+		return STKR_INVALID_INPUT;
+	const uint32_t *keys_per_clause = (const uint32_t *)((const char *)
+		(record + 1) + record->total_keys * sizeof(uint64_t));
+	uint64_t total_keys = 0;
+	for (unsigned i = 0; i < record->num_clauses; ++i)
+		total_keys += keys_per_clause[i];
+	if (total_keys != record->total_keys)
+		return STKR_INVALID_INPUT;
+	return STKR_OK;
+}
+
+/* Checks that a node record and the keys, attributes and text it contains lie
+ * within the 'available' bytes that remain in the data, and that its type and
+ * token are in range. */
+static int check_compiled_node(const CompiledNode *record, unsigned available)
+{
+	if (available < sizeof(CompiledNode) || record->size > available || 
+		(record->size & 7) != 0)
+		return STKR_INVALID_INPUT;
+	if (record->type >= NUM_NODE_TYPES || record->token >= NUM_TOKENS ||
+		record->num_rule_keys > MAX_NODE_RULE_KEYS)
+		return STKR_INVALID_INPUT;
+	uint64_t size = sizeof(CompiledNode) + 
+		record->num_rule_keys * sizeof(uint64_t) +
+		(uint64_t)record->attributes_size + record->text_length;
+	if (size > record->size)
+		return STKR_INVALID_INPUT;
+	return STKR_OK;
+}
+
+/* Checks every record in a compiled document, and that the child counts of
+ * the node records describe a single forest with the stated number of top 
+ * level nodes, before anything is added to the document. */
+static int check_compiled_document(const CompiledHeader *header, 
+	const char *pos, const char *end)
+{
+	for (unsigned i = 0; i < header->num_rules; ++i) {
+		const CompiledRule *record = (const CompiledRule *)pos;
+		int rc = check_compiled_rule(record, unsigned(end - pos));
+		if (rc != STKR_OK)
+			return rc;
+		pos += record->size;
+	}
+	std::vector<unsigned> remaining(1, header->num_top_level_nodes);
+	for (unsigned i = 0; i < header->num_nodes; ++i) {
+		while (!remaining.empty() && remaining.back() == 0)
+			remaining.pop_back();
+		if (remaining.empty())
+			return STKR_INVALID_INPUT;
+		const CompiledNode *record = (const CompiledNode *)pos;
+		int rc = check_compiled_node(record, unsigned(end - pos));
+		if (rc != STKR_OK)
+			return rc;
+		remaining.back()--;
+		if (record->num_children != 0)
+			remaining.push_back(record->num_children);
+		pos += record->size;
+	}
+	for (unsigned i = 0; i < remaining.size(); ++i) {
+		if (remaining[i] != 0)
+			return STKR_INVALID_INPUT;
+	}
+	return pos == end ? STKR_OK : STKR_INVALID_INPUT;
+}
+
+/* Adds a rule from a record that has passed check_compiled_rule(). */
+static int load_compiled_rule(Document *document, const CompiledRule *record)
+{
+	const char *block = (const char *)(record + 1);
+	ParsedSelector ps;
+	ps.total_keys = record->total_keys;
+	ps.num_clauses = record->num_clauses;
+	memcpy(ps.keys, block, ps.total_keys * sizeof(uint64_t));
+	block += ps.total_keys * sizeof(uint64_t);
+	memcpy(ps.keys_per_clause, block, ps.num_clauses * sizeof(uint32_t));
+	block += ps.num_clauses * sizeof(uint32_t);
+	AttributeBuffer attributes;
+	attributes.buffer = const_cast<char *>(block);
+	attributes.size = (int)record->attributes_size;
+	attributes.capacity = 0;
+	attributes.num_attributes = record->num_attributes;
+	return add_packed_rule(NULL, document->system, document, &ps, &attributes,
+		record->flags & COMPILED_RULE_FLAGS, record->priority);
+}
+
+/* Creates a node from a record that has passed check_compiled_node(). */
+static int load_compiled_node(Node **result, Document *document,
+	const CompiledNode *record)
+{
+	unsigned keys_size = record->num_rule_keys * sizeof(uint64_t);
+	const char *block = (const char *)(record + 1);
+	return create_compiled_node(
+		result,
+		document,
+		(NodeType)record->type,
+		record->token,
+		block + keys_size,
+		record->attributes_size,
+		record->num_attributes,
+		(const uint64_t *)block,
+		record->num_rule_keys,
+		block + keys_size + record->attributes_size,
+		record->text_length);
+}
+
+/* Adds the rules and nodes of a compiled document to a document, appending
+ * the top level nodes to 'root'. The data must be 8-byte aligned. Data that 
+ * isn't a compiled document of this version is rejected with 
+ * STKR_INVALID_BINARY. The records are then checked to lie within the data 
+ * and to describe a well formed tree, and if any does not, STKR_INVALID_INPUT
+ * is returned without changing the document. Attribute and key contents are
+ * trusted to be the output of compile_document(). */
+int load_compiled_document(Document *document, Node *root, const void *data,
+	unsigned size)
+{
+	if (root == NULL || root->document != document)
+		return STKR_INCORRECT_CONTEXT;
+	const CompiledHeader *header = (const CompiledHeader *)data;
+	if (((uintptr_t)data & 7) != 0 || size < sizeof(CompiledHeader) ||
+		header->magic != COMPILED_MAGIC ||
+		header->version != COMPILED_VERSION ||
+		header->attribute_header_size != sizeof(Attribute) ||
+		header->size != size)
+		return STKR_INVALID_BINARY;
+	const char *pos = (const char *)data + sizeof(CompiledHeader);
+	const char *end = (const char *)data + size;
+	int rc = check_compiled_document(header, pos, end);
+	if (rc != STKR_OK)
+		return rc;
+
+	/* Add the rules in document order. */
+	for (unsigned i = 0; i < header->num_rules; ++i) {
+		const CompiledRule *record = (const CompiledRule *)pos;
+		rc = load_compiled_rule(document, record);
+		if (rc < 0)
+			return rc;
+		pos += record->size;
+	}
+
+	/* Build the tree. Each node is appended to its parent before its
+	 * children are created, as the parser does. */
+	struct LoadFrame {
+		Node *node;
+		unsigned remaining;
+	};
+	std::vector<LoadFrame> stack;
+	LoadFrame top = { root, header->num_top_level_nodes };
+	stack.push_back(top);
+	for (unsigned i = 0; i < header->num_nodes; ++i) {
+		while (stack.back().remaining == 0)
+			stack.pop_back();
+		const CompiledNode *record = (const CompiledNode *)pos;
+		Node *node = NULL;
+		rc = load_compiled_node(&node, document, record);
+		if (rc < 0)
+			return rc;
+		stack.back().remaining--;
+		append_child(document, stack.back().node, node);
+		if (record->num_children != 0) {
+			LoadFrame frame = { node, record->num_children };
+			stack.push_back(frame);
+		}
+		pos += record->size;
+	}
+	return STKR_OK;
+}
+
+/* Loads a compiled document from a memory mapped file. */
+int load_compiled_document(Document *document, Node *root, const char *path)
+{
+	MappedFile file;
+	if (!platform_map_file(&file, path))
+		return STKR_FILE_ERROR;
+	int rc = load_compiled_document(document, root, file.data, file.size);
+	platform_unmap_file(&file);
+	return rc;
+}
+
+} // namespace stkr
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+
+namespace stkr {
+
+/* A compiled document is a node tree and its rules, serialized after parsing
+ * so that it can be loaded without tokenizing or validating anything. Node
+ * attributes are stored as packed attribute buffers, and node rule keys and
+ * rule selectors are stored hashed. The layout is native to the build that
+ * wrote it. The magic number fails to match on a machine of the other byte
+ * order, and the header records the size of the packed attribute header, so
+ * a file written by an incompatible build is rejected.
+ *
+ * The header is followed by the rule records in document order, then the node
+ * records in preorder. Each record starts on an 8-byte boundary. */
+
+const uint32_t COMPILED_MAGIC   = 0x424B5453; /* "STKB" */
+const uint16_t COMPILED_VERSION = 1;
+
+struct CompiledHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t attribute_header_size; /* sizeof(Attribute). */
+	uint32_t size;                 /* Total size in bytes. */
+	uint32_t num_rules;
+	uint32_t num_nodes;
+	uint32_t num_top_level_nodes;  /* Nodes that are children of the root. */
+};
+
+/* Followed by uint64_t keys[total_keys], uint32_t keys_per_clause[num_clauses]
+ * and the packed attributes. */
+struct CompiledRule {
+	uint32_t size;                 /* Size of the record including padding. */
+	int32_t priority;
+	uint32_t flags;
+	uint16_t total_keys;
+	uint16_t num_clauses;
+	uint32_t attributes_size;
+	uint32_t num_attributes;
+};
+
+/* Followed by uint64_t rule_keys[num_rule_keys], the packed attributes and
+ * the text. */
+struct CompiledNode {
+	uint32_t size;                 /* Size of the record including padding. */
+	uint32_t num_children;
+	uint8_t type;
+	uint8_t token;
+	uint16_t num_rule_keys;
+	uint32_t attributes_size;
+	uint32_t num_attributes;
+	uint32_t text_length;
+};
+
+} // namespace stkr
@@ -110,7 +110,7 @@ void dump_inline_context(const Document *document, const Node *node)
 	const InlineContext *icb = node->icb;
 	if (icb == NULL) {
 		dmsg("%s node %.8Xh has no inline context.", 
-			NODE_TYPE_STRINGS[get_type(node)], uint32_t(node));
+			NODE_TYPE_STRINGS[get_type(node)], uint32_t(uintptr_t(node)));
 	} else {
 		dump_paragraph_elements(document, icb->elements, icb->num_elements);
 		if (icb->lines != NULL)
@@ -14,6 +14,7 @@
 #include "stacker_view.h"
 #include "stacker_platform.h"
 #include "stacker_encoding.h"
+#include "stacker_parser.h"
 
 #include "url_cache.h"
 
@@ -107,6 +108,139 @@ void document_dump(const Document *document, const char *fmt, ...)
 	va_end(args);
 }
 
+/* Tells the client that a new update pass is starting. */
+void notify_update_stage(const Document *document, UpdateStage stage)
+{
+	if (document->stage_callback != NULL)
+		document->stage_callback(document->stage_callback_data, document, stage);
+}
+
+/* Sends a Chrome trace event to the document's trace callback. */
+static void trace_emit(const Document *document, char phase, const char *name,
+	const char *args)
+{
+	char buffer[128 + MAX_TRACE_ARGS];
+	bool has_args = args != NULL && args[0] != '\0';
+	int length = snprintf(buffer, sizeof(buffer), 
+		"{\"name\":\"%s\",\"cat\":\"stacker\",\"ph\":\"%c\","
+		"\"ts\":%llu,\"pid\":1,\"tid\":1%s%s%s}", 
+		name, phase, (unsigned long long)platform_query_microseconds(),
+		has_args ? ",\"args\":{" : "", has_args ? args : "", 
+		has_args ? "}" : "");
+	if (length < 0)
+		return;
+	if ((unsigned)length >= sizeof(buffer))
+		length = sizeof(buffer) - 1;
+	document->trace(document->trace_data, buffer, (unsigned)length);
+}
+
+/* Opens a trace span. The span is remembered so that it can be closed and
+ * reopened around each slice of an incremental update. */
+void trace_begin(const Document *document, const char *name, const char *args)
+{
+	if (!tracing(document))
+		return;
+	Document *d = (Document *)document;
+	assertb(d->trace_depth != MAX_TRACE_DEPTH);
+	if (d->trace_depth == MAX_TRACE_DEPTH)
+		return;
+	TraceSpan *span = d->trace_spans + d->trace_depth++;
+	span->name = name;
+	span->args[0] = '\0';
+	if (args != NULL) {
+		strncpy(span->args, args, MAX_TRACE_ARGS - 1);
+		span->args[MAX_TRACE_ARGS - 1] = '\0';
+	}
+	trace_emit(document, 'B', name, span->args);
+}
+
+/* Closes the innermost open trace span. */
+void trace_end(const Document *document)
+{
+	if (!tracing(document) || document->trace_depth == 0)
+		return;
+	Document *d = (Document *)document;
+	const TraceSpan *span = d->trace_spans + --d->trace_depth;
+	trace_emit(document, 'E', span->name, NULL);
+}
+
+/* Replaces any spans open at or below a nesting level with a new span. Does 
+ * nothing if the span at the level is already the requested one. */
+void trace_stage(const Document *document, unsigned level, const char *name,
+	const char *args)
+{
+	if (!tracing(document))
+		return;
+	if (document->trace_depth == level + 1) {
+		const TraceSpan *span = document->trace_spans + level;
+		if (span->name == name && 0 == strcmp(span->args, 
+			args != NULL ? args : ""))
+			return;
+	}
+	while (document->trace_depth > level)
+		trace_end(document);
+	trace_begin(document, name, args);
+}
+
+/* Writes trace arguments identifying a node. */
+void trace_node_args(const Document *document, const Node *node, 
+	char *buffer, unsigned buffer_size)
+{
+	char label[MAX_TRACE_ARGS];
+	make_node_debug_string(document, node, label, sizeof(label));
+	unsigned j = (unsigned)snprintf(buffer, buffer_size, "\"node\":\"");
+	for (const char *s = label; *s != '\0' && j + 4 < buffer_size; ++s) {
+		unsigned char ch = (unsigned char)*s;
+		if (ch == '"' || ch == '\\')
+			buffer[j++] = '\\';
+		buffer[j++] = ch < 0x20 ? ' ' : (char)ch;
+	}
+	buffer[j++] = '"';
+	buffer[j] = '\0';
+}
+
+/* Ends all open spans at the end of an update slice, leaving them on the 
+ * span stack so that they can be reopened by the next slice. */
+static void trace_suspend(const Document *document)
+{
+	if (!tracing(document))
+		return;
+	for (unsigned i = document->trace_depth; i != 0; --i)
+		trace_emit(document, 'E', document->trace_spans[i - 1].name, NULL);
+}
+
+/* Reopens spans suspended at the end of the previous update slice. */
+static void trace_resume(const Document *document)
+{
+	if (!tracing(document))
+		return;
+	for (unsigned i = 0; i != document->trace_depth; ++i) {
+		const TraceSpan *span = document->trace_spans + i;
+		trace_emit(document, 'B', span->name, span->args);
+	}
+}
+
+/* Each call to update_document() is a slice in the trace. The spans of any 
+ * stages underway when the previous slice ended are reopened inside it. */
+static void trace_begin_slice(const Document *document, uintptr_t timeout)
+{
+	if (!tracing(document))
+		return;
+	char args[32];
+	snprintf(args, sizeof(args), "\"timeout\":%llu", 
+		(unsigned long long)timeout);
+	trace_emit(document, 'B', "update_document", args);
+	trace_resume(document);
+}
+
+static void trace_end_slice(const Document *document)
+{
+	if (!tracing(document))
+		return;
+	trace_suspend(document);
+	trace_emit(document, 'E', "update_document", NULL);
+}
+
 /* Adds a message to the document's external message queue. */
 void enqueue_message(Document *document, const Message *message)
 {
@@ -167,6 +301,7 @@ static void clear_selection_chain(Document *document)
 		node->selection_next = NULL;
 		node->t.flags &= ~NFLAG_IN_SELECTION_CHAIN;
 		node->t.flags |= NFLAG_UPDATE_SELECTION_LAYERS;
+		mark_node_dirty(node);
 	}
 	document->selection_chain_head = NULL;
 	document->selection_chain_tail = NULL;
@@ -592,6 +727,21 @@ void set_layout_dump_callback(Document *document, DumpCallback layout_dump,
 	document->dump_data = layout_dump_data;
 }
 
+void set_update_stage_callback(Document *document, 
+	UpdateStageCallback stage_callback, void *stage_callback_data)
+{
+	document->stage_callback = stage_callback;
+	document->stage_callback_data = stage_callback_data;
+}
+
+void set_trace_callback(Document *document, TraceCallback trace, 
+	void *trace_data)
+{
+	document->trace = trace;
+	document->trace_data = trace_data;
+	document->trace_depth = 0;
+}
+
 /* Determines whether document or global rule tables have changed since the
  * last layout. */
 static bool check_rule_tables(const Document *document)
@@ -640,13 +790,20 @@ static void begin_node_traversal_stage(Document *document,
 		&document->root->t,
 		sizeof(NodeUpdateFrame));
 	tree_iterator_push(&s->iterator);
+	ancestor_filter_clear(&s->ancestor_filter);
+	style_sharing_cache_clear(&s->sharing_cache);
 	s->stage = stage;
 	s->pre_layout_stage = NUS_UPDATE;
+	notify_update_stage(document, stage == DUS_PRE_LAYOUT ? 
+		USTG_PRE_LAYOUT : USTG_POST_LAYOUT);
+	trace_stage(document, TRACE_UPDATE_STAGE, stage == DUS_PRE_LAYOUT ? 
+		"DUS_PRE_LAYOUT" : "DUS_POST_LAYOUT");
 }
 
 /* Begins the layout stage of a document update. */
 static void begin_layout_stage(Document *document, IncrementalUpdateState *s)
 {
+	trace_stage(document, TRACE_UPDATE_STAGE, "DUS_LAYOUT");
 	init_layout(&s->layout_state);
 	begin_layout(&s->layout_state, document, document->root->t.counterpart.box, 
 		s->scratch_buffer, sizeof(s->scratch_buffer));
@@ -668,10 +825,19 @@ static void begin_update(Document *document, uintptr_t timeout)
 
 	s->timeout = timeout;
 	s->start_time = platform_query_timer();
-
-	document->flags = set_or_clear(document->flags, 
-		DOCFLAG_UPDATE_REMATCH_RULES, check_rule_tables(document));
 	document->update_clock++;
+	memset(&document->update_stats, 0, sizeof(UpdateStats));
+
+	/* Logged rule changes only affect nodes with the changed keys, which are 
+	 * marked for update. Other rule table and rule revision changes can affect
+	 * any node, so every node must be visited, and if the tables have
+	 * changed, every node must rematch its rules. */
+	bool tables_changed = check_rule_tables(document);
+	bool rules_changed = tables_changed || document->rule_revision_at_update != 
+		document->system->rule_revision_counter;
+	s->visit_all_nodes = rules_changed && !invalidate_changed_rules(document);
+	document->flags = set_or_clear(document->flags, 
+		DOCFLAG_UPDATE_REMATCH_RULES, s->visit_all_nodes && tables_changed);
 	begin_node_traversal_stage(document, s, DUS_PRE_LAYOUT);
 }
 
@@ -684,7 +850,11 @@ static void complete_update(Document *document, IncrementalUpdateState *s)
 	document->rule_revision_at_update = system->rule_revision_counter;
 	document->global_rule_table_revision = system->rule_table_revision;
 	document->flags &= ~DOCFLAG_RULE_TABLE_CHANGED;
+	node_index_trim_stale(&document->node_index);
 	s->stage = DUS_COMPLETE;
+	notify_update_stage(document, USTG_COMPLETE);
+	while (document->trace_depth != 0)
+		trace_end(document);
 }
 
 /* Does work in the pre-layout-update stage of a document update, returning
@@ -704,12 +874,30 @@ static bool continue_pre_layout_update(Document *document,
 	 * specified by the iterator. */
 	if (s->pre_layout_stage == NUS_UPDATE) {
 		if ((flags & TIF_VISIT_PREORDER) != 0) {
+			document->update_stats.pre_layout_nodes_visited++;
+			bool dirty_descendants = (node->t.flags & 
+				NFLAG_DIRTY_DESCENDANTS) != 0;
+			node->t.flags &= ~NFLAG_DIRTY_DESCENDANTS;
 			unsigned propagate_down = update_node_pre_layout_preorder(
-				document, node, frame->propagate_down);
+				document, node, frame->propagate_down, &s->ancestor_filter, 
+				&s->sharing_cache);
 			frame = (NodeUpdateFrame *)tree_iterator_push(&s->iterator);
 			frame->propagate_down = propagate_down;
+			/* Step over the children if nothing below this node needs to be
+			 * updated. */
+			if (propagate_down == 0 && !dirty_descendants && 
+				!s->visit_all_nodes) {
+				s->iterator.flags |= TIF_VISIT_POSTORDER;
+				flags = s->iterator.flags;
+			}
+			/* The node is an ancestor of everything visited until its 
+			 * postorder step. */
+			if ((flags & TIF_VISIT_POSTORDER) == 0)
+				ancestor_filter_push(&s->ancestor_filter, node);
 		}
 		if ((flags & TIF_VISIT_POSTORDER) != 0) {
+			if ((flags & TIF_VISIT_PREORDER) == 0)
+				ancestor_filter_pop(&s->ancestor_filter, node);
 			unsigned propagate_up = update_node_pre_layout_postorder(
 				document, node, frame->propagate_up);
 			tree_iterator_pop(&s->iterator);
@@ -737,6 +925,13 @@ static bool continue_post_layout_update(Document *document,
 	unsigned flags = s->iterator.flags;
 	NodeUpdateFrame *frame = (NodeUpdateFrame *)s->iterator.frame;
 
+	/* Skip subtrees containing no nodes that need post-layout updates. The 
+	 * bit is cleared by the next pre-layout pass. */
+	if (flags == TIF_VISIT_PREORDER && 
+		(node->t.flags & NFLAG_DIRTY_DESCENDANTS) == 0) {
+		s->iterator.flags |= TIF_VISIT_POSTORDER;
+		flags = s->iterator.flags;
+	}
 	if ((flags & TIF_VISIT_PREORDER) != 0) {
 		if ((flags & TIF_VISIT_POSTORDER) == 0) {
 			NodeUpdateFrame *cf = (NodeUpdateFrame *)tree_iterator_push(&s->iterator);
@@ -746,6 +941,7 @@ static bool continue_post_layout_update(Document *document,
 		}
 	}
 	if ((flags & TIF_VISIT_POSTORDER) != 0) {
+		document->update_stats.post_layout_nodes_visited++;
 		unsigned propagate_up = update_node_post_layout_postorder(
 			document, node, frame->propagate_up);
 		if ((flags & TIF_VISIT_PREORDER) == 0) {
@@ -787,6 +983,23 @@ static bool do_update_step(Document *document, IncrementalUpdateState *s)
 	return false;
 }
 
+/* Rebuilds the ancestor filter of an interrupted pre-layout traversal. The
+ * client may have changed the rule keys of nodes on the iterator's stack
+ * since they were added. */
+static void rebuild_ancestor_filter(IncrementalUpdateState *s)
+{
+	ancestor_filter_clear(&s->ancestor_filter);
+	if (s->stage != DUS_PRE_LAYOUT || s->iterator.flags == TIF_END)
+		return;
+	const Node *node = (const Node *)s->iterator.node;
+	if ((s->iterator.flags & TIF_VISIT_PREORDER) != 0)
+		node = node->t.parent.node;
+	while (node != NULL) {
+		ancestor_filter_push(&s->ancestor_filter, node);
+		node = node->t.parent.node;
+	}
+}
+
 /* Advances the state of an incremental update until interrupted. */
 static bool continue_update(Document *document)
 {
@@ -810,6 +1023,36 @@ static void deinit_update_state(IncrementalUpdateState *s)
 	tree_iterator_deinit(&s->iterator);
 }
 
+/* Returns counters describing the work done by the most recent update. */
+const UpdateStats *get_update_stats(const Document *document)
+{
+	return &document->update_stats;
+}
+
+/* Reads the allocator counters of one of the document's pools. */
+void get_pool_stats(const Document *document, DocumentPool pool, 
+	PoolStats *stats)
+{
+	const Arena *arena = NULL;
+	switch (pool) {
+		case DPOOL_NODES:
+			arena = &document->node_arena;
+			break;
+		case DPOOL_BOXES:
+			arena = &document->box_arena;
+			break;
+		default:
+			arena = &document->layer_arena;
+			break;
+	}
+	stats->live_blocks = arena->live_blocks;
+	stats->peak_blocks = arena->peak_blocks;
+	stats->chunks = arena->num_chunks;
+	stats->allocations = arena->num_allocations;
+	stats->recycled = arena->num_recycled;
+	stats->heap_blocks = arena->num_heap_blocks;
+}
+
 /* Traverses the node tree, updating node state and layout that is invalid. */
 bool update_document(Document *document, uintptr_t timeout)
 {
@@ -818,6 +1061,7 @@ bool update_document(Document *document, uintptr_t timeout)
 	if (document->update == NULL || document->update->stage == DUS_COMPLETE) {
 		if (!needs_update(document))
 			return true;
+		trace_begin_slice(document, timeout);
 		if (document->update == NULL) {
 			init_update_state(&state);
 			document->update = &state;
@@ -825,13 +1069,20 @@ bool update_document(Document *document, uintptr_t timeout)
 		begin_update(document, timeout);
 	} else {
 		document->update->timeout = timeout;
+		document->update->start_time = platform_query_timer();
+		rebuild_ancestor_filter(document->update);
+		/* The client may have modified or destroyed the cached nodes. */
+		style_sharing_cache_clear(&document->update->sharing_cache);
+		trace_begin_slice(document, timeout);
 	}
 	
 	/* Try to complete the update. */
-	if (continue_update(document)) {
+	bool complete = continue_update(document);
+	trace_end_slice(document);
+	if (complete) {
 		deinit_update_state(document->update);
 		if (document->update != &state)
-			delete [] document->update;
+			delete document->update;
 		document->update = NULL;
 		return true;
 	}
@@ -840,17 +1091,44 @@ bool update_document(Document *document, uintptr_t timeout)
 	if (document->update == &state)  {
 		document->update = new IncrementalUpdateState();
 		memcpy(document->update, &state, sizeof(IncrementalUpdateState));
+		if (state.stage == DUS_LAYOUT) {
+			tree_iterator_relocate_buffer(&document->update->layout_state.iterator,
+				state.scratch_buffer, document->update->scratch_buffer);
+		}
 	}
 	return false;
 }
 
+/* Abandons any parse of fetched data in progress. */
+static void end_stream_parse(Document *document)
+{
+	if (document->stream_parser != NULL) {
+		deinit_parser(document->stream_parser);
+		delete document->stream_parser;
+		document->stream_parser = NULL;
+	}
+	document->stream_fed = 0;
+}
+
 static void clear_document(Document *document)
 {
+	end_stream_parse(document);
 	clear_message_queue(&document->message_queue);
 	clear_selection(document);
 	clear_rule_table(&document->rules);
 	if (document->root != NULL)
 		destroy_node(document, document->root, true);
+	/* The index is rebuilt if the new tree is queried. */
+	node_index_clear(&document->node_index);
+	destroy_style_cache(document);
+	/* Release the node and box arenas in one go unless a client still holds
+	 * nodes that aren't part of the tree. */
+	if (document->node_arena.live_blocks == 0)
+		arena_clear(&document->node_arena);
+	if (document->box_arena.live_blocks == 0)
+		arena_clear(&document->box_arena);
+	if (document->layer_arena.live_blocks == 0)
+		arena_clear(&document->layer_arena);
 	document->hit_chain_head = NULL;
 	document->hit_chain_tail = NULL;
 	document->selection_chain_head = NULL;
@@ -871,11 +1149,25 @@ Document *create_document(System *system, unsigned flags)
 	document->available_view_ids = unsigned(-1);
 	document->dump = &dump_discard;
 	document->dump_data = NULL;
+	document->stage_callback = NULL;
+	document->stage_callback_data = NULL;
+	memset(&document->update_stats, 0, sizeof(UpdateStats));
+	document->trace = NULL;
+	document->trace_data = NULL;
+	document->trace_depth = 0;
 	document->box_query_stamp = 1;
 	document->update_clock = 0;
 	document->change_clock = 0;
 	document->change_clock_at_update = unsigned(-1);
-	document->free_boxes = NULL;
+	arena_init(&document->node_arena);
+	arena_init(&document->box_arena);
+	arena_init(&document->layer_arena);
+	rule_table_init(&document->rules);
+	rule_change_log_init(&document->rule_log);
+	node_index_init(&document->node_index);
+	document->style_cache = NULL;
+	document->rule_log_position = 0;
+	document->global_rule_log_position = system->rule_log.position;
 	document->hit_clock = 0;
 	document->flags = flags;
 	document->root_dims[AXIS_H] = 0;
@@ -885,6 +1177,8 @@ Document *create_document(System *system, unsigned flags)
 	document->cursor = CT_DEFAULT;
 	document->navigation_state = DOCNAV_IDLE;
 	document->url_handle = urlcache::INVALID_URL_HANDLE;
+	document->stream_parser = NULL;
+	document->stream_fed = 0;
 	document->source = NULL;
 	document->source_length = 0;
 	document->source_capacity = 0;
@@ -900,24 +1194,17 @@ Document *create_document(System *system, unsigned flags)
 	return document;
 }
 
-static void clear_box_free_list(Document *document)
-{
-	while (document->free_boxes != NULL) {
-		Box *box = document->free_boxes;
-		document->free_boxes = box->t.next.box;
-		delete box;
-	}
-}
-
 void destroy_document(Document *document)
 {
 	if (document->update != NULL) {
 		deinit_update_state(document->update);
-		delete [] document->update;
+		delete document->update;
 		document->update = NULL;
 	}
-	clear_box_free_list(document);
 	clear_document(document);
+	arena_clear(&document->node_arena);
+	arena_clear(&document->box_arena);
+	arena_clear(&document->layer_arena);
 	deinit_message_queue(&document->message_queue);
 	grid_deinit(&document->grid);
 	if (document->url_handle != urlcache::INVALID_URL_HANDLE)
@@ -935,6 +1222,7 @@ void reset_document(Document *document)
 	document->change_clock++;
 	document->rule_revision_at_update = document->system->
 		rule_revision_counter - 1;
+	document->flags |= DOCFLAG_RULE_LOG_INVALID;
 }
 
 /* Walks the hit chain looking for nodes that were not hit this tick and sends
@@ -1055,6 +1343,54 @@ static void set_navigation_state(Document *document, NavigationState state)
 	enqueue_message(document, &message);
 }
 
+/* Passes data received for a fetch in progress to the parser, so that the
+ * top of the document can be laid out before the rest has arrived. The first
+ * data received starts a new parse. */
+static void stream_url_data(Document *document)
+{
+	System *system = document->system;
+	UrlCache *cache = system->url_cache;
+	if (document->navigation_state != DOCNAV_IN_PROGRESS)
+		return;
+	unsigned data_size;
+	const char *data = (const char *)cache->received(document->url_handle, 
+		&data_size);
+	if (data == NULL || data_size <= document->stream_fed)
+		return;
+	if (document->stream_parser == NULL) {
+		reset_document(document);
+		Parser *parser = new Parser();
+		init_parser(parser, system, document);
+		document->stream_parser = parser;
+		parse_begin(parser, get_root(document));
+	}
+	int rc = parse_feed(document->stream_parser, 
+		data + document->stream_fed, data_size - document->stream_fed);
+	document->stream_fed = data_size;
+	if (rc < 0) {
+		end_stream_parse(document);
+		set_navigation_state(document, DOCNAV_PARSE_ERROR);
+	}
+}
+
+/* Parses fetched document content. The URL cache keeps the data locked only
+ * while it is being parsed, so text nodes may share the source only if they
+ * refer to the document's kept copy of it. */
+static int parse_url_data(Document *document, const char *data, unsigned size)
+{
+	unsigned flags = 0;
+	if ((document->flags & DOCFLAG_PARALLEL_PARSE) != 0)
+		flags |= PARSEFLAG_PARALLEL;
+	if ((document->flags & DOCFLAG_SHARE_SOURCE_TEXT) != 0 &&
+		(document->flags & DOCFLAG_KEEP_SOURCE) != 0)
+		flags |= PARSEFLAG_SHARE_TEXT;
+	Parser parser;
+	init_parser(&parser, document->system, document, flags);
+	int rc = parse(&parser, get_root(document), data, size);
+	deinit_parser(&parser);
+	return rc;
+}
+
 /* Queries the state of the URL handle being used to fetch the document content,
  * updating the document if the data is available. */
 static NavigationState poll_url_handle(Document *document)
@@ -1069,9 +1405,19 @@ static NavigationState poll_url_handle(Document *document)
 	unsigned data_size;
 	const void *data = cache->lock(handle, &data_size);
 	if (data != NULL) {
-		reset_document(document);
-		int rc = parse(system, document, get_root(document), 
-			(const char *)data, data_size);
+		int rc;
+		Parser *parser = document->stream_parser;
+		if (parser != NULL && data_size >= document->stream_fed) {
+			/* Finish the parse of the data received while fetching. */
+			rc = parse_feed(parser, (const char *)data + document->stream_fed,
+				data_size - document->stream_fed);
+			if (rc >= 0)
+				rc = parse_end(parser);
+		} else {
+			reset_document(document);
+			rc = parse_url_data(document, (const char *)data, data_size);
+		}
+		end_stream_parse(document);
 		if (rc == STKR_OK) {
 			set_navigation_state(document, DOCNAV_SUCCESS);
 		} else {
@@ -1093,9 +1439,12 @@ unsigned document_fetch_notify_callback(UrlHandle handle,
 			fetch_state == URL_FETCH_DISK) {
 			poll_url_handle(document);
 		} else if (fetch_state == URL_FETCH_FAILED) {
+			end_stream_parse(document);
 			set_navigation_state(document, DOCNAV_FAILED);
 		}
-	} 
+	} else if (type == URL_NOTIFY_DATA) {
+		stream_url_data(document);
+	}
 	return 0;
 }
 
@@ -1128,6 +1477,7 @@ int set_url(Document *document, const char *url)
 			URL_FLAG_KEEP_URL);
 	}
 
+	end_stream_parse(document);
 	set_navigation_state(document, DOCNAV_IDLE);
 	return STKR_OK;
 }
@@ -1145,6 +1495,7 @@ int navigate(Document *document, const char *url, UrlFetchPriority priority)
 
 	if (document->url_handle != INVALID_URL_HANDLE) {
 		/* Request the URL. */
+		set_navigation_state(document, DOCNAV_IN_PROGRESS);
 		cache->request(document->url_handle, priority);
 		/* Poll the handle, since the data might be available immidiately. */
 		poll_url_handle(document);
@@ -1174,13 +1525,13 @@ const char *get_source(const Document *document, unsigned *out_size)
 }
 
 /* Stores a copy of markup being parsed into the document if the document
- * is configured to do so. */
-void document_store_source(Document *document, const char *source, 
+ * is configured to do so. Returns the copy, or NULL if none was made. */
+const char *document_store_source(Document *document, const char *source, 
 	unsigned length)
 {
 	if ((document->flags & DOCFLAG_KEEP_SOURCE) == 0 || 
 		document->source_length != 0)
-		return;
+		return NULL;
 	if (document->source_capacity < length) {
 		delete [] document->source;
 		document->source = new char[length];
@@ -1188,6 +1539,7 @@ void document_store_source(Document *document, const char *source,
 	}
 	memcpy(document->source, source, length);
 	document->source_length = length;
+	return document->source;
 }
 
 } // namespace stkr
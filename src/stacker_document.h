@@ -3,9 +3,11 @@
 #include "stacker_platform.h"
 #include "stacker_attribute.h"
 #include "stacker_rule.h"
+#include "stacker_node.h"
 #include "stacker_inline2.h"
 #include "stacker_diagnostics.h"
 #include "stacker_quadtree.h"
+#include "stacker_arena.h"
 #include "stacker_message.h"
 #include "stacker_layout.h"
 #include "url_cache.h"
@@ -13,6 +15,7 @@
 namespace stkr {
 
 struct Box;
+struct Parser;
 
 const int INVALID_VIEW_ID = -1;
 
@@ -32,13 +35,33 @@ enum NodePreLayoutUpdateStage {
 
 const unsigned INCREMENTAL_UPDATE_SCRATCH_BYTES = 512;
 
+/* Nesting levels of the trace spans that are open during an update. Opening a
+ * span at a level closes any spans open at that level or deeper. */
+enum TraceLevel {
+	TRACE_UPDATE_STAGE,  // DUS_*
+	TRACE_LAYOUT_STAGE,  // LSTG_*
+	TRACE_SIZING_STAGE,  // SSTG_*
+	MAX_TRACE_DEPTH = 8
+};
+
+const unsigned MAX_TRACE_ARGS = 256;
+
+/* A trace span left open across update_document() calls. */
+struct TraceSpan {
+	const char *name;
+	char args[MAX_TRACE_ARGS];
+};
+
 /* The state of an incremental document update. */
 struct IncrementalUpdateState {
 	DocumentUpdateStage stage;
 	NodePreLayoutUpdateStage pre_layout_stage;
 	TimerValue start_time;
 	uintptr_t timeout;
+	bool visit_all_nodes;
 	TreeIterator iterator;
+	AncestorFilter ancestor_filter; /* Keys of the current node's ancestors. */
+	StyleSharingCache sharing_cache; /* Nodes updated in this pass. */
 	IncrementalLayoutState layout_state;
 	uint8_t scratch_buffer[INCREMENTAL_UPDATE_SCRATCH_BYTES];
 };
@@ -57,15 +80,22 @@ struct Document {
 	View *views;
 	unsigned available_view_ids;
 
-	/* Box free list. */
-	Box *free_boxes;
+	/* Node, box and layer allocators. */
+	Arena node_arena;
+	Arena box_arena;
+	Arena layer_arena;
 
 	/* Rules. */
 	RuleTable rules;
+	RuleChangeLog rule_log;
 	unsigned global_rule_table_revision;
 	unsigned rule_revision_at_update;
+	unsigned rule_log_position;        /* Changes in 'rule_log' already seen. */
+	unsigned global_rule_log_position; /* Changes in the system log already seen. */
+	NodeIndex node_index;
 
 	/* Styling. */
+	StyleCache *style_cache; /* NULL until needed. */
 	uint32_t selected_text_color;
 	uint32_t selected_text_fill_color;
 
@@ -104,6 +134,8 @@ struct Document {
 	/* Navigation state. */
 	urlcache::UrlHandle url_handle;
 	NavigationState navigation_state;
+	Parser *stream_parser; /* Parses fetched data as it arrives. */
+	unsigned stream_fed;   /* Bytes of the fetch passed to the parser. */
 
 	/* Markup storage. */
 	char *source;
@@ -113,8 +145,22 @@ struct Document {
 	/* Diagnostics. */
 	DumpCallback dump;
 	void *dump_data;
+	UpdateStageCallback stage_callback;
+	void *stage_callback_data;
+	UpdateStats update_stats;
+	TraceCallback trace;
+	void *trace_data;
+	TraceSpan trace_spans[MAX_TRACE_DEPTH];
+	unsigned trace_depth;
 };
 
+/* Returns the work counters for the current update. The counters may be
+ * incremented through a const document because they are not document state. */
+inline UpdateStats *document_stats(const Document *document)
+{
+	return &((Document *)document)->update_stats;
+}
+
 bool needs_update(const Document *document);
 bool check_interrupt(const Document *document);
 void document_notify_box_destroy(Document *document, Box *box);
@@ -122,6 +168,20 @@ void document_notify_node_destroy(Document *document, Node *node);
 void document_notify_node_changed(Document *document, Node *node);
 void impose_root_constraints(Document *d);
 void document_dump(const Document *document, const char *fmt, ...);
+void notify_update_stage(const Document *document, UpdateStage stage);
+void trace_begin(const Document *document, const char *name, 
+	const char *args = 0);
+void trace_end(const Document *document);
+void trace_stage(const Document *document, unsigned level, const char *name, 
+	const char *args = 0);
+void trace_node_args(const Document *document, const Node *node, 
+	char *buffer, unsigned buffer_size);
+
+/* True if trace events are being recorded for a document. */
+inline bool tracing(const Document *document)
+{
+	return document->trace != NULL;
+}
 bool document_handle_message(Document *document, Message *message);
 void document_handle_mouse_event(Document *document, View *view, 
 	MessageType type, float doc_x, float doc_y, unsigned flags);
@@ -135,7 +195,7 @@ void enqueue_message(Document *document, const Message *message);
 unsigned document_fetch_notify_callback(urlcache::UrlHandle handle, 
 	urlcache::UrlNotification type, urlcache::UrlKey key, 
 	System *system, Document *document, urlcache::UrlFetchState fetch_state);
-void document_store_source(Document *document, const char *source, 
+const char *document_store_source(Document *document, const char *source, 
 	unsigned length);
 int allocate_view_id(Document *document);
 void deallocate_view_id(Document *document, int id);
@@ -3,6 +3,8 @@
 #include "stacker_gdi.h"
 #include "stacker_platform.h"
 
+#include <algorithm>
+
 #define NOMINMAX
 #include <Windows.h>
 
@@ -0,0 +1,80 @@
+#if defined(STACKER_GENERATE)
+
+/* Writes a synthetic .stacker document to standard output or a file.
+ *
+ * Usage: stacker_generate [-o output.stacker] [-seed n] [-nodes n]
+ *                         [-depth n] [-fan-out n] [-hbox n] [-vbox n]
+ *                         [-p n] [-rules n] [-classes n]
+ *                         [-classes-per-node n] [-words n] [-images n]
+ *
+ * The -hbox, -vbox and -p options set the relative frequency of each node
+ * type. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "stacker_generator.h"
+
+namespace stkr {
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: stacker_generate [-o output.stacker]");
+	for (unsigned i = 0; i < NUM_GENERATOR_PARAMETERS; ++i)
+		fprintf(stderr, " [-%s n]", GENERATOR_PARAMETERS[i].name);
+	fprintf(stderr, "\n");
+}
+
+static int generate_main(int argc, char **argv)
+{
+	GeneratorParams params;
+	init_generator_params(&params);
+	const char *output_path = NULL;
+
+	for (int i = 1; i < argc; ++i) {
+		if (i + 1 == argc) {
+			print_usage();
+			return 1;
+		}
+		const char *name = argv[i];
+		const char *value = argv[++i];
+		if (0 == strcmp(name, "-o")) {
+			output_path = value;
+			continue;
+		}
+		const GeneratorParameter *parameter = name[0] == '-' ?
+			find_generator_parameter(name + 1) : NULL;
+		if (parameter == NULL) {
+			print_usage();
+			return 1;
+		}
+		params.*parameter->field = (unsigned)strtoul(value, NULL, 10);
+	}
+
+	unsigned length;
+	char *text = generate_document(&params, &length);
+	FILE *os = stdout;
+	if (output_path != NULL) {
+		os = fopen(output_path, "wb");
+		if (os == NULL) {
+			fprintf(stderr, "Can't open %s for writing.\n", output_path);
+			delete [] text;
+			return 1;
+		}
+	}
+	fwrite(text, 1, length, os);
+	if (os != stdout)
+		fclose(os);
+	delete [] text;
+	return 0;
+}
+
+} // namespace stkr
+
+int main(int argc, char **argv)
+{
+	return stkr::generate_main(argc, argv);
+}
+
+#endif // defined(STACKER_GENERATE)
@@ -0,0 +1,321 @@
+#include "stacker_generator.h"
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+#include "stacker_util.h"
+
+namespace stkr {
+
+/* Synthetic document generator. Builds a tree of the requested shape in
+ * breadth first order, then writes it out as markup preceded by the rules. */
+
+enum GeneratedNodeType {
+	GNODE_VBOX,
+	GNODE_HBOX,
+	GNODE_PARAGRAPH
+};
+
+struct GeneratedNode {
+	GeneratedNodeType type;
+	unsigned depth;
+	unsigned first_child;
+	unsigned num_children;
+	unsigned num_images;
+};
+
+struct GeneratorState {
+	const GeneratorParams *params;
+	uint32_t random_state;
+	GeneratedNode *nodes;
+	unsigned num_nodes;
+	char *text;
+	unsigned length;
+	unsigned capacity;
+};
+
+static const char * const GNODE_TAGS[] = { "vbox", "hbox", "p" };
+
+static const unsigned WORDS_PER_LINE = 12;
+
+const GeneratorParameter GENERATOR_PARAMETERS[] = {
+	{ "seed",             &GeneratorParams::seed             },
+	{ "nodes",            &GeneratorParams::num_nodes        },
+	{ "depth",            &GeneratorParams::max_depth        },
+	{ "fan-out",          &GeneratorParams::fan_out          },
+	{ "hbox",             &GeneratorParams::hbox_weight      },
+	{ "vbox",             &GeneratorParams::vbox_weight      },
+	{ "p",                &GeneratorParams::paragraph_weight },
+	{ "rules",            &GeneratorParams::num_rules        },
+	{ "classes",          &GeneratorParams::num_classes      },
+	{ "classes-per-node", &GeneratorParams::classes_per_node },
+	{ "words",            &GeneratorParams::paragraph_words  },
+	{ "images",           &GeneratorParams::num_images       }
+};
+const unsigned NUM_GENERATOR_PARAMETERS =
+	sizeof(GENERATOR_PARAMETERS) / sizeof(GENERATOR_PARAMETERS[0]);
+
+void init_generator_params(GeneratorParams *params)
+{
+	params->seed = 1;
+	params->num_nodes = 1000;
+	params->max_depth = 10;
+	params->fan_out = 8;
+	params->hbox_weight = 1;
+	params->vbox_weight = 2;
+	params->paragraph_weight = 4;
+	params->num_rules = 20;
+	params->num_classes = 16;
+	params->classes_per_node = 2;
+	params->paragraph_words = 30;
+	params->num_images = 0;
+}
+
+const GeneratorParameter *find_generator_parameter(const char *name)
+{
+	for (unsigned i = 0; i < NUM_GENERATOR_PARAMETERS; ++i)
+		if (0 == strcmp(name, GENERATOR_PARAMETERS[i].name))
+			return GENERATOR_PARAMETERS + i;
+	return NULL;
+}
+
+/* Xorshift generator. Deterministic across platforms, unlike rand(). */
+static uint32_t gen_random(GeneratorState *gs)
+{
+	uint32_t x = gs->random_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	gs->random_state = x;
+	return x;
+}
+
+static unsigned gen_random_below(GeneratorState *gs, unsigned n)
+{
+	return n != 0 ? gen_random(gs) % n : 0;
+}
+
+static void gen_reserve(GeneratorState *gs, unsigned additional)
+{
+	unsigned required = gs->length + additional + 1;
+	if (required <= gs->capacity)
+		return;
+	unsigned new_capacity = gs->capacity != 0 ? gs->capacity : 4096;
+	while (new_capacity < required)
+		new_capacity *= 2;
+	char *new_text = new char[new_capacity];
+	if (gs->text != NULL) {
+		memcpy(new_text, gs->text, gs->length);
+		delete [] gs->text;
+	}
+	gs->text = new_text;
+	gs->capacity = new_capacity;
+}
+
+static void gen_append(GeneratorState *gs, const char *s)
+{
+	unsigned n = (unsigned)strlen(s);
+	gen_reserve(gs, n);
+	memcpy(gs->text + gs->length, s, n + 1);
+	gs->length += n;
+}
+
+static void gen_appendf(GeneratorState *gs, const char *fmt, ...)
+{
+	char buffer[256];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, args);
+	va_end(args);
+	gen_append(gs, buffer);
+}
+
+/* Chooses the type of a new node using the configured weights. Nodes at the
+ * depth limit are always paragraphs. */
+static GeneratedNodeType gen_choose_type(GeneratorState *gs, unsigned depth)
+{
+	const GeneratorParams *p = gs->params;
+	if (depth >= p->max_depth)
+		return GNODE_PARAGRAPH;
+	unsigned total = p->hbox_weight + p->vbox_weight + p->paragraph_weight;
+	if (total == 0)
+		return GNODE_PARAGRAPH;
+	unsigned r = gen_random_below(gs, total);
+	if (r < p->vbox_weight)
+		return GNODE_VBOX;
+	if (r < p->vbox_weight + p->hbox_weight)
+		return GNODE_HBOX;
+	return GNODE_PARAGRAPH;
+}
+
+/* Builds the node tree breadth first. Each container receives between half
+ * and all of the fan-out in children until the node budget is exhausted. */
+static void gen_build_tree(GeneratorState *gs)
+{
+	const GeneratorParams *p = gs->params;
+	unsigned capacity = p->num_nodes != 0 ? p->num_nodes : 1;
+	unsigned fan_out = p->fan_out != 0 ? p->fan_out : 1;
+
+	gs->nodes = new GeneratedNode[capacity];
+	GeneratedNode *root = gs->nodes;
+	root->type = GNODE_VBOX;
+	root->depth = 0;
+	root->first_child = 0;
+	root->num_children = 0;
+	root->num_images = 0;
+	gs->num_nodes = 1;
+
+	unsigned open_containers = 1;
+	for (unsigned i = 0; i < gs->num_nodes && gs->num_nodes < capacity; ++i) {
+		GeneratedNode *parent = gs->nodes + i;
+		if (parent->type == GNODE_PARAGRAPH)
+			continue;
+		open_containers--;
+		unsigned min_children = (fan_out + 1) / 2;
+		unsigned num_children = min_children +
+			gen_random_below(gs, fan_out - min_children + 1);
+		parent->first_child = gs->num_nodes;
+		while (parent->num_children < num_children &&
+			gs->num_nodes < capacity) {
+			GeneratedNode *child = gs->nodes + gs->num_nodes++;
+			child->depth = parent->depth + 1;
+			child->type = gen_choose_type(gs, child->depth);
+			/* Keep at least one container open while there is budget left,
+			 * so that the node count is limited only by depth and fan-out. */
+			bool last = parent->num_children + 1 == num_children;
+			if (last && open_containers == 0 && child->type == GNODE_PARAGRAPH &&
+				child->depth < gs->params->max_depth)
+				child->type = GNODE_VBOX;
+			open_containers += (child->type != GNODE_PARAGRAPH);
+			child->first_child = 0;
+			child->num_children = 0;
+			child->num_images = 0;
+			parent->num_children++;
+		}
+	}
+
+	for (unsigned i = 0; i < p->num_images; ++i)
+		gs->nodes[gen_random_below(gs, gs->num_nodes)].num_images++;
+}
+
+static void gen_write_class_name(GeneratorState *gs, unsigned index)
+{
+	gen_appendf(gs, "c%u", index);
+}
+
+static void gen_write_rules(GeneratorState *gs)
+{
+	const GeneratorParams *p = gs->params;
+	for (unsigned i = 0; i < p->num_rules; ++i) {
+		gen_append(gs, "<rule match=\"");
+		if (p->num_classes != 0) {
+			unsigned a = gen_random_below(gs, p->num_classes);
+			unsigned b = gen_random_below(gs, p->num_classes);
+			switch (i % 4) {
+				case 0:
+					gen_appendf(gs, ".c%u", a);
+					break;
+				case 1:
+					gen_appendf(gs, "p.c%u", a);
+					break;
+				case 2:
+					gen_appendf(gs, ".c%u .c%u", a, b);
+					break;
+				case 3:
+					gen_appendf(gs, "vbox.c%u p", a);
+					break;
+			}
+		} else {
+			static const char * const TAG_SELECTORS[] = {
+				"p", "vbox p", "hbox", "vbox hbox p"
+			};
+			gen_append(gs, TAG_SELECTORS[i % 4]);
+		}
+		gen_append(gs, "\" ");
+		switch ((i / 4) % 4) {
+			case 0:
+				gen_appendf(gs, "color=rgb(%u, %u, %u)",
+					gen_random_below(gs, 256),
+					gen_random_below(gs, 256),
+					gen_random_below(gs, 256));
+				break;
+			case 1:
+				gen_append(gs, "bold=true");
+				break;
+			case 2:
+				gen_appendf(gs, "pad=%u", 1 + gen_random_below(gs, 8));
+				break;
+			case 3:
+				gen_append(gs, "italic=true");
+				break;
+		}
+		gen_append(gs, " />\n");
+	}
+}
+
+static void gen_write_classes(GeneratorState *gs)
+{
+	const GeneratorParams *p = gs->params;
+	if (p->num_classes == 0 || p->classes_per_node == 0)
+		return;
+	gen_append(gs, " class=\"");
+	for (unsigned i = 0; i < p->classes_per_node; ++i) {
+		if (i != 0)
+			gen_append(gs, ", ");
+		gen_write_class_name(gs, gen_random_below(gs, p->num_classes));
+	}
+	gen_append(gs, "\"");
+}
+
+static void gen_write_text(GeneratorState *gs)
+{
+	unsigned num_words = gs->params->paragraph_words;
+	for (unsigned i = 0; i < num_words; ++i) {
+		gen_append(gs, random_word(gen_random(gs)));
+		gen_append(gs, (i + 1) % WORDS_PER_LINE == 0 ? "\n" : " ");
+	}
+}
+
+static void gen_write_node(GeneratorState *gs, const GeneratedNode *node)
+{
+	const char *tag = GNODE_TAGS[node->type];
+	gen_appendf(gs, "<%s", tag);
+	gen_write_classes(gs);
+	gen_append(gs, ">\n");
+	for (unsigned i = 0; i < node->num_images; ++i) {
+		gen_appendf(gs, "<img url=\"stacker://generated/image%u.png\" "
+			"width=32 height=32 />\n", i);
+	}
+	if (node->type == GNODE_PARAGRAPH)
+		gen_write_text(gs);
+	for (unsigned i = 0; i < node->num_children; ++i)
+		gen_write_node(gs, gs->nodes + node->first_child + i);
+	gen_appendf(gs, "</%s>\n", tag);
+}
+
+/* Generates markup for a synthetic document. The result is allocated with
+ * new [] and null terminated. */
+char *generate_document(const GeneratorParams *params, unsigned *out_length)
+{
+	GeneratorState gs;
+	gs.params = params;
+	gs.random_state = params->seed != 0 ? params->seed : 1;
+	gs.nodes = NULL;
+	gs.num_nodes = 0;
+	gs.text = NULL;
+	gs.length = 0;
+	gs.capacity = 0;
+
+	gen_build_tree(&gs);
+	gen_reserve(&gs, gs.num_nodes * (32 + 8 * params->paragraph_words));
+	gen_write_rules(&gs);
+	gen_write_node(&gs, gs.nodes);
+	delete [] gs.nodes;
+
+	if (out_length != NULL)
+		*out_length = gs.length;
+	return gs.text;
+}
+
+} // namespace stkr
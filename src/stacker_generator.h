@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+
+namespace stkr {
+
+/* Parameters controlling the shape and content of a synthetic document. */
+struct GeneratorParams {
+	unsigned seed;             /* Random seed. Equal parameters give equal output. */
+	unsigned num_nodes;        /* Target number of element nodes. */
+	unsigned max_depth;        /* Maximum element nesting depth below the root. */
+	unsigned fan_out;          /* Maximum number of children per container. */
+	unsigned hbox_weight;      /* Relative frequency of <hbox> containers. */
+	unsigned vbox_weight;      /* Relative frequency of <vbox> containers. */
+	unsigned paragraph_weight; /* Relative frequency of <p> leaves. */
+	unsigned num_rules;        /* Number of <rule> elements. */
+	unsigned num_classes;      /* Size of the class vocabulary. */
+	unsigned classes_per_node; /* Classes assigned to each element. */
+	unsigned paragraph_words;  /* Words of text per paragraph. */
+	unsigned num_images;       /* Number of <img> elements. */
+};
+
+/* Associates a parameter name with a field of GeneratorParams, so that tools
+ * can set parameters by name. */
+struct GeneratorParameter {
+	const char *name;
+	unsigned GeneratorParams::*field;
+};
+
+extern const GeneratorParameter GENERATOR_PARAMETERS[];
+extern const unsigned NUM_GENERATOR_PARAMETERS;
+
+void init_generator_params(GeneratorParams *params);
+const GeneratorParameter *find_generator_parameter(const char *name);
+char *generate_document(const GeneratorParams *params, unsigned *out_length);
+
+} // namespace stkr
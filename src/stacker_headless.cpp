@@ -0,0 +1,354 @@
+#if defined(STACKER_HEADLESS)
+
+#include <cstring>
+
+#include <algorithm>
+
+#include <unistd.h>
+
+#include "stacker_headless.h"
+#include "stacker_platform.h"
+
+#define STBI_HEADER_FILE_ONLY
+#include "stb_image.c"
+
+#include "url_cache.h"
+#include "stacker_shared.h"
+#include "stacker_system.h"
+#include "stacker_paragraph.h"
+#include "stacker_encoding.h"
+#include "stacker_util.h"
+
+namespace stkr {
+
+using namespace urlcache;
+
+/* The headless back end never decodes pixels. An image is available once its
+ * header has been read, which is all layout needs. */
+struct NetworkImage {
+	unsigned width;
+	unsigned height;
+	bool available;
+	unsigned use_count;
+};
+
+struct BackEnd {
+	UrlCache *url_cache;
+	int image_notify_id;
+	TextEncoding encoding;
+};
+
+struct BackEndFont {
+	int size;
+	uint16_t flags;
+	bool fixed_pitch;
+};
+
+extern const char * const DEFAULT_FONT_FACE        = "Sans";
+extern const unsigned     DEFAULT_FONT_SIZE        = 16 * 96 / 72;
+extern const unsigned     DEFAULT_FONT_FLAGS       = 0;
+extern const char * const DEFAULT_FIXED_FONT_FACE  = "Mono";
+extern const unsigned     DEFAULT_FIXED_FONT_SIZE  = 16 * 96 / 72;
+extern const unsigned     DEFAULT_FIXED_FONT_FLAGS = 0;
+extern const char * const DEBUG_LABEL_FONT_FACE    = "Mono";
+extern const unsigned     DEBUG_LABEL_FONT_SIZE    = 10 * 96 / 72;
+extern const unsigned     DEBUG_LABEL_FONT_FLAGS   = 0;
+
+/* Advances of the printable ASCII characters in thousandths of an em, taken
+ * from the Helvetica AFM. */
+static const uint16_t ASCII_ADVANCES[0x7F - 0x20] = {
+	 278,  278,  355,  556,  556,  889,  667,  191,  333,  333,  389,  584,  278,  333,  278,  278, // 0x20
+	 556,  556,  556,  556,  556,  556,  556,  556,  556,  556,  278,  278,  584,  584,  584,  556, // 0x30
+	1015,  667,  667,  722,  722,  667,  611,  778,  722,  278,  500,  667,  556,  833,  722,  778, // 0x40
+	 667,  778,  722,  667,  611,  722,  667,  944,  667,  667,  611,  278,  278,  278,  469,  556, // 0x50
+	 333,  556,  556,  500,  556,  556,  278,  556,  556,  222,  222,  500,  222,  833,  556,  556, // 0x60
+	 556,  556,  333,  500,  278,  556,  500,  722,  500,  500,  500,  334,  260,  334,  584        // 0x70
+};
+
+const unsigned FIXED_PITCH_ADVANCE = 600;
+const unsigned WIDE_ADVANCE        = 1000;
+const unsigned DEFAULT_ADVANCE     = 556;
+const unsigned CELL_HEIGHT_PERCENT = 120;
+
+static bool is_fixed_pitch_face(const char *face)
+{
+	static const char * const FIXED_FACES[] = {
+		"Mono", "Consolas", "Courier", "Courier New", "monospace"
+	};
+	for (unsigned i = 0; i < sizeof(FIXED_FACES) / sizeof(FIXED_FACES[0]); ++i)
+		if (strcmp(face, FIXED_FACES[i]) == 0)
+			return true;
+	return false;
+}
+
+/* Returns the advance of a code point in thousandths of an em. */
+static unsigned glyph_advance(const BackEndFont *bef, uint32_t code_point)
+{
+	unsigned advance;
+	if (bef->fixed_pitch)
+		advance = FIXED_PITCH_ADVANCE;
+	else if (code_point >= 0x20 && code_point < 0x7F)
+		advance = ASCII_ADVANCES[code_point - 0x20];
+	else if (code_point >= 0x2E80 && code_point < 0xA000)
+		advance = WIDE_ADVANCE; /* CJK. */
+	else
+		advance = DEFAULT_ADVANCE;
+	if ((bef->flags & STYLE_BOLD) != 0)
+		advance += advance / 20;
+	return advance;
+}
+
+/* Decodes the next character of a string in the back end's encoding. */
+static unsigned decode_character(TextEncoding encoding, const void *text,
+	const void *end, uint32_t *code_point)
+{
+	switch (encoding) {
+		case ENCODING_ASCII:
+		case ENCODING_LATIN1:
+			*code_point = *(const uint8_t *)text;
+			return 1;
+		case ENCODING_UTF8:
+			return utf8_decode((const char *)text, (const char *)end,
+				code_point);
+		case ENCODING_UTF16:
+			return utf16_decode((const uint16_t *)text, code_point);
+		case ENCODING_UTF32:
+			*code_point = *(const uint32_t *)text;
+			return 1;
+		default:
+			assertb(false);
+			*code_point = 0;
+			return 1;
+	}
+}
+
+void *platform_match_font(BackEnd *, const LogicalFont *info)
+{
+	bool match_default = info->face[0] == '\0';
+	const char *face = match_default ? DEFAULT_FONT_FACE : info->face;
+	int size = match_default ? DEFAULT_FONT_SIZE : info->font_size;
+	if (size <= 0)
+		return NULL;
+	BackEndFont *bef = new BackEndFont();
+	bef->size = size;
+	bef->flags = match_default ? (uint16_t)DEFAULT_FONT_FLAGS : info->flags;
+	bef->fixed_pitch = is_fixed_pitch_face(face);
+	return (void *)bef;
+}
+
+void platform_release_font(BackEnd *, void *handle)
+{
+	delete (BackEndFont *)handle;
+}
+
+unsigned platform_measure_text(BackEnd *back_end, void *font_handle,
+	const void *text, unsigned length, unsigned *advances)
+{
+	const BackEndFont *bef = (const BackEndFont *)font_handle;
+	TextEncoding encoding = back_end->encoding;
+	unsigned unit_size = BYTES_PER_CODE_UNIT[encoding];
+	const uint8_t *pos = (const uint8_t *)text;
+	const uint8_t *end = pos + length * unit_size;
+	uint64_t em = uint64_t(bef->size) << TEXT_METRIC_PRECISION;
+	unsigned num_characters = 0;
+	while (pos < end) {
+		uint32_t code_point;
+		unsigned units = decode_character(encoding, pos, end, &code_point);
+		advances[num_characters++] = unsigned(em *
+			glyph_advance(bef, code_point) / 1000);
+		pos += std::max(units, 1u) * unit_size;
+	}
+	return num_characters;
+}
+
+void platform_font_metrics(BackEnd *, void *font_handle,
+	FontMetrics *result)
+{
+	const BackEndFont *bef = (const BackEndFont *)font_handle;
+	uint64_t em = uint64_t(bef->size) << TEXT_METRIC_PRECISION;
+	result->height = unsigned(em * CELL_HEIGHT_PERCENT / 100);
+	result->em_width = result->height;
+}
+
+/*
+ * Network Images
+ */
+
+static unsigned image_url_notify_callback(UrlHandle handle,
+	UrlNotification type, UrlKey, BackEnd *back_end, NetworkImage *ni,
+	UrlFetchState)
+{
+	if (ni != NULL && type == URL_NOTIFY_EVICT)
+		platform_destroy_network_image(back_end, back_end->url_cache, handle);
+	return 0;
+}
+
+static UrlHandle create_network_image_internal(BackEnd *, UrlCache *cache,
+	UrlHandle handle)
+{
+	cache->lock_cache();
+	NetworkImage *image = (NetworkImage *)cache->user_data(handle);
+	if (image == NULL) {
+		image = new NetworkImage();
+		image->width = 0;
+		image->height = 0;
+		image->available = false;
+		image->use_count = 1; /* The handle's reference. */
+		cache->set_user_data(handle, image);
+	}
+	image->use_count++;
+	cache->unlock_cache();
+	return handle;
+}
+
+UrlHandle platform_create_network_image(BackEnd *back_end,
+	UrlCache *cache, const char *url)
+{
+	UrlHandle handle = cache->create_handle(url, -1,
+		URLP_NORMAL, DEFAULT_TTL_SECS,
+		NULL, 0, back_end->image_notify_id,
+		URL_FLAG_DISCARD | URL_FLAG_REUSE_SINK_HANDLE);
+	return create_network_image_internal(back_end, cache, handle);
+}
+
+UrlHandle platform_create_network_image(BackEnd *back_end,
+	UrlCache *cache, UrlKey key)
+{
+	UrlHandle handle = cache->create_handle(key,
+		URLP_NORMAL, DEFAULT_TTL_SECS,
+		NULL, 0, back_end->image_notify_id,
+		URL_FLAG_DISCARD | URL_FLAG_REUSE_SINK_HANDLE);
+	return create_network_image_internal(back_end, cache, handle);
+}
+
+void platform_destroy_network_image(BackEnd *, UrlCache *cache,
+	UrlHandle image_handle)
+{
+	if (cache == NULL || image_handle == INVALID_URL_HANDLE)
+		return;
+	cache->lock_cache();
+	NetworkImage *image = (NetworkImage *)cache->user_data(image_handle);
+	assertb(image != NULL && image->use_count != 0);
+	if (--image->use_count == 0) {
+		delete image;
+		cache->destroy_handle(image_handle);
+	}
+	cache->unlock_cache();
+}
+
+/* Reads the dimensions of an image from its header if the data has arrived. */
+static bool get_network_image_header(UrlCache *cache, UrlHandle image_handle,
+	NetworkImage *image)
+{
+	if (image_handle == INVALID_URL_HANDLE || image == NULL)
+		return false;
+	if (image->available)
+		return true;
+	unsigned data_size;
+	const void *data = cache->lock(image_handle, &data_size);
+	if (data == NULL)
+		return false;
+	int width, height, components;
+	if (stbi_info_from_memory((const stbi_uc *)data, (int)data_size,
+		&width, &height, &components)) {
+		image->width = (unsigned)width;
+		image->height = (unsigned)height;
+		image->available = true;
+	}
+	cache->unlock(image_handle);
+	return image->available;
+}
+
+bool platform_get_network_image_info(BackEnd *, UrlCache *cache,
+	UrlHandle image_handle, unsigned *width, unsigned *height)
+{
+	if (cache == NULL)
+		return false;
+	NetworkImage *image = (NetworkImage *)cache->user_data(image_handle);
+	bool available = get_network_image_header(cache, image_handle, image);
+	if (width != NULL)
+		*width = available ? image->width : 0;
+	if (height != NULL)
+		*height = available ? image->height : 0;
+	return available;
+}
+
+void *platform_get_network_image_data(BackEnd *, UrlCache *cache,
+	UrlHandle image_handle)
+{
+	if (cache == NULL)
+		return NULL;
+	NetworkImage *ni = (NetworkImage *)cache->user_data(image_handle);
+	bool available = get_network_image_header(cache, image_handle, ni);
+	return available ? (void *)ni : NULL;
+}
+
+void platform_test_network_image(FILE *os)
+{
+	static const char * const IMAGE_URLS[] = {
+		"http://upload.wikimedia.org/wikipedia/commons/4/43/07._Camel_Profile%2C_near_Silverton%2C_NSW%2C_07.07.2007.jpg",
+		"http://upload.wikimedia.org/wikipedia/commons/3/36/Eryops_-_National_Museum_of_Natural_History_-_IMG_1974.JPG",
+		"http://en.wikipedia.org/wiki/File:Russet_potato_cultivar_with_sprouts.jpg"
+	};
+	static const unsigned NUM_IMAGE_URLS = sizeof(IMAGE_URLS) / sizeof(IMAGE_URLS[0]);
+	static const unsigned POLL_INTERVAL_MSEC = 100;
+	static const unsigned RUN_TIME_MSEC = 15 * 1000;
+
+	UrlCache cache;
+	BackEnd *back_end = headless_init(&cache);
+
+	UrlHandle images[NUM_IMAGE_URLS];
+	void *image_data[NUM_IMAGE_URLS];
+	for (unsigned i = 0; i < NUM_IMAGE_URLS; ++i) {
+		images[i] = platform_create_network_image(back_end, &cache, IMAGE_URLS[i]);
+		image_data[i] = NULL;
+	}
+	for (unsigned poll_count = 0; ; ++poll_count) {
+		unsigned elapsed = poll_count * POLL_INTERVAL_MSEC;
+		if (elapsed > RUN_TIME_MSEC)
+			break;
+		float elapsed_secs = float(elapsed) * 1e-3f;
+		for (unsigned i = 0; i < NUM_IMAGE_URLS; ++i) {
+			void *new_data = platform_get_network_image_data(back_end,
+				&cache, images[i]);
+			if (new_data == image_data[i])
+				continue;
+			fprintf(os, "[%3.2f] Image data for %s changed to %p.\n",
+				elapsed_secs, IMAGE_URLS[i], new_data);
+			if (new_data != NULL) {
+				const NetworkImage *ni = (const NetworkImage *)new_data;
+				fprintf(os, "\tImage is %ux%u.\n", ni->width, ni->height);
+			}
+			image_data[i] = new_data;
+		}
+		cache.update();
+		usleep(POLL_INTERVAL_MSEC * 1000);
+	}
+	for (unsigned i = 0; i < NUM_IMAGE_URLS; ++i)
+		platform_destroy_network_image(back_end, &cache, images[i]);
+	headless_deinit(back_end);
+}
+
+BackEnd *headless_init(UrlCache *url_cache, TextEncoding encoding)
+{
+	BackEnd *be = new BackEnd();
+	be->encoding = encoding;
+	be->url_cache = url_cache;
+	be->image_notify_id = INVALID_NOTIFY_SINK_ID;
+	if (url_cache != NULL) {
+		be->image_notify_id = url_cache->add_notify_sink(
+			(NotifyCallback)&image_url_notify_callback, be);
+	}
+	return be;
+}
+
+void headless_deinit(BackEnd *be)
+{
+	if (be->image_notify_id != INVALID_NOTIFY_SINK_ID)
+		be->url_cache->remove_notify_sink(be->image_notify_id);
+	delete be;
+}
+
+} // namespace stkr
+
+#endif // defined(STACKER_HEADLESS)
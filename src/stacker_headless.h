@@ -0,0 +1,15 @@
+#pragma once
+
+#include "stacker.h"
+
+namespace urlcache { class UrlCache; }
+
+namespace stkr {
+
+struct BackEnd;
+
+BackEnd *headless_init(urlcache::UrlCache *url_cache = 0, 
+	TextEncoding encoding = ENCODING_UTF8);
+void headless_deinit(BackEnd *back_end);
+
+} // namespace stkr
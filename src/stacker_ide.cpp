@@ -336,19 +336,37 @@ static void gui_update_document(GuiState *state)
 
 	char message[MAX_ERROR_LENGTH];
 	gui_end_test(state);
-	reset_document(state->document);
-	int code = parse(
+
+	/* Find the edited range by comparing the new text with the source the
+	 * document was last parsed from, so that only the element around the edit
+	 * is parsed again. */
+	unsigned old_length = 0;
+	const char *old_source = get_source(state->document, &old_length);
+	const char *new_source = (const char *)state->source;
+	unsigned new_length = state->source_length;
+	unsigned prefix = 0;
+	while (prefix < old_length && prefix < new_length && 
+		old_source[prefix] == new_source[prefix])
+		++prefix;
+	unsigned suffix = 0;
+	while (suffix < old_length - prefix && suffix < new_length - prefix &&
+		old_source[old_length - suffix - 1] == 
+		new_source[new_length - suffix - 1])
+		++suffix;
+	int code = reparse(
 		state->system, 
 		state->document, 
-		get_root(state->document), 
-		(const char *)state->source, 
-		state->source_length, 
+		new_source, 
+		new_length, 
+		prefix, 
+		old_length - suffix, 
+		new_length - suffix, 
 		message, MAX_ERROR_LENGTH);
 	state->parse_code = code;
 	if (code != STKR_OK) {
-		gui_dump_append(state, "parse() returned code %d: %s\n", code, message);
+		gui_dump_append(state, "reparse() returned code %d: %s\n", code, message);
 	} else {
-		gui_dump_append(state, "parse() returned STKR_OK.\n");
+		gui_dump_append(state, "reparse() returned STKR_OK.\n");
 	}
 	InvalidateRect(state->dialog_window, &state->frame_rect, FALSE);
 }
@@ -696,7 +714,8 @@ static BOOL CALLBACK gui_control_group_dialog_proc(HWND hwnd, unsigned message,
 					matched_nodes, MAX_MATCHED_NODES, -1);
 				if (rc >= 0) {
 					gui_dump_set(state, "Selector \"%s\" matched %d nodes:\n", selector, rc);
-					for (unsigned i = 0; i < (unsigned)rc; ++i) {
+					unsigned num_listed = std::min((unsigned)rc, MAX_MATCHED_NODES);
+					for (unsigned i = 0; i < num_listed; ++i) {
 						gui_dump_append(state, "%3u: %s\n", i, 
 							get_node_debug_string(matched_nodes[i]));
 					}
@@ -117,8 +117,8 @@ static unsigned build_paragraph_elements(Document *document,
 	uint32_t ch;
 	do {
 		ch = text_iterator_next(&ti);
-	} while (ch != END_OF_STREAM && 
-		(unicode_isspace(ch) || mode == WSM_PRESERVE));
+	} while (ch != END_OF_STREAM && unicode_isspace(ch) && 
+		mode != WSM_PRESERVE);
 
 	unsigned num_elements = 0;
 	Node *child = NULL;
@@ -146,9 +146,9 @@ static unsigned build_paragraph_elements(Document *document,
 			}
 		} else {
 			e.penalty_type = (ch == '\n') ? PENALTY_FORCE_BREAK : PENALTY_NONE;
-			ch = text_iterator_next(&ti);
-			if (ch == '\r')
-				continue; /* Normalize \r\n to \n. */
+			do {
+				ch = text_iterator_next(&ti);
+			} while (ch == '\r'); /* Normalize \r\n to \n. */
 		}
 
 		elements[num_elements++] = e;
@@ -319,6 +319,9 @@ static void grow_measurement_buffer(TextMeasurementState *ms,
  * into the corresponding paragraph elements. */
 static void measure_element_group(TextMeasurementState *ms, unsigned text_length)
 {
+	UpdateStats *stats = document_stats(ms->iterator.document);
+	stats->text_measurements++;
+	stats->characters_measured += text_length;
 	unsigned num_characters = measure_text(ms->iterator.document->system, 
 		ms->iterator.style->font_id, ms->buffer, text_length, ms->advances);
 	for (unsigned i = 0, j = 0; i < ms->iterator.count; ++i) {
@@ -812,6 +815,7 @@ static bool next_line(InlineBoxUpdateState *s)
 	/* If the line must be visited for rebuild, add it at the tail of the build 
 	 * queue. */
 	if (rebuild) {
+		document->update_stats.lines_rebuilt++;
 		update_line_box(s, container, pl, s->line_number, lb);
 		build_queue_push(s, pl, lb);
 	}
@@ -1093,12 +1097,12 @@ void destroy_inline_context(Document *document, Node *node)
 /* Rebuilds the inline context of a text container node. */
 void rebuild_inline_context(Document *document, Node *node)
 {
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 	if (node->icb != NULL) {
 		destroy_line_list(node->icb->lines);
-		assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+		assert_heap(); /* FIXME: DEBUG. */
 		delete [] (char *)node->icb;
-		assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+		assert_heap(); /* FIXME: DEBUG. */
 		node->icb = NULL;
 	}
 
@@ -1110,7 +1114,7 @@ void rebuild_inline_context(Document *document, Node *node)
 		 
 	unsigned num_elements = determine_paragraph_buffer_size(document, 
 		node, space_mode);
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 
 	unsigned bytes_required = sizeof(InlineContext);
 	bytes_required += num_elements * sizeof(ParagraphElement);
@@ -1122,20 +1126,32 @@ void rebuild_inline_context(Document *document, Node *node)
 	block += num_elements * sizeof(ParagraphElement);
 	icb->lines = NULL;
 
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 	build_paragraph_elements(document, node, space_mode, icb->elements);
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 
 	node->icb = icb;
 	node->t.flags &= ~NFLAG_RECONSTRUCT_PARAGRAPH;
 	node->t.flags |= NFLAG_REMEASURE_PARAGRAPH_ELEMENTS;
-
+	invalidate_paragraph_layout(document, node);
 	Box *box = node->t.counterpart.box;
-	if (box != NULL) {
-		box->layout_flags &= ~(BLFLAG_TEXT_VALID | BLFLAG_INLINE_BOXES_VALID);
+	if (box != NULL)
 		box->t.flags &= ~BOXFLAG_SAME_PARAGRAPH;
-	}
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
+}
+
+/* Invalidates the layout of an inline container whose paragraph elements have
+ * been rebuilt or must be remeasured. The container's preferred and intrinsic
+ * sizes depend on the elements as they would on the sizes of child boxes. */
+void invalidate_paragraph_layout(Document *document, Node *node)
+{
+	Box *box = node->t.counterpart.box;
+	if (box == NULL)
+		return;
+	unsigned content_sizes = axismask(AXISFLAG_PREFERRED_VALID | 
+		AXISFLAG_INTRINSIC_VALID);
+	clear_flags(document, box, BLFLAG_TEXT_VALID | BLFLAG_INLINE_BOXES_VALID | 
+		content_sizes, 0);
 }
 
 /* Resolves a document space horizontal position into a caret position within
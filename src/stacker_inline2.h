@@ -81,6 +81,7 @@ VisualLayer *update_box_text_layer(Document *document, Box *box);
 VisualLayer *require_selection_layer(Document *document, Box *box);
 void destroy_inline_context(Document *document, Node *node);
 void rebuild_inline_context(Document *document, Node *node);
+void invalidate_paragraph_layout(Document *document, Node *node);
 CaretAddress caret_position(Document *document, const Box *box, float x);
 void set_selected_element_range(Document *document, Node *node, 
 	CaretAddress start, CaretAddress end);
@@ -101,10 +101,16 @@ void compute_layer_position(const Box *box, const LayerPosition *lp,
 VisualLayer *create_layer(Document *document, const Node *node, 
 	VisualLayerType type, unsigned extra)
 {
-	document; node; 
-
-	VisualLayer *layer = (VisualLayer *)(new char[sizeof(VisualLayer) + extra]);
+	node; 
+
+	/* Pane and image layers have a fixed size and share one class. Text 
+	 * layers are bucketed by the size of their character data. */
+	unsigned size = sizeof(VisualLayer) + extra;
+	unsigned size_class = arena_size_class(size);
+	VisualLayer *layer = (VisualLayer *)arena_allocate(&document->layer_arena,
+		size_class, size);
 	layer->type = type;
+	layer->size_class = size_class;
 	layer->next[VLCHAIN_BOX] = NULL;
 	layer->next[VLCHAIN_NODE] = NULL;
 	layer->flags = 0;
@@ -136,7 +142,7 @@ void destroy_layer(Document *document, VisualLayer *layer)
 	assertb((layer->flags & (VLFLAG_IN_BOX_CHAIN | VLFLAG_IN_NODE_CHAIN)) == 0);
 	if (layer->type == VLT_IMAGE)
 		clear_image_layer_url(document, layer);
-	delete [] (char *)layer;
+	arena_free(&document->layer_arena, layer, layer->size_class);
 }
 
 void release_layer(Document *document, VisualLayer *layer)
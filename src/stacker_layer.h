@@ -96,7 +96,8 @@ struct VisualLayer {
 	VisualLayerType type :  4;
 	LayerKey key         :  4;
 	int depth_offset     :  8;
-	unsigned flags       : 12;
+	unsigned flags       :  7;
+	unsigned size_class  :  5;
 	VisualLayer *next[2];
 	union {
 		PaneLayer pane;
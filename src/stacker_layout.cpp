@@ -195,11 +195,16 @@ static unsigned modify_clear(Document *, Box *box, Axis axis,
 	unsigned to_clear, unsigned cleared_in_child)
 {
 	unsigned valid_mask = axisflag(axis, AXISFLAG_ALL_VALID_MASK);
+	unsigned cleared_here = to_clear;
 
 	cleared_in_child = normalize_clear(box, axis, cleared_in_child);
 	if ((cleared_in_child & valid_mask) != 0) {
 		/* The containing box must be visited. */
 		to_clear |= BLFLAG_TREE_VALID;
+		/* Preferred and intrinsic sizes are always computed from the 
+		 * children's, even if the extrinsic size isn't. */
+		to_clear |= cleared_in_child & axisflag(axis, 
+			AXISFLAG_PREFERRED_VALID | AXISFLAG_INTRINSIC_VALID);
 		/* A child size has changed. If this box is sized from its children,
 		 * then its size may also have changed. */
 		if ((box->layout_flags & axisflag(axis, AXISFLAG_DEPENDS_ON_CHILDREN)) != 0)
@@ -219,7 +224,9 @@ static unsigned modify_clear(Document *, Box *box, Axis axis,
 		BLFLAG_LAYOUT_INFO_VALID | BLFLAG_TREE_VALID | 
 		BLFLAG_TREE_BOUNDS_VALID | BLFLAG_TREE_CLIP_VALID);
 
-	if ((to_clear & valid_mask) != 0) {
+	/* Sizes cleared only because a child's changed will be recomputed, and 
+	 * their dependents notified, by the sizing pass if their values change. */
+	if ((cleared_here & valid_mask) != 0) {
 		/* The size of dependent children must be recalculated. */
 		if ((box->layout_flags & axisflag(axis, AXISFLAG_HAS_DEPENDENT_CHILD)) != 0)
 			to_clear |= axisflag(axis, AXISFLAG_CHILD_SIZES_NOT_INVALIDATED) | BLFLAG_TREE_VALID;
@@ -439,6 +446,7 @@ static void notify_extrinsic_changed(SizingFrame *frame, Box *box, Axis axis)
 	 * flag on the node, and expansion flags in the node's parent chain. */
 	if (is_main_box(box)) {
 		box->t.counterpart.node->t.flags |= (NFLAG_WIDTH_CHANGED << axis);
+		mark_node_dirty(box->t.counterpart.node);
 		propagate_expansion_flags(box->t.counterpart.node, 1 << axis);
 	}
 
@@ -487,8 +495,10 @@ static bool set_box_position(Document *document, Box *box, float a, float b,
 		/* If this box is the primary box of its owning node, and it has moved, 
 		 * the node needs to rebuild visual layers that depend on the document 
 		 * position of its box. */
-		if (is_main_box(box))
+		if (is_main_box(box)) {
 			box->t.counterpart.node->t.flags |= NFLAG_UPDATE_BOX_LAYERS;
+			mark_node_dirty(box->t.counterpart.node);
+		}
 	} else if (box->cell_code == INVALID_CELL_CODE) {
 		/* The box hasn't moved, but it isn't in the grid (boxes are removed
 		 * from the grid when they are hidden or change parents). Now we know
@@ -703,8 +713,8 @@ static bool update_extrinsic_size(IncrementalLayoutState *s, Document *d,
 		}
 	}
 	new_size = apply_min_max(box, axis, new_size);
-	set_size(box, SSLOT_EXTRINSIC, axis, new_size);
-	notify_extrinsic_changed(frame, box, axis);
+	if (set_size(box, SSLOT_EXTRINSIC, axis, new_size))
+		notify_extrinsic_changed(frame, box, axis);
 	return true;
 }
 
@@ -902,6 +912,7 @@ static SizingFrame *push_sizing_frame(IncrementalLayoutState *s,
 	SizingStage stage, unsigned parent_lflags, unsigned frame_flags)
 {
 	SizingFrame *f = (SizingFrame *)tree_iterator_push(&s->iterator);
+	document_stats(s->iterator.document)->sizing_frame_pushes++;
 	f->stage = stage;
 	f->jump_stage = SSTG_COMPLETE;
 	frame_flags = down_propagate_repeat_flags(frame_flags);
@@ -1196,8 +1207,11 @@ static void complete_ideal_break(IncrementalLayoutState *s,
 	/* A shrink fit intrinsic width on a paragraph is set to the corresponding 
 	 * preferred width, because it would not otherwise be set by the bottom-up 
 	 * sizing process. Shrink fit heights are different. They are computed by
-	 * the final break. */
-	if (box->axes[AXIS_H].mode_dim <= DMODE_SHRINK && 
+	 * the final break. DMODE_GROW widths are set by compute_trivial_sizes(), 
+	 * or by maybe_handle_unbounded_grow_width() if there is no width bound, 
+	 * and must not be replaced here. */
+	DimensionMode mode = (DimensionMode)box->axes[AXIS_H].mode_dim;
+	if (mode <= DMODE_SHRINK && mode != DMODE_GROW && 
 		set_size(box, SSLOT_INTRINSIC, AXIS_H, (float)width))
 		notify_intrinsic_changed(frame, box, AXIS_H);
 }
@@ -1388,6 +1402,32 @@ static void position_children(Document *document, Box *box)
 	}
 }
 
+/* Records the sizing stage of the current box in the trace. Stages that 
+ * process the text of an inline container are labelled with the container. */
+static void trace_sizing_stage(Document *document, Box *box, SizingStage stage)
+{
+	static const char * const SIZING_STAGE_NAMES[] = {
+		"SSTG_EXTRINSIC_MAIN",
+		"SSTG_EXTRINSIC",
+		"SSTG_INDEPENDENT_EXTRINSIC",
+		"SSTG_BREAK_FINAL",
+		"SSTG_DO_FLEX",
+		"SSTG_VISIT_CHILDREN",
+		"SSTG_INTRINSIC_MAIN",
+		"SSTG_TEXT_MEASUREMENT",
+		"SSTG_BREAK_IDEAL",
+		"SSTG_INLINE_BOX_UPDATE",
+		"SSTG_COMPLETE"
+	};
+
+	char args[MAX_TRACE_ARGS];
+	args[0] = '\0';
+	if (stage == SSTG_TEXT_MEASUREMENT || stage == SSTG_BREAK_IDEAL ||
+		stage == SSTG_BREAK_FINAL || stage == SSTG_INLINE_BOX_UPDATE)
+		trace_node_args(document, box->t.counterpart.node, args, sizeof(args));
+	trace_stage(document, TRACE_SIZING_STAGE, SIZING_STAGE_NAMES[stage], args);
+}
+
 /* Performs one step in an incremental size update. Returns true if the update
  * is complete. */
 static bool continue_size_update(IncrementalLayoutState *s, Document *document)
@@ -1403,6 +1443,8 @@ static bool continue_size_update(IncrementalLayoutState *s, Document *document)
 	Box *box = s->box;
 	bool handled = false;
 	do {
+		if (tracing(document))
+			trace_sizing_stage(document, box, frame->stage);
 		switch (frame->stage) {
 			case SSTG_EXTRINSIC_MAIN:    
 			case SSTG_EXTRINSIC:
@@ -1561,6 +1603,8 @@ static void begin_info_update_stage(IncrementalLayoutState *s,
 		sizeof(InfoUpdateFrame));
 	s->box = root;
 	s->layout_stage = LSTG_UPDATE_INFO;
+	notify_update_stage(document, USTG_LAYOUT_UPDATE_INFO);
+	trace_stage(document, TRACE_LAYOUT_STAGE, "LSTG_UPDATE_INFO");
 
 	/* Create a frame for the root. */
 	InfoUpdateFrame *frame = (InfoUpdateFrame *)tree_iterator_push(&s->iterator);
@@ -1578,6 +1622,8 @@ static void begin_sizing_stage(IncrementalLayoutState *s,
 		sizeof(SizingFrame));
 	s->box = root;
 	s->layout_stage = LSTG_COMPUTE_SIZES;
+	notify_update_stage(document, USTG_LAYOUT_COMPUTE_SIZES);
+	trace_stage(document, TRACE_LAYOUT_STAGE, "LSTG_COMPUTE_SIZES");
 	push_sizing_frame(s, SSTG_EXTRINSIC_MAIN, root->layout_flags, 0);
 }
 
@@ -1594,6 +1640,8 @@ static void begin_bounds_update_stage(IncrementalLayoutState *s,
 		tree_iterator_push(&s->iterator);
 	frame->parent_valid = true;
 	s->layout_stage = LSTG_COMPUTE_BOUNDS;
+	notify_update_stage(document, USTG_LAYOUT_COMPUTE_BOUNDS);
+	trace_stage(document, TRACE_LAYOUT_STAGE, "LSTG_COMPUTE_BOUNDS");
 }
 
 /* Starts the clip/depth update stage in an incremental layout. */
@@ -1612,6 +1660,8 @@ static void begin_clip_update_stage(IncrementalLayoutState *s,
 	frame->depth = 0;
 	frame->must_update = false;
 	s->layout_stage = LSTG_UPDATE_CLIP;
+	notify_update_stage(document, USTG_LAYOUT_UPDATE_CLIP);
+	trace_stage(document, TRACE_LAYOUT_STAGE, "LSTG_UPDATE_CLIP");
 }
 
 /* Finalizes an incremental layout. */
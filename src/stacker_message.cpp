@@ -24,9 +24,9 @@ bool is_keyboard_message(MessageType type)
 
 void init_message_queue(MessageQueue *queue, unsigned capacity)
 {
-	assertb(capacity != 0);
-	capacity = next_power_of_two(capacity);
-	queue->messages = new Message[capacity];
+	/* A zero capacity queue allocates nothing until the first message. */
+	capacity = capacity != 0 ? next_power_of_two(capacity) : 0;
+	queue->messages = capacity != 0 ? new Message[capacity] : NULL;
 	queue->capacity = capacity;
 	queue->head = 0;
 	queue->tail = 0;
@@ -47,19 +47,21 @@ void enqueue_message(MessageQueue *queue, const Message *message)
 {
 	unsigned mask = queue->capacity - 1;
 	unsigned next = (queue->tail + 1) & mask;
-	if (next == queue->head) {
+	if (next == queue->head || queue->capacity == 0) {
 		unsigned new_capacity = std::max(2 * queue->capacity, 
 			DEFAULT_MESSAGE_QUEUE_CAPACITY);
-		Message *messages = new Message[new_capacity], *m = messages;
-		do {
-			*m++ = queue->messages[queue->head];
+		Message *messages = new Message[new_capacity];
+		unsigned count = 0;
+		while (queue->head != queue->tail) {
+			messages[count++] = queue->messages[queue->head];
 			queue->head = (queue->head + 1) & mask;
-		} while (queue->head != queue->tail);
+		}
+		delete [] queue->messages;
 		queue->messages = messages;
 		queue->head = 0;
-		queue->tail = queue->capacity;
+		queue->tail = count;
 		queue->capacity = new_capacity;
-		next = (queue->tail + 1) & (new_capacity - 1);
+		next = (count + 1) & (new_capacity - 1);
 	}
 	queue->messages[queue->tail] = *message;
 	queue->tail = next;
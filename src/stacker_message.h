@@ -8,7 +8,7 @@ struct Document;
 struct Node;
 struct Box;
 struct View;
-enum NavigationState;
+enum NavigationState : int;
 
 enum MessageType {
 	/* Mouse messages. */
@@ -67,6 +67,8 @@ unsigned get_text_length(const Node *node)
 	return node->text_length;
 }
 
+/* Returns a node's text, which is not null terminated if the document was 
+ * parsed with DOCFLAG_SHARE_SOURCE_TEXT. Use get_text_length(). */
 const char *get_text(const Node *node)
 {
 	return node->text;
@@ -142,7 +144,8 @@ Node *last_child(Node *node)
 	return node->t.last.node;
 }
 
-static bool refold_attributes(Document *document, Node *base);
+static bool refold_attributes(Document *document, Node *base, 
+	Layout *requested = 0);
 
 /* Searches for an attribute in the buffers of a node and its matched rules. */
 const Attribute *find_attribute(const Node *node, int name)
@@ -279,16 +282,34 @@ int fold_string_attribute(Document *document, Node *node, int name,
 	return rc;
 }
 
+static void free_node_text(Node *node)
+{
+	if ((node->t.flags & NFLAG_HAS_STATIC_TEXT) == 0 && !node->shared_text)
+		delete [] node->text;
+}
+
+/* Makes a new node's text refer to a buffer that outlives the node, like the
+ * document's copy of its source, rather than to a copy. Shared text is not 
+ * null terminated. set_node_text() gives the node a private copy. */
+void share_node_text(Node *node, const char *text, uint32_t length)
+{
+	free_node_text(node);
+	node->text = const_cast<char *>(text);
+	node->text_length = length;
+	node->t.flags &= ~NFLAG_HAS_STATIC_TEXT;
+	node->shared_text = 1;
+}
+
 /* Sets a node's text buffer. */
 void set_node_text(Document *document, Node *node, const char *text, int length)
 {
 	if (length < 0)
 		length = (int)strlen(text);
-	if (length + 1 > (int)node->text_length) {
-		if ((node->t.flags & NFLAG_HAS_STATIC_TEXT) == 0)
-			delete [] node->text;
+	if (length + 1 > (int)node->text_length || node->shared_text) {
+		free_node_text(node);
 		node->text = new char[length + 1];
 		node->t.flags &= ~NFLAG_HAS_STATIC_TEXT;
+		node->shared_text = 0;
 	}
 	memcpy(node->text, text, length);
 	node->text[length] = '\0';
@@ -342,6 +363,23 @@ static unsigned sort_attribute_buffers(const Node *node,
 	return num_buffers;
 }
 
+/* Returns the offset of the first attribute in a node's buffer that isn't the
+ * result of a fold. Folded attributes precede those the node defines. */
+static unsigned own_attributes_offset(const Node *node, 
+	unsigned *num_folded = 0)
+{
+	const Attribute *a = abuf_first(&node->attributes);
+	unsigned count = 0;
+	while (a != NULL && a->folded) {
+		a = abuf_next(&node->attributes, a);
+		count++;
+	}
+	if (num_folded != NULL)
+		*num_folded = count;
+	return a != NULL ? unsigned((const char *)a - node->attributes.buffer) : 
+		unsigned(node->attributes.size);
+}
+
 const Attribute *node_first_attribute(const Node *node, AttributeIterator *ai)
 {
 	refold_attributes((Document *)node->document, (Node *)node);
@@ -402,6 +440,7 @@ struct AttributeFoldingState {
 
 	/* Working state used to build the style. */
 	NodeStyle style;
+	Layout layout; /* Requested by the folded attributes. */
 	const NodeStyle *inherited;
 	LogicalFont descriptor;
 	bool have_font_face;
@@ -740,6 +779,7 @@ static void afs_reduce(AttributeFoldingState *fs)
 		end = abuf_next(dest, end);
 	abuf_replace_range(dest, abuf_first(dest), end, &working);
 	abuf_clear(&working);
+	fs->layout = new_layout;
 
 	/* Update the layout mode. If the new mode is no-layout, leave the styles
 	 * as they are. This is a trick to avoid layout when a node is hidden
@@ -767,20 +807,216 @@ static void afs_init(AttributeFoldingState *fs, Node *base)
 	fs->must_update_font_id = (fs->style.text.font_id == INVALID_FONT_ID);
 }
 
-static void afs_finalize(AttributeFoldingState *fs)
+/* Stores a node's computed style, invalidating text layers and layout 
+ * depending on what changed. */
+static void store_node_style(Node *base, const NodeStyle *style)
 {
-	afs_maybe_update_font(fs);
-	/* Store the final style, invalidating text layers and layout depending on 
-	 * what changed. */
-	Node *base = fs->base;
-	unsigned diff = compare_styles(&fs->style, &base->style);
+	unsigned diff = compare_styles(style, &base->style);
 	if (diff != 0) {
 		if ((diff & STYLECMP_MUST_RETOKENIZE) != 0)
 			base->t.flags |= NFLAG_RECONSTRUCT_PARAGRAPH;
 		if ((diff & STYLECMP_MUST_REMEASURE) != 0)
 			base->t.flags |= NFLAG_REMEASURE_PARAGRAPH_ELEMENTS;
-		base->style = fs->style;
+		base->style = *style;
+	}
+}
+
+static void afs_finalize(AttributeFoldingState *fs)
+{
+	afs_maybe_update_font(fs);
+	store_node_style(fs->base, &fs->style);
+}
+
+void style_cache_clear(StyleCache *cache)
+{
+	memset(cache->entries, 0, sizeof(cache->entries));
+}
+
+void destroy_style_cache(Document *document)
+{
+	delete document->style_cache;
+	document->style_cache = NULL;
+}
+
+/* Returns the document's style cache, allocating it if necessary. */
+static StyleCache *get_style_cache(Document *document)
+{
+	if (document->style_cache == NULL) {
+		document->style_cache = new StyleCache();
+		style_cache_clear(document->style_cache);
+	}
+	return document->style_cache;
+}
+
+/* Mixes a value into a hash. The result depends on the order of mixing. */
+inline uint64_t hash_combine(uint64_t hash, uint64_t value)
+{
+	return (hash ^ value) * 0x9E3779B97F4A7C15ull + (hash >> 29);
+}
+
+/* Packs the fields of a style into words that can be hashed and compared. */
+static void pack_node_style(const NodeStyle *style, 
+	uint32_t fields[PACKED_STYLE_WORDS])
+{
+	fields[0] = style->flags | (style->justification << 10) | 
+		(style->white_space_mode << 12) | (style->wrap_mode << 14);
+	fields[1] = uint16_t(style->text.font_id) | (style->text.flags << 16);
+	fields[2] = style->text.color;
+	fields[3] = style->text.tint;
+	fields[4] = uint16_t(style->hanging_indent) | 
+		(uint32_t(uint16_t(style->leading)) << 16);
+}
+
+static uint64_t hash_node_style(const NodeStyle *style)
+{
+	uint32_t fields[PACKED_STYLE_WORDS];
+	pack_node_style(style, fields);
+	return murmur3_64(fields, sizeof(fields));
+}
+
+/* Combines a rule's revision and enabled state. A fold depends on both. */
+inline uint64_t rule_stamp(const Rule *rule)
+{
+	return rule->revision | (uint64_t(rule->flags & RFLAG_ENABLED) << 32);
+}
+
+/* Hashes the attributes that the children of a folded node can inherit from
+ * it, that is the inheritable attributes of the node and its matched rules, 
+ * with the same hash of its parent. Two nodes with equal hashes pass on the 
+ * same attributes. */
+static uint64_t make_inheritance_hash(const Node *node)
+{
+	const Node *parent = node->t.parent.node;
+	uint64_t hash = parent != NULL ? parent->inheritance_hash : 0;
+	const AttributeBuffer *buffers[1 + NUM_RULE_SLOTS];
+	unsigned num_buffers = sort_attribute_buffers(node, buffers);
+	for (unsigned i = 0; i < num_buffers; ++i) {
+		for (const Attribute *a = abuf_first(buffers[i]); a != NULL; 
+			a = abuf_next(buffers[i], a)) {
+			if (is_inheritable(a->name))
+				hash = hash_combine(hash, 
+					murmur3_64(a, sizeof(Attribute) + a->size));
+		}
+	}
+	return hash;
+}
+
+/* Hashes the inputs to a fold of a node's attributes: the style and 
+ * inheritable attributes of its parent, its type, the attributes it defines,
+ * and its matched rules. Rules are identified by address and revision, which
+ * together are never reused. */
+static uint64_t make_style_cache_key(const Node *node)
+{
+	const Node *parent = node->t.parent.node;
+	uint64_t hash = node->type;
+	if (parent != NULL) {
+		hash = hash_combine(hash, parent->inheritance_hash);
+		hash = hash_combine(hash, hash_node_style(&parent->style));
+	}
+	unsigned offset = own_attributes_offset(node);
+	hash = hash_combine(hash, murmur3_64(node->attributes.buffer + offset, 
+		node->attributes.size - offset));
+	for (unsigned i = 0; i < node->num_matched_rules; ++i) {
+		const Rule *rule = node->rule_slots[i].rule;
+		hash = hash_combine(hash, uint64_t(uintptr_t(rule)));
+		hash = hash_combine(hash, rule_stamp(rule));
+	}
+	return hash != 0 ? hash : 1;
+}
+
+/* True if the fold inputs stored in a style cache entry are those of a node. */
+static bool style_cache_inputs_match(const StyleCacheEntry *entry, 
+	const Node *node)
+{
+	const Node *parent = node->t.parent.node;
+	unsigned offset = own_attributes_offset(node);
+	unsigned own_size = node->attributes.size - offset;
+	if (entry->type != node->type || 
+		entry->has_parent != (parent != NULL) ||
+		entry->num_rules != node->num_matched_rules ||
+		entry->own_size != own_size)
+		return false;
+	if (parent != NULL) {
+		uint32_t parent_style[PACKED_STYLE_WORDS];
+		pack_node_style(&parent->style, parent_style);
+		if (entry->parent_inheritance_hash != parent->inheritance_hash ||
+			memcmp(entry->parent_style, parent_style, 
+				sizeof(parent_style)) != 0)
+			return false;
 	}
+	for (unsigned i = 0; i < node->num_matched_rules; ++i) {
+		const Rule *rule = node->rule_slots[i].rule;
+		bool enabled = (entry->rules_enabled & (1 << i)) != 0;
+		if (entry->rules[i] != rule || 
+			entry->rule_revisions[i] != rule->revision ||
+			enabled != ((rule->flags & RFLAG_ENABLED) != 0))
+			return false;
+	}
+	return own_size == 0 || 
+		memcmp(entry->data, node->attributes.buffer + offset, own_size) == 0;
+}
+
+/* Gives a node the folded attributes and style in a style cache entry. The
+ * style of a node without layout is left as it is, as by afs_reduce(). */
+static void apply_cached_style(Document *document, Node *base, 
+	const StyleCacheEntry *entry)
+{
+	AttributeBuffer folded;
+	folded.buffer = (char *)entry->data + entry->own_size;
+	folded.size = entry->folded_size;
+	folded.capacity = entry->folded_size;
+	folded.num_attributes = entry->num_folded;
+	AttributeBuffer *dest = &base->attributes;
+	const Attribute *end = (const Attribute *)(dest->buffer + 
+		own_attributes_offset(base));
+	abuf_replace_range(dest, abuf_first(dest), end, &folded);
+	if (maybe_switch_layout(document, base, (Layout)entry->layout))
+		base->t.flags |= NFLAG_RECOMPOSE_CHILD_BOXES;
+	if (base->layout != LAYOUT_NONE)
+		store_node_style(base, &entry->style);
+	base->inheritance_hash = entry->inheritance_hash;
+}
+
+/* Stores the inputs and result of a fold in a style cache entry. Nodes 
+ * without layout aren't stored, because the fold leaves their styles 
+ * unchanged, and nor are nodes whose own and folded attributes together don't
+ * fit in an entry. */
+static void style_cache_insert(StyleCacheEntry *entry, uint64_t key, 
+	const Node *base, Layout requested)
+{
+	unsigned num_folded;
+	unsigned folded_size = own_attributes_offset(base, &num_folded);
+	unsigned own_size = base->attributes.size - folded_size;
+	if (base->layout == LAYOUT_NONE || 
+		own_size + folded_size > STYLE_CACHE_DATA_SIZE)
+		return;
+	entry->key = key;
+	const Node *parent = base->t.parent.node;
+	entry->has_parent = (parent != NULL);
+	if (parent != NULL) {
+		entry->parent_inheritance_hash = parent->inheritance_hash;
+		pack_node_style(&parent->style, entry->parent_style);
+	}
+	entry->num_rules = base->num_matched_rules;
+	entry->rules_enabled = 0;
+	for (unsigned i = 0; i < base->num_matched_rules; ++i) {
+		const Rule *rule = base->rule_slots[i].rule;
+		entry->rules[i] = rule;
+		entry->rule_revisions[i] = rule->revision;
+		if ((rule->flags & RFLAG_ENABLED) != 0)
+			entry->rules_enabled |= uint8_t(1 << i);
+	}
+	entry->type = base->type;
+	entry->own_size = (uint16_t)own_size;
+	if (own_size != 0)
+		memcpy(entry->data, base->attributes.buffer + folded_size, own_size);
+	entry->inheritance_hash = base->inheritance_hash;
+	entry->style = base->style;
+	entry->layout = (uint8_t)requested;
+	entry->folded_size = (uint16_t)folded_size;
+	entry->num_folded = (uint16_t)num_folded;
+	if (folded_size != 0)
+		memcpy(entry->data + own_size, base->attributes.buffer, folded_size);
 }
 
 /* Disable debug initialization of AttributeFoldingState which makes debug
@@ -789,20 +1025,48 @@ static void afs_finalize(AttributeFoldingState *fs)
 
 /* Recalculates the values of attributes defined by a node or its matched rules
  * that have one or more modifiers, storing the results as folded attributes at 
- * the start of the node's attribute buffer. */
-static bool refold_attributes(Document *document, Node *base)
+ * the start of the node's attribute buffer. If the node is folded and
+ * 'requested' is not null, the layout named by the attributes is stored in
+ * it. */
+static bool refold_attributes(Document *document, Node *base, 
+	Layout *requested)
 {
 	if ((base->t.flags & NFLAG_FOLD_ATTRIBUTES) == 0 && 
 		(base->t.parent.node == NULL || 
 			!refold_attributes(document, base->t.parent.node)))
 		return false;
+
+	/* Nodes with the same fold inputs as a node folded earlier get the same
+	 * results. The root is always folded, because it sets document state. */
+	StyleCacheEntry *entry = NULL;
+	uint64_t key = 0;
+	if (base != document->root) {
+		key = make_style_cache_key(base);
+		entry = get_style_cache(document)->entries + 
+			unsigned(key >> (64 - STYLE_CACHE_BITS));
+		if (entry->key == key && style_cache_inputs_match(entry, base)) {
+			apply_cached_style(document, base, entry);
+			base->t.flags &= ~NFLAG_FOLD_ATTRIBUTES;
+			if (requested != NULL)
+				*requested = (Layout)entry->layout;
+			document->update_stats.folds_cached++;
+			return true;
+		}
+	}
+
+	document->update_stats.attribute_folds++;
 	AttributeFoldingState fs;
 	afs_init(&fs, base);
 	afs_add_modifiers(&fs);
 	afs_sort_modifiers(&fs);
 	afs_reduce(&fs);
 	afs_finalize(&fs);
+	base->inheritance_hash = make_inheritance_hash(base);
 	base->t.flags &= ~NFLAG_FOLD_ATTRIBUTES;
+	if (entry != NULL)
+		style_cache_insert(entry, key, base, fs.layout);
+	if (requested != NULL)
+		*requested = fs.layout;
 	return true;
 }
 
@@ -813,8 +1077,10 @@ void attribute_changed(Document *document, Node *node, int name)
 		set_node_flags(document, node, NFLAG_UPDATE_BACKGROUND_LAYERS, true);
 	if (is_layout_attribute(name))
 		set_node_flags(document, node, NFLAG_REBUILD_BOXES, true);
-	if (name == TOKEN_CLASS)
+	if (name == TOKEN_CLASS) {
 		set_node_flags(document, node, NFLAG_UPDATE_RULE_KEYS, true);
+		node_index_mark_stale(&document->node_index, node);
+	}
 }
 
 /* Like tree_next(), but only descends into nodes with inline layout. */
@@ -948,13 +1214,14 @@ static Layout established_layout(const Document *document,
 
 void remove_from_parent(Document *document, Node *child)
 {
-	document;
-
+	if (child->indexed != 0)
+		node_index_remove_subtree(&document->node_index, child);
 	Node *parent = child->t.parent.node;
 	if (parent != NULL) {
 		propagate_expansion_flags(child, AXIS_BIT_H | AXIS_BIT_V);
 		tree_remove_from_parent(&parent->t, &child->t);
 		parent->t.flags |= NFLAG_RECOMPOSE_CHILD_BOXES;
+		mark_node_dirty(parent);
 		document_notify_node_changed(document, parent);
 	}
 	child->t.flags |= NFLAG_PARENT_CHANGED | NFLAG_FOLD_ATTRIBUTES;
@@ -968,9 +1235,13 @@ void insert_child_before(Document *document, Node *parent, Node *child,
 	remove_from_parent(document, child);
 	tree_insert_child_before(&parent->t, &child->t, 
 		before != NULL ? &before->t : NULL);
+	if (parent->indexed != 0)
+		node_index_add_subtree(&document->node_index, child);
 	parent->t.flags |= NFLAG_RECOMPOSE_CHILD_BOXES;
 	propagate_expansion_flags(child, AXIS_BIT_H | AXIS_BIT_V);
 	child->t.flags |= NFLAG_PARENT_CHANGED | NFLAG_FOLD_ATTRIBUTES;
+	child->source_offset = NO_SOURCE_OFFSET; /* The parser sets it afterwards. */
+	mark_node_dirty(child);
 	document->change_clock++;
 	document_notify_node_changed(document, parent);
 }
@@ -980,11 +1251,42 @@ void append_child(Document *document, Node *parent, Node *child)
 	insert_child_before(document, parent, child, NULL);
 }
 
+/* Appends a new node to a subtree that isn't attached to its document. The
+ * node flags are set as by append_child(), but the document isn't modified,
+ * so that subtrees can be built on worker threads. */
+void append_detached_child(Node *parent, Node *child)
+{
+	assertb(child->t.parent.node == NULL);
+	tree_insert_child_before(&parent->t, &child->t, NULL);
+	parent->t.flags |= NFLAG_RECOMPOSE_CHILD_BOXES;
+	propagate_expansion_flags(child, AXIS_BIT_H | AXIS_BIT_V);
+	child->t.flags |= NFLAG_PARENT_CHANGED | NFLAG_FOLD_ATTRIBUTES;
+	mark_node_dirty(child);
+}
+
 void prepend_child(Document *document, Node *parent, Node *child)
 {
 	insert_child_before(document, parent, child, parent->t.first.node);
 }
 
+/* Sets NFLAG_DIRTY_DESCENDANTS in the parent chain of 'node', so that update
+ * traversals, which skip subtrees without the bit, will reach the node. The
+ * walk stops at the first ancestor that already has the bit, because its own
+ * ancestors must have it too. */
+void mark_node_dirty(Node *node)
+{
+	for (Node *parent = node->t.parent.node; parent != NULL && 
+		(parent->t.flags & NFLAG_DIRTY_DESCENDANTS) == 0; 
+		parent = parent->t.parent.node)
+		parent->t.flags |= NFLAG_DIRTY_DESCENDANTS;
+}
+
+/* True if 'a' precedes 'b' in a preorder walk of the tree containing both. */
+bool node_before(const Node *a, const Node *b)
+{
+	return tree_before(&a->t, &b->t);
+}
+
 /* Sets expansion flags in the parent chain of 'child'. This function is called
  * to indicate that size of 'child' has changed on the specified axes. */
 void propagate_expansion_flags(Node *child, unsigned axes)
@@ -1147,35 +1449,25 @@ static unsigned make_initial_rule_keys(const System *system, int tag_name,
 		cls, cls_length, rule_keys, MAX_NODE_RULE_KEYS); 
 }
 
-/* Creates a node object from an initial attribute set and text content.  */
-int create_node(Node **result, Document *document, NodeType type, int tag_name,
-	const AttributeAssignment *assignments, unsigned num_assignments, 
+/* Bytes needed to store a rule key and the node's position in the index
+ * slot for the key. */
+const unsigned RULE_KEY_STORAGE_SIZE = sizeof(uint64_t) + sizeof(uint32_t);
+
+/* Allocates a node with room for its attributes, rule keys and text in the 
+ * same block, and initializes the header. The attribute buffer and rule keys 
+ * are left empty. */
+static Node *allocate_node(Document *document, Arena *arena, NodeType type, 
+	int tag_name, unsigned attribute_block_size, unsigned rule_key_capacity,
 	const char *text, uint32_t text_length)
 {
-	/* The node's rule keys upon creation are allocated in a static block
-	 * after the node. Rule keys depend on the class attribute, so we have to
-	 * find that in the VA list, and generate rule keys into a temporary 
-	 * buffer before allocating the node. */
-	uint64_t rule_keys[MAX_NODE_RULE_KEYS];
-	unsigned num_rule_keys = make_initial_rule_keys(document->system, tag_name,
-		rule_keys, assignments, num_assignments);
-	unsigned rule_key_capacity = std::min(2 * num_rule_keys, MAX_NODE_RULE_KEYS);
-	
-	/* Determine the size of the node and its initial attribute block. */
 	uint32_t bytes_required = sizeof(Node);
-	uint32_t attribute_block_size = 0;
-	for (unsigned i = 0; i < num_assignments; ++i) {
-		int rc = abuf_set(NULL, assignments[i].name, &assignments[i].value);
-		if (rc < 0)
-			return rc;
-		attribute_block_size += (unsigned)rc;
-	}
 	bytes_required += attribute_block_size;
-	bytes_required += rule_key_capacity * sizeof(uint64_t);
+	bytes_required += rule_key_capacity * RULE_KEY_STORAGE_SIZE;
 	bytes_required += text_length + 1;
 
 	/* Initialize the header. */
-	char *block = new char[bytes_required];
+	unsigned size_class = arena_size_class(bytes_required);
+	char *block = (char *)arena_allocate(arena, size_class, bytes_required);
 	Node *node = (Node *)block;
 	block += sizeof(Node);
 	tree_init(&node->t, DEFAULT_NODE_FLAGS);
@@ -1185,9 +1477,15 @@ int create_node(Node **result, Document *document, NodeType type, int tag_name,
 	node->current_layout = (uint8_t)LAYOUT_NONE;
 	node->target_layout = (uint8_t)LAYOUT_NONE;
 	node->token = (uint8_t)tag_name;
-	node->num_rule_keys = (uint8_t)num_rule_keys;
+	node->num_rule_keys = 0;
 	node->rule_key_capacity = (uint8_t)rule_key_capacity;
+	node->size_class = (uint8_t)size_class;
+	node->shared_text = 0;
+	node->indexed = 0;
+	node->stale = 0;
 	node->num_matched_rules = 0;
+	node->source_offset = NO_SOURCE_OFFSET;
+	node->source_length = 0;
 	node->hit_prev = NULL;
 	node->hit_next = NULL;
 	node->selection_prev = NULL;
@@ -1204,27 +1502,99 @@ int create_node(Node **result, Document *document, NodeType type, int tag_name,
 	node->text = block;
 	block += text_length + 1;
 
-	/* Initialize the attribute buffer with the static attribute block as its
-	 * initial storage, and populate it with the supplied parsed attributes. */
+	/* The attribute buffer uses the static attribute block as its initial
+	 * storage. */
 	abuf_init(&node->attributes, block, attribute_block_size);
+	block += attribute_block_size;
+	node->rule_keys = (uint64_t *)block;
+	block += rule_key_capacity * sizeof(uint64_t);
+	node->index_positions = (uint32_t *)block;
+	node->inheritance_hash = 0;
+	return node;
+}
+
+/* Creates a node in a given arena. The document's state is not modified, so
+ * that subtrees can be built on worker threads, each with its own arena. The
+ * arena must be merged into the document's node arena before the nodes are
+ * destroyed, and the nodes added to the system's node count. */
+int create_detached_node(Node **result, Document *document, Arena *arena, 
+	NodeType type, int tag_name, const AttributeAssignment *assignments, 
+	unsigned num_assignments, const char *text, uint32_t text_length)
+{
+	/* The node's rule keys upon creation are allocated in a static block
+	 * after the node. Rule keys depend on the class attribute, so we have to
+	 * find that in the VA list, and generate rule keys into a temporary 
+	 * buffer before allocating the node. */
+	uint64_t rule_keys[MAX_NODE_RULE_KEYS];
+	unsigned num_rule_keys = make_initial_rule_keys(document->system, tag_name,
+		rule_keys, assignments, num_assignments);
+	unsigned rule_key_capacity = std::min(2 * num_rule_keys, MAX_NODE_RULE_KEYS);
+	
+	/* Determine the size of the node's initial attribute block. */
+	uint32_t attribute_block_size = 0;
+	for (unsigned i = 0; i < num_assignments; ++i) {
+		int rc = abuf_set(NULL, assignments[i].name, &assignments[i].value);
+		if (rc < 0)
+			return rc;
+		attribute_block_size += (unsigned)rc;
+	}
+	Node *node = allocate_node(document, arena, type, tag_name, 
+		attribute_block_size, rule_key_capacity, text, text_length);
+
+	/* Populate the attribute buffer with the supplied parsed attributes. */
 	for (unsigned i = 0; i < num_assignments; ++i)
 		abuf_set(&node->attributes, assignments[i].name, &assignments[i].value,
 			assignments[i].op);
-	block += attribute_block_size;
 
 	/* Copy in the rule keys. */
-	node->rule_keys = (uint64_t *)block;
 	memcpy(node->rule_keys, rule_keys, num_rule_keys * sizeof(uint64_t));
-	block += rule_key_capacity * sizeof(uint64_t);
+	node->num_rule_keys = (uint8_t)num_rule_keys;
 
 	/* Perform any node-type specific initialization. */
 	initialize_node(document, node);
 
+	*result = node;
+	return STKR_OK;
+}
+
+/* Creates a node from the contents of a compiled document. The attributes are
+ * a packed attribute buffer and the rule keys are already hashed, so they are
+ * copied without validation. */
+int create_compiled_node(Node **result, Document *document, NodeType type, 
+	int tag_name, const void *attributes, unsigned attributes_size, 
+	unsigned num_attributes, const uint64_t *rule_keys, unsigned num_rule_keys,
+	const char *text, uint32_t text_length)
+{
+	if (num_rule_keys > MAX_NODE_RULE_KEYS)
+		return STKR_INVALID_BINARY;
+	unsigned rule_key_capacity = std::min(2 * num_rule_keys, MAX_NODE_RULE_KEYS);
+	Node *node = allocate_node(document, &document->node_arena, type, 
+		tag_name, attributes_size, rule_key_capacity, text, text_length);
+	if (attributes_size != 0) {
+		memcpy(node->attributes.buffer, attributes, attributes_size);
+		node->attributes.size = (int)attributes_size;
+		node->attributes.num_attributes = num_attributes;
+	}
+	memcpy(node->rule_keys, rule_keys, num_rule_keys * sizeof(uint64_t));
+	node->num_rule_keys = (uint8_t)num_rule_keys;
+	initialize_node(document, node);
 	document->system->total_nodes++;
 	*result = node;
 	return STKR_OK;
 }
 
+/* Creates a node object from an initial attribute set and text content.  */
+int create_node(Node **result, Document *document, NodeType type, int tag_name,
+	const AttributeAssignment *assignments, unsigned num_assignments, 
+	const char *text, uint32_t text_length)
+{
+	int rc = create_detached_node(result, document, &document->node_arena, 
+		type, tag_name, assignments, num_assignments, text, text_length);
+	if (rc == STKR_OK)
+		document->system->total_nodes++;
+	return rc;
+}
+
 static void destroy_node_boxes(Document *document, Node *node);
 
 void destroy_node(Document *document, Node *node, bool recursive)
@@ -1246,10 +1616,9 @@ void destroy_node(Document *document, Node *node, bool recursive)
 	}
 	abuf_clear(&node->attributes);
 	if ((node->t.flags & NFLAG_HAS_STATIC_RULE_KEYS) == 0)
-		delete [] node->rule_keys;
-	if ((node->t.flags & NFLAG_HAS_STATIC_TEXT) == 0)
-		delete [] node->text;
-	delete [] (char *)node;
+		delete [] (char *)node->rule_keys;
+	free_node_text(node);
+	arena_free(&document->node_arena, node, node->size_class);
 }
 
 void destroy_children(Document *document, Node *node)
@@ -1269,14 +1638,24 @@ static void destroy_node_boxes(Document *document, Node *node)
 	}
 }
 
-/* Sets or clears a mask of node flags. */
-void set_node_flags(Document *document, Node *node, unsigned mask, bool value)
+/* Sets or clears a mask of node flags. Setting bits marks the node's 
+ * ancestors so that the next update will visit the node. */
+void set_node_flags_internal(Document *document, Node *node, 
+	unsigned mask, bool value)
 {
 	unsigned new_flags = set_or_clear(node->t.flags, mask, value);
 	unsigned changed = node->t.flags ^ new_flags;
 	node->t.flags = new_flags;
-	if (changed != 0)
+	if (changed != 0) {
+		if (value)
+			mark_node_dirty(node);
 		document->change_clock++;
+	}
+}
+
+void set_node_flags(Document *document, Node *node, unsigned mask, bool value)
+{
+	set_node_flags_internal(document, node, mask, value);
 }
 
 /* Creates a new layer of the specified types and adds it to the node's layer
@@ -1332,57 +1711,105 @@ static void update_node_rule_keys(Document *document, Node *node,
 	unsigned num_keys = make_node_rule_keys(document->system, 
 		(Token)node->token, node->t.flags, cls, cls_length, 
 		keys, MAX_NODE_RULE_KEYS);
+	bool indexed = node->indexed != 0;
+	if (indexed)
+		node_index_remove(&document->node_index, node);
 	if (num_keys > node->rule_key_capacity) {
 		if ((node->t.flags & NFLAG_HAS_STATIC_RULE_KEYS) == 0)
-			delete [] node->rule_keys;
-		node->rule_keys = new uint64_t[num_keys];
+			delete [] (char *)node->rule_keys;
+		char *block = new char[num_keys * RULE_KEY_STORAGE_SIZE];
+		node->rule_keys = (uint64_t *)block;
+		node->index_positions = (uint32_t *)(block + 
+			num_keys * sizeof(uint64_t));
+		node->rule_key_capacity = (uint8_t)num_keys;
 		node->t.flags &= ~NFLAG_HAS_STATIC_RULE_KEYS;
 	}
 	memcpy(node->rule_keys, keys, num_keys * sizeof(uint64_t));
 	node->num_rule_keys = (uint8_t)num_keys;
-	node->rule_key_capacity = (uint8_t)num_keys;
 	node->t.flags &= ~NFLAG_UPDATE_RULE_KEYS;
+	if (indexed)
+		node_index_add(&document->node_index, node);
+}
+
+/* Returns the flags, other than NFLAG_FOLD_ATTRIBUTES, that a node must be
+ * given when a rule starts or stops contributing its attributes to the node. 
+ * These are the flags attribute_changed() sets for the rule's attributes. */
+static unsigned rule_update_flags(const Rule *rule)
+{
+	if ((rule->flags & RFLAG_ENABLED) == 0)
+		return 0;
+	unsigned flags = 0;
+	for (const Attribute *a = abuf_first(&rule->attributes); a != NULL; 
+		a = abuf_next(&rule->attributes, a)) {
+		if (is_background_attribute(a->name))
+			flags |= NFLAG_UPDATE_BACKGROUND_LAYERS;
+		if (is_layout_attribute(a->name))
+			flags |= NFLAG_REBUILD_BOXES;
+	}
+	return flags;
 }
 
-/* Rebuilds a node's array of matched rule references. */
-static bool update_rule_slots(Document *document, Node *node)
+/* Replaces a node's array of matched rule references. The update flags of
+ * the rules entering and leaving the array are given to the node. Those of 
+ * leaving rules are read from their slots, because the rules themselves may 
+ * have been destroyed. */
+static bool store_rule_slots(Node *node, const Rule * const *matched, 
+	unsigned num_matched)
 {
-	const Rule *matched[NUM_RULE_SLOTS];
-	unsigned num_matched = match_rules(document, node, 
-		matched, NUM_RULE_SLOTS, &document->rules, 
-		&document->system->global_rules);
 	bool changed = (num_matched != node->num_matched_rules);
+	unsigned update_flags = 0;
 	unsigned i;
 	for (i = 0; i < num_matched; ++i) {
 		RuleSlot *slot = node->rule_slots + i;
 		if (i >= node->num_matched_rules || slot->rule != matched[i]) {
+			if (i < node->num_matched_rules)
+				update_flags |= slot->update_flags;
 			slot->rule = matched[i];
 			slot->revision = slot->rule->revision - 1;
+			slot->update_flags = rule_update_flags(slot->rule);
+			update_flags |= slot->update_flags;
 			changed = true;
 		}
 	}
+	for (; i < node->num_matched_rules; ++i)
+		update_flags |= node->rule_slots[i].update_flags;
 	node->num_matched_rules = (uint8_t)num_matched;
 	node->t.flags &= ~NFLAG_UPDATE_MATCHED_RULES;
 	if (changed) 
-		node->t.flags |= NFLAG_FOLD_ATTRIBUTES;
+		node->t.flags |= NFLAG_FOLD_ATTRIBUTES | update_flags;
 	return changed;
 }
 
+/* Rebuilds a node's array of matched rule references. */
+static bool update_rule_slots(Document *document, Node *node, 
+	const AncestorFilter *filter)
+{
+	const Rule *matched[NUM_RULE_SLOTS];
+	unsigned num_matched = match_rules(document, node, 
+		matched, NUM_RULE_SLOTS, &document->rules, 
+		&document->system->global_rules, filter);
+	return store_rule_slots(node, matched, num_matched);
+}
+
 /* Looks at the rules matched by a node, and if their attributes have changed
  * (or the rules themselves have changed), sets the relevant update bits. */
 static void check_rule_slots(Document *document, Node *node)
 {
 	document;
 	bool rules_changed = false;
+	unsigned update_flags = 0;
 	for (unsigned i = 0; i < node->num_matched_rules; ++i) {
 		RuleSlot *slot = node->rule_slots + i;
 		if (slot->revision != slot->rule->revision) {
 			slot->revision = slot->rule->revision;
+			update_flags |= slot->update_flags;
+			slot->update_flags = rule_update_flags(slot->rule);
+			update_flags |= slot->update_flags;
 			rules_changed = true;
 		}
 	}
 	if (rules_changed)
-		node->t.flags |= NFLAG_FOLD_ATTRIBUTES;
+		node->t.flags |= NFLAG_FOLD_ATTRIBUTES | update_flags;
 }
 
 /* If necessary, rebuilds a node's rule keys from its class attribute and 
@@ -1391,7 +1818,8 @@ static void check_rule_slots(Document *document, Node *node)
  * change the set of mactched rules again, and so on ad infinitum. Cycles are
  * broken by stopping the process as soon as a previously matched rule with a
  * class modifier is removed from the match set. */
-void update_matched_rules(Document *document, Node *node)
+void update_matched_rules(Document *document, Node *node, 
+	const AncestorFilter *filter)
 {
 	static const unsigned MAX_VISITED = 16;
 
@@ -1403,7 +1831,7 @@ void update_matched_rules(Document *document, Node *node)
 		 * rules. */
 		if ((node->t.flags & NFLAG_UPDATE_RULE_KEYS) != 0)
 			update_node_rule_keys(document, node, ignore_class_modifiers);
-		if (!update_rule_slots(document, node))
+		if (!update_rule_slots(document, node, filter))
 			break;
 		ignore_class_modifiers = false;
 		/* The rule set has changed. If any of the rules now matched modify
@@ -1437,6 +1865,134 @@ void update_matched_rules(Document *document, Node *node)
 	/* The children of this node may now match different rules, even if their
 	 * clasess haven't changed, because selectors can match parent nodes. */
 	node->t.flags |= NFLAG_UPDATE_CHILD_RULES;
+	node_index_mark_stale(&document->node_index, node);
+}
+
+void style_sharing_cache_clear(StyleSharingCache *cache)
+{
+	memset(cache->entries, 0, sizeof(cache->entries));
+}
+
+/* True if the inputs to rule matching and folding that belong to two nodes 
+ * themselves are the same. Nodes with the same parent and the same inputs 
+ * match the same rules, and if they match the same rules, fold to the same 
+ * style. */
+static bool same_style_inputs(const Node *a, const Node *b)
+{
+	if (a->t.parent.node != b->t.parent.node || a->type != b->type || 
+		a->token != b->token || a->num_rule_keys != b->num_rule_keys)
+		return false;
+	if (a->num_rule_keys != 0 && memcmp(a->rule_keys, b->rule_keys, 
+		a->num_rule_keys * sizeof(uint64_t)) != 0)
+		return false;
+	unsigned offset_a = own_attributes_offset(a);
+	unsigned offset_b = own_attributes_offset(b);
+	unsigned size = unsigned(a->attributes.size) - offset_a;
+	if (size != unsigned(b->attributes.size) - offset_b)
+		return false;
+	if (size == 0)
+		return true;
+	return memcmp(a->attributes.buffer + offset_a, 
+		b->attributes.buffer + offset_b, size) == 0;
+}
+
+/* Hashes a node's parent and the inputs compared by same_style_inputs(). */
+static uint64_t style_sharing_hash(const Node *node)
+{
+	unsigned offset = own_attributes_offset(node);
+	uint64_t hash = murmur3_64(node->rule_keys, 
+		node->num_rule_keys * sizeof(uint64_t), 
+		node->token | (node->type << 8));
+	hash ^= murmur3_64(node->attributes.buffer + offset, 
+		node->attributes.size - offset, unsigned(hash));
+	hash ^= uint64_t(uintptr_t(node->t.parent.node)) * 0x9E3779B97F4A7C15ull;
+	return hash;
+}
+
+/* Finds the cache entry for a node and stores its hash in 'hash'. Returns the
+ * entry's node if it can lend its matched rules to this one, or NULL. The 
+ * node's rule keys are brought up to date first, as by 
+ * update_matched_rules(). */
+static const Node *style_sharing_lookup(Document *document, 
+	StyleSharingCache *cache, Node *node, StyleSharingEntry **entry, 
+	uint64_t *hash)
+{
+	if ((node->t.flags & NFLAG_UPDATE_RULE_KEYS) != 0)
+		update_node_rule_keys(document, node, true);
+	*hash = style_sharing_hash(node);
+	*entry = cache->entries + unsigned(*hash >> 
+		(64 - STYLE_SHARING_CACHE_BITS));
+	const Node *source = (*entry)->node;
+	if (node->t.prev.node == NULL)
+		return NULL;
+	if (source == NULL || source == node || (*entry)->hash != *hash || 
+		!same_style_inputs(source, node))
+		return NULL;
+	return source;
+}
+
+/* Offers a node whose rules and possibly style were updated to later 
+ * siblings. Nodes matching rules that modify the class are not shared,
+ * because their rule keys depend on the rules they match. */
+static void style_sharing_insert(StyleSharingEntry *entry, const Node *node, 
+	uint64_t hash, bool has_style, Layout layout)
+{
+	/* Don't evict an entry in favour of a node with no later siblings. */
+	if (node->t.next.node == NULL)
+		return;
+	for (unsigned i = 0; i < node->num_matched_rules; ++i)
+		if ((node->rule_slots[i].rule->flags & RFLAG_MODIFIES_CLASS) != 0)
+			return;
+	entry->node = node;
+	entry->hash = hash;
+	entry->has_style = has_style;
+	entry->layout = (uint8_t)layout;
+}
+
+/* Gives a node the matched rules of another with the same style inputs. */
+static void share_matched_rules(Document *document, Node *node, 
+	const Node *source)
+{
+	const Rule *matched[NUM_RULE_SLOTS];
+	for (unsigned i = 0; i < source->num_matched_rules; ++i)
+		matched[i] = source->rule_slots[i].rule;
+	store_rule_slots(node, matched, source->num_matched_rules);
+	node->t.flags |= NFLAG_UPDATE_CHILD_RULES;
+	document->update_stats.rules_shared++;
+}
+
+/* True if two nodes have the same matched rules. */
+static bool same_matched_rules(const Node *a, const Node *b)
+{
+	if (a->num_matched_rules != b->num_matched_rules)
+		return false;
+	for (unsigned i = 0; i < a->num_matched_rules; ++i)
+		if (a->rule_slots[i].rule != b->rule_slots[i].rule)
+			return false;
+	return true;
+}
+
+/* Gives a node the folded attributes and style of another with the same style
+ * inputs and matched rules, instead of refolding its attributes. */
+static void share_folded_style(Document *document, Node *base, 
+	const Node *source, Layout requested)
+{
+	/* Replace the node's folded attributes with a copy of the source's. */
+	AttributeBuffer folded;
+	folded.buffer = source->attributes.buffer;
+	folded.size = (int)own_attributes_offset(source, &folded.num_attributes);
+	folded.capacity = folded.size;
+	AttributeBuffer *dest = &base->attributes;
+	const Attribute *end = (const Attribute *)(dest->buffer + 
+		own_attributes_offset(base));
+	abuf_replace_range(dest, abuf_first(dest), end, &folded);
+
+	if (maybe_switch_layout(document, base, requested))
+		base->t.flags |= NFLAG_RECOMPOSE_CHILD_BOXES;
+	store_node_style(base, &source->style);
+	base->inheritance_hash = source->inheritance_hash;
+	base->t.flags &= ~NFLAG_FOLD_ATTRIBUTES;
+	document->update_stats.folds_shared++;
 }
 
 /* Builds a LayerPosition structure by reading background attributes. */
@@ -1737,6 +2293,8 @@ void set_interaction_state(Document *document, Node *node,
 	 * node. This might result in the node or any of its children matching
 	 * different rules. */
 	node->t.flags |= NFLAG_UPDATE_RULE_KEYS | NFLAG_UPDATE_MATCHED_RULES;
+	node_index_mark_stale(&document->node_index, node);
+	mark_node_dirty(node);
 	document->change_clock++;
 }
 
@@ -1808,20 +2366,38 @@ static void compose_child_boxes(Document *document, Node *node)
 
 /* Updates a node before layout. Parents are visited before children. */
 unsigned update_node_pre_layout_preorder(Document *document, Node *node, 
-	unsigned propagate_down)
+	unsigned propagate_down, const AncestorFilter *filter, 
+	StyleSharingCache *sharing)
 {
 	node->t.flags |= propagate_down;
 
 	update_node_debug_string(document, node);
 
+	/* Siblings with the same rule keys and attributes match the same rules, 
+	 * so a node can often copy the results of an earlier sibling. */
+	if (node->t.prev.node == NULL && node->t.next.node == NULL)
+		sharing = NULL;
+	StyleSharingEntry *sharing_entry = NULL;
+	uint64_t sharing_hash = 0;
+	const Node *source = NULL;
+	bool rematched = false;
+
 	/* Rematch rules and/or rebuild rule keys for this node if its classes or 
 	 * the contents of the rule tables have changed. */
 	if ((document->flags & DOCFLAG_UPDATE_REMATCH_RULES) != 0)
 		node->t.flags |= NFLAG_UPDATE_MATCHED_RULES;
 	if ((node->t.flags & (NFLAG_UPDATE_RULE_KEYS | 
 		NFLAG_UPDATE_MATCHED_RULES)) != 0) {
-		update_matched_rules(document, node);
+		if (sharing != NULL) {
+			source = style_sharing_lookup(document, sharing, node, 
+				&sharing_entry, &sharing_hash);
+		}
+		if (source != NULL)
+			share_matched_rules(document, node, source);
+		else
+			update_matched_rules(document, node, filter);
 		propagate_down |= NFLAG_UPDATE_MATCHED_RULES;
+		rematched = true;
 	}
 	check_rule_slots(document, node);
 	
@@ -1845,12 +2421,35 @@ unsigned update_node_pre_layout_preorder(Document *document, Node *node,
 		impose_root_constraints(document);
 	
 	/* When a node's style is changed, the styles of its children must be 
-	 * recalculated. */
+	 * recalculated. A sibling that was folded earlier in the update with the
+	 * same rules has the same style. */
+	bool folded = false;
+	Layout requested = LAYOUT_NONE;
 	if ((node->t.flags & NFLAG_FOLD_ATTRIBUTES) != 0) {
-		refold_attributes(document, node);
+		if (sharing != NULL && sharing_entry == NULL) {
+			source = style_sharing_lookup(document, sharing, node, 
+				&sharing_entry, &sharing_hash);
+		}
+		if (source != NULL && sharing_entry->has_style && 
+			same_matched_rules(source, node)) {
+			requested = (Layout)sharing_entry->layout;
+			share_folded_style(document, node, source, requested);
+		} else {
+			refold_attributes(document, node, &requested);
+			folded = true;
+		}
 		propagate_down |= NFLAG_FOLD_ATTRIBUTES;
 	}
 
+	/* Offer the node to later siblings if it has results they can't get from
+	 * the entry's current node. Styles of hidden nodes aren't shared, because
+	 * folding may leave them unchanged. */
+	if (sharing_entry != NULL && (rematched || folded) && 
+		(source == NULL || (folded && !sharing_entry->has_style))) {
+		style_sharing_insert(sharing_entry, node, sharing_hash, 
+			folded && node->layout != LAYOUT_NONE, requested);
+	}
+
 	if ((node->t.flags & NFLAG_UPDATE_BACKGROUND_LAYERS) != 0) {
 		update_background_layers(document, node);
 		node->t.flags &= ~NFLAG_UPDATE_BACKGROUND_LAYERS;
@@ -1872,7 +2471,7 @@ unsigned update_node_pre_layout_postorder(Document *document, Node *node,
 		update_node_boxes(document, node);
 		propagate_up |= NFLAG_RECOMPOSE_CHILD_BOXES;
 	}
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 
 	/* If we've rebuilt our own box tree, or child boxes have changed,
 	 * recompose the child boxes into our tree. */
@@ -1880,7 +2479,7 @@ unsigned update_node_pre_layout_postorder(Document *document, Node *node,
 		compose_child_boxes(document, node);
 		node->t.flags &= ~NFLAG_RECOMPOSE_CHILD_BOXES;
 	}
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 
 	/* Synchronize the box's layer stack with the node's. */
 	if ((node->t.flags & NFLAG_UPDATE_BOX_LAYERS) != 0) {
@@ -1889,19 +2488,26 @@ unsigned update_node_pre_layout_postorder(Document *document, Node *node,
 		if (node->layout == LAYOUT_INLINE)
 			propagate_up |= NFLAG_UPDATE_BOX_LAYERS;
 	}
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 
 	/* Update inline contexts. */
 	if (node->layout == LAYOUT_INLINE_CONTAINER) {
 		if ((node->t.flags & NFLAG_RECONSTRUCT_PARAGRAPH) != 0)
 			rebuild_inline_context(document, node);
-		assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+		else if ((node->t.flags & NFLAG_REMEASURE_PARAGRAPH_ELEMENTS) != 0)
+			invalidate_paragraph_layout(document, node);
+		assert_heap(); /* FIXME: DEBUG. */
 	} else {
-		/* Propagate up to the nearest inline container. */
-		propagate_up |= node->t.flags & (NFLAG_RECONSTRUCT_PARAGRAPH | 
-			NFLAG_REMEASURE_PARAGRAPH_ELEMENTS);
+		/* Propagate up to the nearest inline container, which takes over
+		 * responsibility for the flags. Left set here, they would be passed
+		 * up again, invalidating the container, whenever the node is next
+		 * visited. */
+		unsigned paragraph_flags = NFLAG_RECONSTRUCT_PARAGRAPH | 
+			NFLAG_REMEASURE_PARAGRAPH_ELEMENTS;
+		propagate_up |= node->t.flags & paragraph_flags;
+		node->t.flags &= ~paragraph_flags;
 	}
-	assertb(_heapchk() == _HEAPOK); /* FIXME: DEBUG. */
+	assert_heap(); /* FIXME: DEBUG. */
 
 	return propagate_up;
 }
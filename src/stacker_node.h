@@ -12,8 +12,19 @@ struct Box;
 struct InlineContext;
 struct VisualLayer;
 struct Rule;
+struct Arena;
+struct AncestorFilter;
 
 const unsigned NUM_RULE_SLOTS = 4;
+const uint32_t NO_SOURCE_OFFSET = 0xFFFFFFFF;
+
+const unsigned STYLE_SHARING_CACHE_BITS = 8;
+const unsigned STYLE_SHARING_CACHE_SIZE = 1 << STYLE_SHARING_CACHE_BITS;
+
+const unsigned STYLE_CACHE_BITS       = 9;
+const unsigned STYLE_CACHE_SIZE       = 1 << STYLE_CACHE_BITS;
+const unsigned STYLE_CACHE_DATA_SIZE  = 128;
+const unsigned PACKED_STYLE_WORDS     = 5;
 
 /* A reference to a rule that has matched against a node, along with a copy
  * of the rule's update clock. When the clock in the reference does not match
@@ -21,6 +32,7 @@ const unsigned NUM_RULE_SLOTS = 4;
 struct RuleSlot {
 	const Rule *rule;
 	unsigned revision;
+	unsigned update_flags; /* See rule_update_flags(). */
 };
 
 /* A part of a document. */
@@ -45,9 +57,15 @@ struct Node {
 	uint8_t num_matched_rules;
 	uint8_t num_rule_keys;
 	uint8_t rule_key_capacity;
+	uint8_t size_class;
+	uint8_t shared_text; /* The text is in a buffer the node doesn't own. */
+	uint8_t indexed;     /* The node is in the document's node index. */
+	uint8_t stale;       /* The node is on the node index's stale list. */
 	uint32_t text_length;
 	uint32_t mouse_hit_stamp;
 	uint32_t first_element;
+	uint32_t source_offset; /* Start of the node's markup relative to its parent's, or NO_SOURCE_OFFSET. */
+	uint32_t source_length; /* Length of the node's markup. */
 
 	char *text;
 	
@@ -55,6 +73,8 @@ struct Node {
 
 	RuleSlot rule_slots[NUM_RULE_SLOTS];
 	uint64_t *rule_keys;
+	uint32_t *index_positions; /* Node index positions, allocated with the rule keys. */
+	uint64_t inheritance_hash; /* See make_inheritance_hash(). */
 
 	NodeStyle style;
 
@@ -65,6 +85,60 @@ struct Node {
 #endif
 };
 
+/* A node whose rules were matched or whose attributes were folded during the
+ * current update. A later sibling with the same type, rule keys and attributes
+ * can copy the node's matched rules and, if the node was folded, its style. */
+struct StyleSharingEntry {
+	const Node *node; /* NULL if the entry is empty. */
+	uint64_t hash;
+	bool has_style;   /* The node's style was folded during the update. */
+	uint8_t layout;   /* The layout requested by the folded attributes. */
+};
+
+/* Nodes recently updated by the pre-layout traversal, indexed by the high bits
+ * of their sharing hashes. Entries refer to nodes without owning them, so the
+ * cache must be cleared whenever the client may have modified the tree. */
+struct StyleSharingCache {
+	StyleSharingEntry entries[STYLE_SHARING_CACHE_SIZE];
+};
+
+/* The result of folding the attributes of a node, stored under a hash of the 
+ * inputs to the fold. The inputs themselves are kept too, and are compared 
+ * on a hit, so that nodes whose keys collide are folded rather than given 
+ * the wrong style. */
+struct StyleCacheEntry {
+	uint64_t key;              /* Zero if the entry is empty. */
+	uint64_t inheritance_hash; /* The hash the folded node was given. */
+
+	/* Inputs. */
+	uint64_t parent_inheritance_hash;
+	uint32_t parent_style[PACKED_STYLE_WORDS];
+	const Rule *rules[NUM_RULE_SLOTS];
+	uint32_t rule_revisions[NUM_RULE_SLOTS];
+	uint8_t rules_enabled;     /* Bit i is set if rules[i] was enabled. */
+	uint8_t type;
+	uint8_t has_parent;
+	uint8_t num_rules;
+	uint16_t own_size;
+
+	/* Results. */
+	NodeStyle style;
+	uint8_t layout;            /* The layout requested by the folded attributes. */
+	uint16_t folded_size;
+	uint16_t num_folded;
+
+	/* The node's own attributes followed by the folded attributes. */
+	char data[STYLE_CACHE_DATA_SIZE];
+};
+
+/* Folded styles from earlier updates, indexed by the high bits of their keys.
+ * Keys are made from the contents of nodes and the identities of rules, not
+ * from node pointers, so the cache survives changes to the tree. The cache is
+ * allocated by the first fold that uses it. */
+struct StyleCache {
+	StyleCacheEntry entries[STYLE_CACHE_SIZE];
+};
+
 struct AttributeIterator {
 	const struct Node *node;
 	const Attribute *attribute;
@@ -100,14 +174,32 @@ const Node *find_inline_container(const Document *document, const Node *node);
 const Node *find_inline_container_not_self(const Document *document, const Node *node);
 const Node *find_chain_inline_container(const Document *document, 
 	const Node *node);
+int create_detached_node(Node **result, Document *document, Arena *arena, 
+	NodeType type, int tag_name, const AttributeAssignment *assignments = 0, 
+	unsigned num_assignments = 0, const char *text = 0, 
+	uint32_t text_length = 0);
+int create_compiled_node(Node **result, Document *document, NodeType type, 
+	int tag_name, const void *attributes, unsigned attributes_size, 
+	unsigned num_attributes, const uint64_t *rule_keys, unsigned num_rule_keys,
+	const char *text, uint32_t text_length);
+void append_detached_child(Node *parent, Node *child);
+void share_node_text(Node *node, const char *text, uint32_t length);
 void propagate_expansion_flags(Node *child, unsigned axes);
+void mark_node_dirty(Node *node);
 bool is_inline_child(const Document *document, const Node *node);
 bool node_before(const Node *a, const Node *b);
 
-void update_matched_rules(Document *document, Node *node);
+void update_matched_rules(Document *document, Node *node, 
+	const AncestorFilter *filter = NULL);
 bool must_update_rule_keys(const Node *node);
 
-unsigned update_node_pre_layout_preorder(Document *document, Node *node, unsigned propagate_down);
+void style_sharing_cache_clear(StyleSharingCache *cache);
+void style_cache_clear(StyleCache *cache);
+void destroy_style_cache(Document *document);
+
+unsigned update_node_pre_layout_preorder(Document *document, Node *node, 
+	unsigned propagate_down, const AncestorFilter *filter, 
+	StyleSharingCache *sharing);
 unsigned update_node_pre_layout_postorder(Document *document, Node *node, unsigned propagate_up);
 unsigned update_node_post_layout_postorder(Document *document, Node *node, unsigned propagate_up);
 
@@ -206,6 +206,7 @@ int adjust_glue(int ratio, int width, int stretch, int shrink)
 static bool build_breakpoint(IncrementalBreakState *s, ParagraphElement e,
 	unsigned position)
 {
+	document_stats(s->document)->breakpoints_evaluated++;
 	Breakpoint *b = s->breakpoints + s->num_breakpoints;
 	b->unscaled = false;
 	b->b = (int)position;
@@ -5,6 +5,9 @@
 #include <cstdarg>
 
 #include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
 
 #include "stacker.h"
 #include "stacker_token.h"
@@ -14,12 +17,28 @@
 #include "stacker_document.h"
 #include "stacker_encoding.h"
 #include "stacker_system.h"
+#include "stacker_arena.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define STKR_SSE2
+	#include <emmintrin.h>
+#endif
 
 namespace stkr {
 
 const int STKR_OK_HALT     = 1; /* No error, but don't parse any more. */
 const int STKR_OK_NO_SCOPE = 2; /* No error, but this is a non-document tag (a rule). Don't try to create a node from it. */
 const int STKR_SKIP_TAG    = 3; /* No error, but the tag should be ignored. */
+const int STKR_OK_SUSPEND  = 4; /* No error, but we need more input to continue. */
+
+/* A block element parsed ahead of time into a detached subtree. */
+struct ParseSpan {
+	unsigned start;  /* Offset of the opening '<'. */
+	unsigned end;    /* Offset just past the closing tag's '>'. */
+	unsigned lines;  /* Number of line breaks in the span. */
+	Node *node;      /* The subtree, or NULL if the main thread must parse the span. */
+	Node *partial;   /* Nodes left by a failed parse, to be destroyed. */
+};
 
 static int read_url_literal(Parser *parser);
 static int read_color_literal(Parser *parser, int keyword);
@@ -45,6 +64,40 @@ static unsigned unescape(const char *s, unsigned length, char *dest)
 	return j;
 }
 
+/* True for bytes that can't end a run of plain text or change the state of the
+ * text tokenizer other than by being a non-space character. */
+inline bool is_plain_text_byte(uint8_t ch)
+{
+	return ch < 0x80 && ch != '<' && ch != '\\' && ch != '\n';
+}
+
+/* Returns the position of the first byte at or after 'pos' that isn't plain 
+ * text, or 'end' if there is none. Sixteen bytes are tested at a time where
+ * SSE2 is available. */
+static unsigned skip_plain_text(const char *s, unsigned pos, unsigned end)
+{
+#if defined(STKR_SSE2)
+	const __m128i open_angle = _mm_set1_epi8('<');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i newline = _mm_set1_epi8('\n');
+	while (pos + 16 <= end) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + pos));
+		__m128i special = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, open_angle), 
+				_mm_cmpeq_epi8(v, backslash)),
+			_mm_cmpeq_epi8(v, newline));
+		/* The sign bit of 'v' is set for non-ASCII bytes. */
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(special, v));
+		if (mask != 0)
+			return pos + lowest_set_bit(mask);
+		pos += 16;
+	}
+#endif
+	while (pos != end && is_plain_text_byte((uint8_t)s[pos]))
+		pos++;
+	return pos;
+}
+
 inline uint32_t next_character(Parser *s)
 {
 	s->ch0 = s->ch1;
@@ -71,8 +124,11 @@ inline uint32_t rewind(Parser *s, unsigned saved_pos_ch0)
  * use in error messages. */
 static int read_context(const Parser *parser, char *buffer, unsigned buffer_size)
 {
+	/* When streaming, the context can extend past the parsed input. */
+	unsigned available = parser->input == parser->buffer ? 
+		parser->buffer_size : parser->input_size;
 	const char *s = parser->input + parser->token_start;
-	const char *end = parser->input + parser->input_size;
+	const char *end = parser->input + available;
 	unsigned length = 0;
 	bool drop_spaces = true;
 	bool is_space = false;
@@ -224,18 +280,48 @@ static int parser_error(Parser *parser, int code, ...)
 	return code;
 }
 
-static void push_scope(Parser *parser, Node *node)
+/* Creates a node in the parser's document. Parsers building a detached
+ * subtree on a worker thread allocate from their own arena instead. */
+static int parser_create_node(Parser *parser, Node **node, NodeType type, 
+	int tag_name, const AttributeAssignment *assignments = NULL, 
+	unsigned num_assignments = 0, uint32_t text_length = 0)
+{
+	if (parser->node_arena != NULL) {
+		return create_detached_node(node, parser->document, parser->node_arena,
+			type, tag_name, assignments, num_assignments, NULL, text_length);
+	}
+	return create_node(node, parser->document, type, tag_name, 
+		assignments, num_assignments, NULL, text_length);
+}
+
+static void parser_append_child(Parser *parser, Node *parent, Node *child)
+{
+	if (parser->node_arena != NULL)
+		append_detached_child(parent, child);
+	else
+		append_child(parser->document, parent, child);
+}
+
+/* Makes a node whose markup starts at input offset 'start' the current scope.
+ * Markup offsets are recorded relative to the parent's, so that an edit only
+ * moves the nodes that follow it at each level. */
+static void push_scope(Parser *parser, Node *node, unsigned start)
 {
 	if (parser->scope != NULL)
-		append_child(parser->document, parser->scope, node);
+		parser_append_child(parser, parser->scope, node);
+	node->source_offset = start - parser->scope_start;
+	parser->scope_start = start;
 	parser->scope = node;
 }
 
-static int pop_scope(Parser *parser)
+/* Closes the current scope, whose markup ends at input offset 'end'. */
+static int pop_scope(Parser *parser, unsigned end)
 {
 	Node *popped = parser->scope;
 	if (popped == NULL)
 		return STKR_MISMATCHED_TAGS;
+	popped->source_length = end - parser->scope_start;
+	parser->scope_start -= popped->source_offset;
 	parser->scope = popped->t.parent.node;
 	if (parser->scope == parser->root) {
 		if (parser->first_parsed == NULL)
@@ -247,6 +333,16 @@ static int pop_scope(Parser *parser)
 	return STKR_OK;
 }
 
+/* Returns the input offset of the end of the markup of the current scope's
+ * last child. This is where an implicit paragraph ends. */
+static unsigned last_child_end(const Parser *parser)
+{
+	const Node *last = parser->scope->t.last.node;
+	if (last == NULL)
+		return parser->scope_start;
+	return parser->scope_start + last->source_offset + last->source_length;
+}
+
 /* Reads a numeric literal token. */
 static int read_number(Parser *parser)
 {
@@ -451,6 +547,7 @@ static int next_token(Parser *parser)
 		do {
 			if (unicode_isspace(ch)) {
 				if (ch == '\n') {
+					parser->line++;
 					parser->emit_break = seen_newline;
 					seen_newline = true;
 				}
@@ -461,6 +558,13 @@ static int next_token(Parser *parser)
 			if (parser->ch0 == '\\' && is_escapeable(parser->ch1)) {
 				parser->token_escape_count++;
 				ch = skip_two_characters(parser);
+			} else if (parser->token == TOKEN_TEXT && !seen_newline && 
+				parser->ch1 < 0x80 && is_plain_text_byte((uint8_t)parser->ch1)) {
+				/* Following a non-space character, a run of plain text has no
+				 * effect on the token other than to lengthen it, so skip to 
+				 * the end of the run in one step. */
+				ch = rewind(parser, skip_plain_text(parser->input, 
+					parser->pos_ch1, parser->input_size));
 			} else {
 				ch = next_character(parser);
 			}
@@ -545,6 +649,7 @@ static int read_color_literal(Parser *parser, int keyword)
 }
 
 static int parse_tag(Parser *parser);
+static int match_closing_tag(Parser *parser, int tag_name);
 
 
 /* Appends a text node to the current scope. */
@@ -554,23 +659,32 @@ static int add_text_node(Parser *parser)
 		return parser_error(parser, STKR_INCORRECT_CONTEXT);
 	unsigned unescaped_length = parser->token_value.string.length - 
 		parser->token_escape_count;
+	bool share = parser->text_base != NULL && parser->token_escape_count == 0;
 	Node *node = NULL;
-	int rc = create_node(
+	int rc = parser_create_node(
+		parser,
 		&node, 
-		parser->document, 
 		LNODE_TEXT, 
 		TOKEN_INVALID, 
 		NULL, 0, 
-		NULL, 
-		unescaped_length);
+		share ? 0 : unescaped_length);
 	if (rc >= 0) {
-		unescape(
-			parser->token_value.string.data, 
-			parser->token_value.string.length, 
-			node->text);
+		if (share) {
+			share_node_text(node, parser->text_base + 
+				(parser->token_value.string.data - parser->input), 
+				unescaped_length);
+		} else {
+			unescape(
+				parser->token_value.string.data, 
+				parser->token_value.string.length, 
+				node->text);
+		}
 		set_node_debug_string(node, "text (%u characters)", 
 			unescaped_length);
-		append_child(parser->document, parser->scope, node);
+		parser_append_child(parser, parser->scope, node);
+		node->source_offset = unsigned(parser->token_value.string.data - 
+			parser->input) - parser->scope_start;
+		node->source_length = parser->token_value.string.length;
 	} else {
 		parser_error(parser, STKR_ERROR);
 	}
@@ -606,12 +720,68 @@ static int maybe_skip_closing_tag(Parser *parser)
 	return STKR_SKIP_TAG;
 }
 
-static int parse_text(Parser *parser, bool in_block = true)
+/* Appends a subtree built by a worker thread in place of the element it was
+ * parsed from, and moves the tokenizer past the element. If the worker 
+ * failed, the element is parsed here instead. */
+static int attach_span(Parser *parser, const ParseSpan *span)
 {
-	int rc = STKR_OK;
-	bool done = false, have_paragraph = false;
+	if (span->node == NULL)
+		return parse_tag(parser);
+	push_scope(parser, span->node, span->start);
+	int rc = pop_scope(parser, span->end);
+	parser->line += span->lines;
+	parser->in_tag = false;
+	rewind(parser, span->end);
+	next_token(parser);
+	return rc;
+}
 
-	do {
+/* Passes over spans that start before the tag being parsed. The main thread
+ * never reached their opening '<', for example because they began inside a 
+ * skipped tag, and would otherwise stop any later span from being attached. */
+static void skip_passed_spans(Parser *parser)
+{
+	while (parser->next_span != parser->num_spans && 
+		parser->spans[parser->next_span].start < parser->tag_start) {
+		ParseSpan *span = parser->spans + parser->next_span++;
+		if (span->node != NULL)
+			destroy_node(parser->document, span->node, true);
+	}
+}
+
+/* Pushes a frame for the content of a tag. */
+static void push_frame(Parser *parser, int tag_name, bool in_block)
+{
+	if (parser->num_frames == parser->frame_capacity) {
+		unsigned new_capacity = parser->frame_capacity != 0 ? 
+			2 * parser->frame_capacity : PARSER_INITIAL_FRAME_CAPACITY;
+		ParseFrame *frames = new ParseFrame[new_capacity];
+		if (parser->frames != NULL) {
+			memcpy(frames, parser->frames, 
+				parser->num_frames * sizeof(ParseFrame));
+			delete [] parser->frames;
+		}
+		parser->frames = frames;
+		parser->frame_capacity = new_capacity;
+	}
+	ParseFrame *frame = parser->frames + parser->num_frames++;
+	frame->tag_name = tag_name;
+	frame->in_block = in_block;
+	frame->have_paragraph = false;
+}
+
+/* Parses text and tags until the frame at the bottom of the stack is 
+ * terminated by a closing tag or the end of the input. Nested tags push frames
+ * rather than recursing, so that when more input is expected, the parser can 
+ * return STKR_OK_SUSPEND at the end of the available input and pick up where 
+ * it left off when parse_content() is next called. */
+static int parse_content(Parser *parser)
+{
+	int rc = STKR_OK;
+	for (;;) {
+		ParseFrame *frame = parser->frames + parser->num_frames - 1;
+		bool in_block = frame->in_block;
+		bool done = false;
 		bool open_paragraph = false;
 		bool close_paragraph = false;
 
@@ -624,6 +794,7 @@ static int parse_text(Parser *parser, bool in_block = true)
 				continue;
 			}
 		} else if (token == TOKEN_OPEN_ANGLE) {
+			parser->tag_start = parser->pos_ch0 - 1;
 			rc = maybe_skip_opening_tag(parser);
 			if (rc == STKR_SKIP_TAG)
 				continue;
@@ -649,20 +820,24 @@ static int parse_text(Parser *parser, bool in_block = true)
 			next_token(parser);
 			close_paragraph = true;
 		} else if (token == TOKEN_EOF) {
+			/* The end of a partial input just means we have to wait. */
+			if (!parser->final)
+				return STKR_OK_SUSPEND;
 			done = true;
 		} else {
 			return parser_error(parser, STKR_INVALID_INPUT);
 		}
 
 		/* Start a new paragraph if required. */
-		if (open_paragraph && !have_paragraph) {
+		if (open_paragraph && !frame->have_paragraph) {
 			Node *paragraph = NULL;
-			rc = create_node(&paragraph, parser->document, LNODE_PARAGRAPH, 
+			rc = parser_create_node(parser, &paragraph, LNODE_PARAGRAPH, 
 				TOKEN_PARAGRAPH);
 			if (rc < 0)
 				return parser_error(parser, STKR_ERROR);
-			push_scope(parser, paragraph);
-			have_paragraph = true;
+			push_scope(parser, paragraph, token == TOKEN_OPEN_ANGLE ? 
+				parser->tag_start : parser->token_start);
+			frame->have_paragraph = true;
 		}
 
 		/* Append a new text node to the scope. */
@@ -674,26 +849,58 @@ static int parse_text(Parser *parser, bool in_block = true)
 		}
 
 		/* Close any open paragraph before reading the tag, if requested. */
-		if (close_paragraph && have_paragraph) {
-			have_paragraph = false;
-			rc = pop_scope(parser);
+		if (close_paragraph && frame->have_paragraph) {
+			frame->have_paragraph = false;
+			rc = pop_scope(parser, last_child_end(parser));
 			if (rc != STKR_OK)
 				return rc;
 		}
 
-		/* If we've encountered a tag, parse it. */
-		if (token == TOKEN_OPEN_ANGLE) 
-			if ((rc = parse_tag(parser)) != STKR_OK)
+		/* If we've encountered a tag, parse it. This may push a frame for its
+		 * contents, which the next iteration will work on. */
+		if (token == TOKEN_OPEN_ANGLE) {
+			skip_passed_spans(parser);
+			if (parser->next_span != parser->num_spans && 
+				parser->spans[parser->next_span].start == parser->tag_start)
+				rc = attach_span(parser, parser->spans + parser->next_span++);
+			else
+				rc = parse_tag(parser);
+			if (rc != STKR_OK)
+				return rc;
+			continue;
+		}
+		if (!done)
+			continue;
+
+		/* End of the frame's content. Close any open paragraph. */
+		if (frame->have_paragraph) {
+			frame->have_paragraph = false;
+			rc = pop_scope(parser, last_child_end(parser));
+			if (rc != STKR_OK)
 				return rc;
-	} while (!done);
+		}
+		if (parser->num_frames == 1)
+			break;
 
-	return have_paragraph ? pop_scope(parser) : STKR_OK;
+		/* Match the closing tag. Note that we have already consumed the "</"
+		 * because we needed to decide whether to skip the tag. */
+		int tag_name = frame->tag_name;
+		parser->num_frames--;
+		rc = match_closing_tag(parser, tag_name);
+		if (rc != STKR_OK)
+			return rc;
+	}
+	return STKR_OK;
 }
 
 static int interpret_tag(Parser *parser, int tag_name, 
 	const AttributeAssignment *attributes, unsigned num_attributes)
 {
 	if (tag_name == TOKEN_RULE) {
+		/* Rules must be added in document order. A worker thread can't do 
+		 * that, so it gives up and leaves the span to the main thread. */
+		if (parser->node_arena != NULL)
+			return STKR_INCORRECT_CONTEXT;
 		int rc = add_rule_from_attributes(
 			NULL,
 			parser->system, 
@@ -711,11 +918,11 @@ static int interpret_tag(Parser *parser, int tag_name,
 		if (node_type == LNODE_INVALID)
 			return STKR_SKIP_TAG;
 		Node *node = NULL;
-		int rc = create_node(&node, parser->document, node_type, tag_name, 
+		int rc = parser_create_node(parser, &node, node_type, tag_name, 
 			attributes, num_attributes);
 		if (rc < 0)
 			return parser_error(parser, STKR_ERROR);
-		push_scope(parser, node);
+		push_scope(parser, node, parser->tag_start);
 	}
 	return STKR_OK;
 }
@@ -728,8 +935,9 @@ static int match_closing_tag(Parser *parser, int tag_name)
 			TOKEN_STRINGS[tag_name]);
 	if (next_token(parser) != TOKEN_CLOSE_ANGLE)
 		return parser_error(parser, STKR_UNEXPECTED_TOKEN, ">");
+	unsigned end = parser->pos_ch0;
 	next_token(parser); // Consume '>'.
-	return pop_scope(parser);
+	return pop_scope(parser, end);
 }
 
 /* Parses a list of attribute assignments inside a tag. */
@@ -829,6 +1037,7 @@ static int parse_tag(Parser *parser)
 	bool self_terminating = (parser->token == TOKEN_SLASH_CLOSE_ANGLE);
 	if (parser->token != TOKEN_CLOSE_ANGLE && !self_terminating)
 		return parser_error(parser, STKR_UNEXPECTED_TOKEN, ">");
+	unsigned end = parser->pos_ch0;
 	next_token(parser);
 
 	/* Create a node for the tag. */
@@ -843,25 +1052,18 @@ static int parse_tag(Parser *parser)
 
 	/* Self terminating tags have no content and we don't expect a closer. */
 	if (self_terminating)
-		return (rc == STKR_OK_NO_SCOPE) ? STKR_OK : pop_scope(parser);
-
-	/* Parse the contents. */
-	rc = parse_text(parser, token_natural_layout(tag_name) == LAYOUT_BLOCK);
-	if (rc != STKR_OK)
-		return rc;
+		return (rc == STKR_OK_NO_SCOPE) ? STKR_OK : pop_scope(parser, end);
 
-	/* Match the closing tag. Note than parse_text() has consumed the "</"
-	 * because it needed to decide whether to skip the tag. */
-	return match_closing_tag(parser, tag_name);
+	/* The contents are parsed by parse_content() in a new frame. */
+	push_frame(parser, tag_name, 
+		token_natural_layout(tag_name) == LAYOUT_BLOCK);
+	return STKR_OK;
 }
 
-int parse_document(Parser *parser)
+/* Checks that the top level content was terminated by the end of the input. */
+static int check_end_of_document(Parser *parser)
 {
-	bool in_block = parser->scope == NULL || 
-		natural_layout((NodeType)parser->scope->type) == LAYOUT_BLOCK;
-	int rc = parse_text(parser, in_block);
-	if (rc != STKR_OK)
-		return rc;
+	int rc = STKR_OK;
 	if (parser->token != TOKEN_EOF) {
 		if (parser->token == TOKEN_OPEN_ANGLE_SLASH) {
 			int tag_name = next_token(parser);
@@ -875,6 +1077,16 @@ int parse_document(Parser *parser)
 	return rc;
 }
 
+/* Parses as much of the input as is available. Returns STKR_OK_SUSPEND if the
+ * input is partial and the parser is waiting for more. */
+static int parse_document(Parser *parser)
+{
+	int rc = parse_content(parser);
+	if (rc != STKR_OK)
+		return rc;
+	return check_end_of_document(parser);
+}
+
 void init_parser(Parser *parser, System *system, Document *document, 
 	unsigned flags)
 {
@@ -884,15 +1096,35 @@ void init_parser(Parser *parser, System *system, Document *document,
 	parser->input_size = 0;
 	parser->pos = 0;
 	parser->token = STKR_INVALID_TOKEN;
+	parser->frames = NULL;
+	parser->num_frames = 0;
+	parser->frame_capacity = 0;
+	parser->buffer = NULL;
+	parser->buffer_size = 0;
+	parser->buffer_capacity = 0;
+	parser->scan_pos = 0;
+	parser->scan_state = SCAN_TEXT;
+	parser->final = true;
 	parser->message.utf8 = NULL;
 	parser->message_length = 0;
 	parser->code = STKR_OK;
 	parser->flags = flags;
+	parser->node_arena = NULL;
+	parser->text_base = NULL;
+	parser->spans = NULL;
+	parser->num_spans = 0;
+	parser->next_span = 0;
 }
 
 void deinit_parser(Parser *parser)
 {
 	clear_message(parser);
+	delete [] parser->frames;
+	parser->frames = NULL;
+	parser->frame_capacity = 0;
+	delete [] parser->buffer;
+	parser->buffer = NULL;
+	parser->buffer_capacity = 0;
 }
 
 static void reset_parser(Parser *parser, Node *root, 
@@ -902,6 +1134,8 @@ static void reset_parser(Parser *parser, Node *root,
 	parser->first_parsed = NULL;
 	parser->last_parsed = NULL;
 	parser->scope = root;
+	parser->scope_start = 0;
+	parser->tag_start = 0;
 	parser->input = input;
 	parser->input_size = length;
 	parser->pos = 0;
@@ -915,24 +1149,370 @@ static void reset_parser(Parser *parser, Node *root,
 	if (skip_two_characters(parser) == UNICODE_BOM)
 		next_character(parser);
 	next_token(parser);
+
+	/* Push a frame for the top level content. */
+	bool in_block = root == NULL || 
+		natural_layout((NodeType)root->type) == LAYOUT_BLOCK;
+	parser->num_frames = 0;
+	push_frame(parser, TOKEN_INVALID, in_block);
+
+	/* The root's markup is known again only if the parse succeeds. */
+	parser->root_was_empty = root == NULL || root->t.first.node == NULL;
+	if (root != NULL)
+		root->source_offset = NO_SOURCE_OFFSET;
 }
 
-int parse(Parser *parser, Node *root, const char *input, unsigned length)
+/* Records that the children of the document root were all parsed from the
+ * input, which makes incremental reparsing of the input possible. */
+static void set_root_source(Parser *parser)
+{
+	Node *root = parser->root;
+	if (root != NULL && parser->root_was_empty && 
+		root == parser->document->root &&
+		(parser->flags & PARSEFLAG_SINGLE_NODE) == 0) {
+		root->source_offset = 0;
+		root->source_length = parser->input_size;
+	}
+}
+
+/* Checks that a root node belongs to the parser's document. */
+static int check_root(Parser *parser, Node *root)
 {
-	/* If we have a root node, make sure it's from the parser's document. */
 	if (root != NULL && (parser->document == NULL ||
 		root->document != parser->document))
 		return parser_error(parser, STKR_ERROR);
+	return STKR_OK;
+}
+
+/* Finds block elements that can be handed to worker threads. Elements at most
+ * 'max_size' bytes long are taken whole. Larger ones are opened up so that 
+ * their children are considered instead, since a document usually has one
+ * top level element containing everything. The scan follows the tokenizer's 
+ * rules for escapes, tags and strings but doesn't otherwise check the markup.
+ * If the tags don't balance, no spans are returned, and the main thread parses
+ * the input and reports the error. */
+static void find_parse_spans(const char *input, unsigned length, 
+	unsigned max_size, std::vector<ParseSpan> *spans)
+{
+	struct OpenElement {
+		unsigned start;
+		int tag_name;
+	};
+	std::vector<OpenElement> open;
+	spans->clear();
+	ScanState state = SCAN_TEXT;
+	unsigned tag_start = 0;
+	int tag_name = TOKEN_INVALID;
+	bool closing = false;
+	for (unsigned i = 0; i < length; ++i) {
+		char ch = input[i];
+		if (state == SCAN_TEXT) {
+			if (ch == '\\') {
+				state = SCAN_TEXT_ESCAPE;
+			} else if (ch == '<') {
+				tag_start = i;
+				closing = i + 1 < length && input[i + 1] == '/';
+				unsigned name_start = i + 1 + closing, name_end = name_start;
+				while (name_end < length && (isalnum((uint8_t)input[name_end]) ||
+					input[name_end] == '-'))
+					name_end++;
+				tag_name = find_keyword(input + name_start, name_end - name_start);
+				i = name_end - 1;
+				state = SCAN_TAG;
+			}
+		} else if (state == SCAN_TEXT_ESCAPE) {
+			state = SCAN_TEXT;
+		} else if (state == SCAN_TAG) {
+			if (ch == '"') {
+				state = SCAN_STRING;
+			} else if (ch == '>') {
+				state = SCAN_TEXT;
+				if (closing) {
+					if (open.empty() || open.back().tag_name != tag_name) {
+						spans->clear();
+						return;
+					}
+					unsigned start = open.back().start;
+					open.pop_back();
+					if (i + 1 - start >= PARALLEL_PARSE_MIN_SPAN &&
+						i + 1 - start <= max_size &&
+						token_natural_layout(tag_name) == LAYOUT_BLOCK) {
+						/* Elements close after their children, so this one
+						 * replaces any spans found inside it. */
+						while (!spans->empty() && spans->back().start > start)
+							spans->pop_back();
+						ParseSpan span = { start, i + 1, 0, NULL, NULL };
+						spans->push_back(span);
+					}
+				} else if (input[i - 1] != '/') {
+					OpenElement element = { tag_start, tag_name };
+					open.push_back(element);
+				}
+			}
+		} else if (ch == '"') {
+			state = SCAN_TAG;
+		}
+	}
+	if (!open.empty() || state != SCAN_TEXT)
+		spans->clear();
+}
+
+/* Parses spans on a worker thread until there are none left. Each worker
+ * builds its subtrees in its own arena. */
+static void run_parse_worker(Parser *main_parser, Arena *arena, 
+	std::atomic<unsigned> *next_span)
+{
+	Parser parser;
+	init_parser(&parser, main_parser->system, main_parser->document, 0);
+	parser.node_arena = arena;
+	for (;;) {
+		unsigned index = next_span->fetch_add(1);
+		if (index >= main_parser->num_spans)
+			break;
+		ParseSpan *span = main_parser->spans + index;
+		if (main_parser->text_base != NULL)
+			parser.text_base = main_parser->text_base + span->start;
+		int rc = parse(&parser, NULL, main_parser->input + span->start, 
+			span->end - span->start);
+		if (rc == STKR_OK && parser.first_parsed != NULL && 
+			parser.first_parsed == parser.last_parsed) {
+			span->node = parser.first_parsed;
+			span->lines = parser.line - 1;
+		} else {
+			/* Find the top of whatever was built before the failure. */
+			Node *partial = parser.first_parsed;
+			if (partial == NULL && parser.scope != NULL) {
+				partial = parser.scope;
+				while (partial->t.parent.node != NULL)
+					partial = partial->t.parent.node;
+			}
+			span->partial = partial;
+		}
+	}
+	deinit_parser(&parser);
+}
+
+/* Parses large block elements of the input on worker threads before the main
+ * thread starts. The main thread attaches the results as it reaches each span
+ * in the input, so the tree, the order of rules and any errors are the same as
+ * if the whole input had been parsed in sequence. */
+static void parse_spans_in_parallel(Parser *parser)
+{
+	unsigned length = parser->input_size;
+	unsigned num_threads = std::min(std::thread::hardware_concurrency(), 
+		MAX_PARSE_THREADS);
+	if (length < PARALLEL_PARSE_MIN_INPUT || num_threads < 2)
+		return;
+	std::vector<ParseSpan> spans;
+	find_parse_spans(parser->input, length, 
+		length / (num_threads * PARALLEL_PARSE_SPANS_PER_THREAD), &spans);
+	if (spans.size() < 2)
+		return;
+	parser->num_spans = (unsigned)spans.size();
+	parser->spans = new ParseSpan[parser->num_spans];
+	std::copy(spans.begin(), spans.end(), parser->spans);
+	parser->next_span = 0;
+
+	/* The main thread works too. */
+	num_threads = std::min(num_threads, parser->num_spans);
+	Arena arenas[MAX_PARSE_THREADS];
+	std::thread threads[MAX_PARSE_THREADS];
+	std::atomic<unsigned> next_span(0);
+	for (unsigned i = 0; i < num_threads; ++i)
+		arena_init(arenas + i);
+	for (unsigned i = 1; i < num_threads; ++i)
+		threads[i] = std::thread(run_parse_worker, parser, arenas + i, &next_span);
+	run_parse_worker(parser, arenas, &next_span);
+	for (unsigned i = 1; i < num_threads; ++i)
+		threads[i].join();
+
+	/* Hand the nodes over to the document, then throw away any that came from
+	 * failed spans. */
+	Document *document = parser->document;
+	for (unsigned i = 0; i < num_threads; ++i) {
+		document->system->total_nodes += arenas[i].num_allocations;
+		arena_merge(&document->node_arena, arenas + i);
+	}
+	for (unsigned i = 0; i < parser->num_spans; ++i) {
+		if (parser->spans[i].partial != NULL)
+			destroy_node(document, parser->spans[i].partial, true);
+	}
+}
+
+/* Destroys any subtrees that the main thread didn't reach. */
+static void release_spans(Parser *parser)
+{
+	for (unsigned i = parser->next_span; i < parser->num_spans; ++i) {
+		if (parser->spans[i].node != NULL)
+			destroy_node(parser->document, parser->spans[i].node, true);
+	}
+	delete [] parser->spans;
+	parser->spans = NULL;
+	parser->num_spans = 0;
+	parser->next_span = 0;
+}
+
+int parse(Parser *parser, Node *root, const char *input, unsigned length)
+{
+	/* If we have a root node, make sure it's from the parser's document. */
+	if (check_root(parser, root) != STKR_OK)
+		return parser->code;
 	
-	/* Pass the source to the document so it can make a copy if desired. */
-	if (parser->document != NULL)
-		document_store_source(parser->document, input, length);
+	/* Pass the source to the document so it can make a copy if desired. 
+	 * Worker threads parse pieces of a source that has already been stored,
+	 * and are told where their text is by the main thread. */
+	if (parser->document != NULL && parser->node_arena == NULL) {
+		const char *stored = document_store_source(parser->document, 
+			input, length);
+		parser->text_base = NULL;
+		if ((parser->flags & PARSEFLAG_SHARE_TEXT) != 0) {
+			if ((parser->document->flags & DOCFLAG_KEEP_SOURCE) != 0)
+				parser->text_base = stored;
+			else
+				parser->text_base = input;
+		}
+	}
 	
 	/* Reset parsing state and parse the input. */
+	parser->final = true;
 	reset_parser(parser, root, input, length);
+	if ((parser->flags & PARSEFLAG_PARALLEL) != 0 && parser->document != NULL)
+		parse_spans_in_parallel(parser);
 	int rc = parse_document(parser);
+	release_spans(parser);
 	if (rc == STKR_OK_HALT)
 		rc = STKR_OK;
+	if (rc == STKR_OK)
+		set_root_source(parser);
+	return rc;
+}
+
+/* Advances the boundary scan over newly buffered input, returning the length 
+ * of the longest prefix of the buffer that ends just after a tag. Such a 
+ * prefix never ends inside a token, a string, an escape sequence or a UTF-8 
+ * sequence, so the tokenizer can run to the end of it and resume later from
+ * the same position. */
+static unsigned scan_for_boundary(Parser *parser)
+{
+	const char *buffer = parser->buffer;
+	unsigned boundary = parser->input_size;
+	unsigned state = parser->scan_state;
+	for (unsigned i = parser->scan_pos; i < parser->buffer_size; ++i) {
+		char ch = buffer[i];
+		switch (state) {
+			case SCAN_TEXT:
+				if (ch == '\\')
+					state = SCAN_TEXT_ESCAPE;
+				else if (ch == '<')
+					state = SCAN_TAG;
+				break;
+			case SCAN_TEXT_ESCAPE:
+				state = SCAN_TEXT;
+				break;
+			case SCAN_TAG:
+				if (ch == '"') {
+					state = SCAN_STRING;
+				} else if (ch == '>') {
+					state = SCAN_TEXT;
+					boundary = i + 1;
+				}
+				break;
+			case SCAN_STRING:
+				if (ch == '"')
+					state = SCAN_TAG;
+				break;
+		}
+	}
+	parser->scan_pos = parser->buffer_size;
+	parser->scan_state = (uint8_t)state;
+	return boundary;
+}
+
+/* Makes the first 'length' bytes of the buffer available to the tokenizer, 
+ * which is waiting at the end of the previous input with TOKEN_EOF as its 
+ * current token. */
+static void extend_input(Parser *parser, unsigned length)
+{
+	parser->input = parser->buffer;
+	parser->input_size = length;
+	rewind(parser, parser->pos_ch0);
+	if (parser->pos_ch0 == 0 && parser->ch0 == UNICODE_BOM)
+		next_character(parser);
+	next_token(parser);
+}
+
+/* Prepares to parse a document that will be supplied in pieces by 
+ * parse_feed(). */
+int parse_begin(Parser *parser, Node *root)
+{
+	if (check_root(parser, root) != STKR_OK)
+		return parser->code;
+	parser->buffer_size = 0;
+	parser->scan_pos = 0;
+	parser->scan_state = SCAN_TEXT;
+	parser->final = false;
+	reset_parser(parser, root, parser->buffer, 0);
+	return STKR_OK;
+}
+
+/* Appends a chunk of input and parses as much of the input received so far as
+ * is possible. Chunks may be split at any byte. */
+int parse_feed(Parser *parser, const char *data, unsigned length)
+{
+	if (parser->code != STKR_OK)
+		return parser->code;
+	
+	/* Append the chunk to the buffer. */
+	unsigned required = parser->buffer_size + length;
+	if (required > parser->buffer_capacity) {
+		unsigned new_capacity = parser->buffer_capacity != 0 ? 
+			parser->buffer_capacity : PARSER_INITIAL_BUFFER_CAPACITY;
+		while (new_capacity < required)
+			new_capacity *= 2;
+		char *buffer = new char[new_capacity];
+		if (parser->buffer != NULL) {
+			memcpy(buffer, parser->buffer, parser->buffer_size);
+			delete [] parser->buffer;
+		}
+		parser->buffer = buffer;
+		parser->buffer_capacity = new_capacity;
+		parser->input = buffer;
+	}
+	memcpy(parser->buffer + parser->buffer_size, data, length);
+	parser->buffer_size = required;
+
+	/* Parse up to the end of the last complete tag, if we have a new one. */
+	unsigned boundary = scan_for_boundary(parser);
+	if (boundary == parser->input_size || parser->num_frames == 0)
+		return STKR_OK;
+	extend_input(parser, boundary);
+	int rc = parse_content(parser);
+	if (rc == STKR_OK_SUSPEND)
+		return STKR_OK;
+	if (rc == STKR_OK)
+		rc = check_end_of_document(parser);
+	if (rc < 0 && parser->code == STKR_OK)
+		parser->code = rc;
+	parser->num_frames = 0;
+	return rc;
+}
+
+/* Parses the remainder of the input after the last call to parse_feed(). */
+int parse_end(Parser *parser)
+{
+	if (parser->code != STKR_OK)
+		return parser->code;
+	if (parser->document != NULL)
+		document_store_source(parser->document, parser->buffer, 
+			parser->buffer_size);
+	parser->final = true;
+	if (parser->num_frames == 0)
+		return parser->code;
+	extend_input(parser, parser->buffer_size);
+	int rc = parse_document(parser);
+	parser->num_frames = 0;
+	if (rc == STKR_OK)
+		set_root_source(parser);
 	return rc;
 }
 
@@ -972,7 +1552,12 @@ int parse(
 	void *error_buffer, 
 	unsigned error_buffer_size)
 {
-	return parse_helper(system, document, root, input, length, 0, 
+	unsigned flags = 0;
+	if (document != NULL && (document->flags & DOCFLAG_PARALLEL_PARSE) != 0)
+		flags |= PARSEFLAG_PARALLEL;
+	if (document != NULL && (document->flags & DOCFLAG_SHARE_SOURCE_TEXT) != 0)
+		flags |= PARSEFLAG_SHARE_TEXT;
+	return parse_helper(system, document, root, input, length, flags, 
 		NULL, NULL, error_buffer, error_buffer_size);
 }
 
@@ -991,4 +1576,204 @@ int create_node_from_markup(
 		PARSEFLAG_SINGLE_NODE, out_node, NULL, error_buffer, error_buffer_size);
 }
 
+/* True if a piece of markup might contain a rule tag. Rules can't be replaced
+ * along with a subtree, so markup that might have one isn't reparsed on its
+ * own. False positives just cost a full parse. */
+static bool might_contain_rule(const char *s, unsigned length)
+{
+	static const char RULE[] = "rule";
+	const char *end = s + length;
+	while ((s = (const char *)memchr(s, '<', end - s)) != NULL) {
+		do {
+			s++;
+		} while (s != end && isspace((unsigned char)*s));
+		if (unsigned(end - s) >= sizeof(RULE) - 1 &&
+			memcmp(s, RULE, sizeof(RULE) - 1) == 0)
+			return true;
+	}
+	return false;
+}
+
+/* Finds the deepest node whose markup strictly encloses the bytes from 
+ * 'start' up to 'end' of the source, leaving its first and last characters
+ * untouched. Returns NULL if there is none but the root. */
+static Node *find_enclosing_element(Node *root, unsigned start, unsigned end,
+	unsigned *out_start)
+{
+	Node *node = root;
+	unsigned node_start = 0;
+	for (;;) {
+		Node *child = node->t.first.node;
+		unsigned child_start = 0;
+		for (; child != NULL; child = child->t.next.node) {
+			if (child->source_offset == NO_SOURCE_OFFSET)
+				continue;
+			child_start = node_start + child->source_offset;
+			if (child_start >= start) {
+				child = NULL;
+				break;
+			}
+			if (end < child_start + child->source_length)
+				break;
+		}
+		if (child == NULL)
+			break;
+		node = child;
+		node_start = child_start;
+	}
+	*out_start = node_start;
+	return node != root ? node : NULL;
+}
+
+/* Parses the markup of one element on its own. The result is NULL if the
+ * markup isn't exactly one element. */
+static int parse_element(Parser *parser, const char *input, unsigned length,
+	Node **out_node)
+{
+	*out_node = NULL;
+	parser->final = true;
+	reset_parser(parser, NULL, input, length);
+	parser->frames[0].in_block = false; /* Don't wrap the element in a <p>. */
+	int rc = parse_content(parser);
+	Node *node = parser->first_parsed;
+	if (rc == STKR_OK_HALT && node != NULL && node->source_offset == 0 && 
+		node->source_length == length) {
+		*out_node = node;
+		return STKR_OK;
+	}
+
+	/* Destroy whatever was built. */
+	if (node == NULL && parser->scope != NULL) {
+		node = parser->scope;
+		while (node->t.parent.node != NULL)
+			node = node->t.parent.node;
+	}
+	if (node != NULL)
+		destroy_node(parser->document, node, true);
+	return rc < 0 ? rc : STKR_OK;
+}
+
+/* Elements can be swapped without changing how their neighbours are wrapped
+ * in paragraphs if they have the same kind of natural layout. */
+static bool same_paragraph_behaviour(int tag_a, int tag_b)
+{
+	Layout a = token_natural_layout(tag_a);
+	Layout b = token_natural_layout(tag_b);
+	return a == b || (a != LAYOUT_NONE && a != LAYOUT_INLINE && 
+		b != LAYOUT_NONE && b != LAYOUT_INLINE);
+}
+
+/* Shifts the markup of everything that follows a node in the source by the
+ * change in the node's length. */
+static void shift_following_markup(Node *root, Node *node, unsigned delta)
+{
+	do {
+		for (Node *sibling = node->t.next.node; sibling != NULL; 
+			sibling = sibling->t.next.node) {
+			if (sibling->source_offset != NO_SOURCE_OFFSET)
+				sibling->source_offset += delta;
+		}
+		node = node->t.parent.node;
+		node->source_length += delta;
+	} while (node != root);
+}
+
+/* Tries to replace the smallest element enclosing an edit with a subtree 
+ * parsed from the element's new markup. Returns STKR_OK_HALT if the edit
+ * can't be handled that way. */
+static int reparse_enclosing_element(Document *document, const char *input, 
+	unsigned length, unsigned edit_start, unsigned edit_old_end, 
+	unsigned edit_new_end)
+{
+	/* The tree must have been parsed from the kept source, and the edit must
+	 * be consistent with both inputs. */
+	Node *root = document->root;
+	unsigned old_length = document->source_length;
+	if ((document->flags & DOCFLAG_KEEP_SOURCE) == 0 ||
+		(document->flags & DOCFLAG_SHARE_SOURCE_TEXT) != 0 ||
+		root->source_offset != 0 || root->source_length != old_length ||
+		edit_start > edit_old_end || edit_old_end > old_length ||
+		edit_start > edit_new_end || edit_new_end > length ||
+		old_length - edit_old_end != length - edit_new_end)
+		return STKR_OK_HALT;
+
+	unsigned start = 0;
+	Node *node = find_enclosing_element(root, edit_start, edit_old_end, &start);
+	if (node == NULL)
+		return STKR_OK_HALT;
+
+	/* Try successively larger elements until one parses to a single element
+	 * that can stand in for the old one. Text and implicit paragraphs don't 
+	 * start with a tag, and are passed over. A syntax error would recur in
+	 * every enclosing element, so it goes straight to a full parse, which 
+	 * reports it. */
+	unsigned delta = length - old_length;
+	Parser parser;
+	init_parser(&parser, document->system, document, PARSEFLAG_SINGLE_NODE);
+	int rc = STKR_OK_HALT;
+	for (; node != root; start -= node->source_offset, 
+		node = node->t.parent.node) {
+		if (input[start] != '<')
+			continue;
+		unsigned old_element_length = node->source_length;
+		unsigned new_element_length = old_element_length + delta;
+		if (might_contain_rule(document->source + start, old_element_length) ||
+			might_contain_rule(input + start, new_element_length))
+			break;
+		Node *replacement = NULL;
+		if (parse_element(&parser, input + start, new_element_length, 
+			&replacement) != STKR_OK)
+			break;
+		if (replacement != NULL && same_paragraph_behaviour(node->token, 
+			replacement->token)) {
+			insert_child_before(document, node->t.parent.node, replacement, node);
+			replacement->source_offset = node->source_offset;
+			destroy_node(document, node, true);
+			shift_following_markup(root, replacement, delta);
+			rc = STKR_OK;
+			break;
+		}
+		if (replacement != NULL)
+			destroy_node(document, replacement, true);
+	}
+	deinit_parser(&parser);
+	if (rc != STKR_OK)
+		return rc;
+
+	/* Keep the new source. */
+	document->source_length = 0;
+	document_store_source(document, input, length);
+	return STKR_OK;
+}
+
+/* Updates a document parsed from a kept source after an edit that replaced
+ * the bytes from 'edit_start' to 'edit_old_end' of the old source with those
+ * from 'edit_start' to 'edit_new_end' of 'input'. Where possible, only the 
+ * smallest element enclosing the edit is parsed again, and its subtree 
+ * replaced, so the rest of the tree keeps its boxes and layout. Otherwise the
+ * document is reset and the whole input parsed. */
+int reparse(
+	System *system, 
+	Document *document, 
+	const char *input, 
+	unsigned length,
+	unsigned edit_start,
+	unsigned edit_old_end,
+	unsigned edit_new_end,
+	void *error_buffer, 
+	unsigned error_buffer_size)
+{
+	int rc = reparse_enclosing_element(document, input, length, 
+		edit_start, edit_old_end, edit_new_end);
+	if (rc == STKR_OK) {
+		if (error_buffer != NULL)
+			strcpy_encoding("", 0, error_buffer, error_buffer_size, 
+				system->message_encoding);
+		return STKR_OK;
+	}
+	reset_document(document);
+	return parse(system, document, get_root(document), input, length, 
+		error_buffer, error_buffer_size);
+}
+
 } // namespace stkr
@@ -10,13 +10,24 @@ namespace stkr {
 struct System;
 struct Document;
 struct Node;
+struct Arena;
+struct ParseSpan;
 
 const unsigned MAX_ATTRIBUTES       = 32;
 const unsigned MAX_MESSAGE_SIZE     = 511;
 const unsigned ERROR_CONTEXT_CHARS  = 16;
+const unsigned PARSER_INITIAL_FRAME_CAPACITY  = 32;
+const unsigned PARSER_INITIAL_BUFFER_CAPACITY = 16 * 1024;
+
+const unsigned MAX_PARSE_THREADS          = 16;
+const unsigned PARALLEL_PARSE_MIN_INPUT   = 256 * 1024; /* Smaller inputs are parsed on one thread. */
+const unsigned PARALLEL_PARSE_MIN_SPAN    = 4 * 1024;   /* Smaller subtrees aren't worth a handoff. */
+const unsigned PARALLEL_PARSE_SPANS_PER_THREAD = 4;
 
 enum ParserFlag {
-	PARSEFLAG_SINGLE_NODE = 1 << 0 /* Stop after parsing the first node in the input. */
+	PARSEFLAG_SINGLE_NODE = 1 << 0, /* Stop after parsing the first node in the input. */
+	PARSEFLAG_PARALLEL    = 1 << 1, /* Parse large subtrees on worker threads. */
+	PARSEFLAG_SHARE_TEXT  = 1 << 2  /* Text nodes refer to the source rather than a copy. */
 };
 
 struct Position {
@@ -27,6 +38,21 @@ struct Position {
 	uint32_t ch1;
 };
 
+/* State of the scan for safe stopping points in streamed input. */
+enum ScanState {
+	SCAN_TEXT,
+	SCAN_TEXT_ESCAPE,
+	SCAN_TAG,
+	SCAN_STRING
+};
+
+/* Parsing state for the content of an open tag. */
+struct ParseFrame {
+	int tag_name;
+	bool in_block;       /* Text is wrapped in paragraphs. */
+	bool have_paragraph; /* We've opened a paragraph that is the current scope. */
+};
+
 struct Parser {
 	System *system;
 	Document *document;
@@ -48,6 +74,23 @@ struct Parser {
 	bool emit_break;
 	int line;
 	Node *scope;
+	unsigned scope_start;    /* Input offset of the markup of the current scope. */
+	unsigned tag_start;      /* Input offset of the '<' of the tag being parsed. */
+	bool root_was_empty;     /* The root had no children when the parse began. */
+	ParseFrame *frames;
+	unsigned num_frames;
+	unsigned frame_capacity;
+	char *buffer;            /* Input received so far when streaming. */
+	unsigned buffer_size;
+	unsigned buffer_capacity;
+	unsigned scan_pos;       /* Buffered bytes examined by the boundary scan. */
+	uint8_t scan_state;
+	bool final;              /* The input ends at input_size. */
+	Arena *node_arena;       /* If set, nodes are built detached from the document in this arena. */
+	const char *text_base;   /* If set, a copy of the input that text nodes without escapes refer to. */
+	ParseSpan *spans;        /* Subtrees parsed in advance by worker threads. */
+	unsigned num_spans;
+	unsigned next_span;
 	unsigned flags;
 	int code;
 	union {
@@ -59,10 +102,13 @@ struct Parser {
 	unsigned message_length;
 };
 
-void init_parser(Parser *parser);
+void init_parser(Parser *parser, System *system, Document *document, 
+	unsigned flags = 0);
 void deinit_parser(Parser *parser);
-int parse(Parser *parser, Document *document, Node *root, 
-	const char *input, unsigned length);
+int parse(Parser *parser, Node *root, const char *input, unsigned length);
+int parse_begin(Parser *parser, Node *root);
+int parse_feed(Parser *parser, const char *data, unsigned length);
+int parse_end(Parser *parser);
 
 } // namespace stkr
 
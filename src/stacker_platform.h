@@ -1,11 +1,12 @@
 #pragma once
 
 #include <cstdio>
+#include <cstdint>
 
 namespace urlcache { 
 	class UrlCache; 
 	typedef void *UrlHandle;
-	typedef unsigned long long UrlKey; 
+	typedef uint64_t UrlKey; 
 }
 
 namespace stkr {
@@ -33,6 +34,7 @@ struct TimerValue;
 
 TimerValue platform_query_timer(void);
 bool platform_check_timeout(TimerValue start, uintptr_t timeout);
+uint64_t platform_query_microseconds(void);
 
 
 /*
@@ -51,6 +53,18 @@ void *platform_get_network_image_data(BackEnd *back_end,
 	urlcache::UrlCache *cache, urlcache::UrlHandle image_handle);
 void platform_test_network_image(FILE *os);
 
+/*
+ * Files
+ */
+struct MappedFile {
+	const void *data;
+	unsigned size;
+	void *handle;
+};
+
+bool platform_map_file(MappedFile *file, const char *path);
+void platform_unmap_file(MappedFile *file);
+
 /*
  * GUI
  */
@@ -68,4 +82,12 @@ void platform_copy_to_clipboard(BackEnd *back_end, const void *text,
 	#include "stacker_direct2d.h"
 #endif
 
+#if defined(STACKER_POSIX)
+	#include "stacker_posix.h"
+#endif
+
+#if defined(STACKER_HEADLESS)
+	#include "stacker_headless.h"
+#endif
+
 
@@ -0,0 +1,86 @@
+#if defined(STACKER_POSIX)
+
+#include "stacker_platform.h"
+
+#include <cstdint>
+#include <ctime>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace stkr {
+
+/*
+ * Platform
+ */
+
+/* There is no clipboard without a windowing system. */
+void platform_copy_to_clipboard(BackEnd *, const void *, unsigned)
+{
+}
+
+/*
+ * Timing
+ */
+
+TimerValue platform_query_timer(void)
+{
+	TimerValue now;
+	clock_gettime(CLOCK_MONOTONIC, &now.time);
+	return now;
+}
+
+bool platform_check_timeout(TimerValue start, uintptr_t timeout)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t delta_usec = 
+		int64_t(now.tv_sec - start.time.tv_sec) * 1000000 + 
+		(now.tv_nsec - start.time.tv_nsec) / 1000;
+	return uint64_t(delta_usec) >= uint64_t(timeout);
+}
+
+uint64_t platform_query_microseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return uint64_t(now.tv_sec) * 1000000 + uint64_t(now.tv_nsec) / 1000;
+}
+
+/*
+ * Files
+ */
+
+bool platform_map_file(MappedFile *file, const char *path)
+{
+	file->data = NULL;
+	file->size = 0;
+	file->handle = NULL;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	void *data = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && uint64_t(st.st_size) <= UINT32_MAX)
+		data = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd); /* The mapping keeps the file open. */
+	if (data == MAP_FAILED)
+		return false;
+	file->data = data;
+	file->size = unsigned(st.st_size);
+	return true;
+}
+
+void platform_unmap_file(MappedFile *file)
+{
+	if (file->data != NULL)
+		munmap(const_cast<void *>(file->data), file->size);
+	file->data = NULL;
+	file->size = 0;
+}
+
+} // namespace stkr
+
+#endif // defined(STACKER_POSIX)
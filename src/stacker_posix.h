@@ -0,0 +1,11 @@
+#pragma once
+
+#include <ctime>
+
+namespace stkr {
+
+struct TimerValue { 
+	struct timespec time;
+};
+
+} // namespace stkr
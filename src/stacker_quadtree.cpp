@@ -180,6 +180,7 @@ void grid_remove(Document *document, Box *box)
 {
 	if (box->cell_code == INVALID_CELL_CODE)
 		return;
+	document->update_stats.grid_removals++;
 	GridCell *cell = grid_find_cell(&document->grid, box->cell_code);
 	assertb(cell != NULL && cell->num_boxes != 0 && 
 		cell->code == box->cell_code);
@@ -205,6 +206,7 @@ void grid_insert(Document *document, Box *box)
 	assertb(cell != NULL && cell->code == cell_code);
 	if (cell_code != box->cell_code) {
 		grid_remove(document, box);
+		document->update_stats.grid_inserts++;
 		if (cell->boxes != NULL)
 			cell->boxes->cell_prev = box;
 		box->cell_next = cell->boxes;
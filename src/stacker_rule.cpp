@@ -3,7 +3,7 @@
 #include <cstdint>
 
 #include <algorithm>
-#include <unordered_map>
+#include <vector>
 
 #include "stacker_shared.h"
 #include "stacker_util.h"
@@ -21,15 +21,24 @@ inline bool is_rule_attribute(int token)
 	return token != TOKEN_MATCH && token != TOKEN_GLOBAL;
 }
 
+static const unsigned RULE_KEY_LEVEL_SHIFT = 60;
+static const uint64_t RULE_KEY_NAME_MASK = (1ull << RULE_KEY_LEVEL_SHIFT) - 1ull;
+
 /* Builds a lookup key for a rule table by combining a rule key with a level
  * number. The resulting values matches a rule with the specified key 'level' 
  * places from the end of its selector. */
 static uint64_t make_rule_lookup_key(uint64_t key, unsigned level)
 {
-	static const unsigned LEVEL_SHIFT = 60;
-	static const uint64_t NAME_MASK = (1ull << LEVEL_SHIFT) - 1ull;
 	assertb(level == (level & 7));
-	return (key & NAME_MASK) + ((uint64_t)level << LEVEL_SHIFT);
+	return (key & RULE_KEY_NAME_MASK) + ((uint64_t)level << RULE_KEY_LEVEL_SHIFT);
+}
+
+/* Hashes a rule key, ignoring any level number, for an ancestor filter. The
+ * low bits and the next bits of the hash each select a counter. */
+inline uint32_t ancestor_filter_hash(uint64_t key)
+{
+	key &= RULE_KEY_NAME_MASK;
+	return uint32_t(key ^ (key >> 32));
 }
 
 /* Parses a selector, converting it into an array of rule keys. */
@@ -119,18 +128,133 @@ int parse_selector(ParsedSelector *ps, const char *s, int length)
 	return STKR_OK;
 }
 
-static int create_rule(
-	Rule **result, 
-	System *system, 
-	Document *document, 
-	const ParsedSelector *ps,
+void selector_cache_init(SelectorCache *cache)
+{
+	memset(cache->buckets, 0, sizeof(cache->buckets));
+	cache->lru_head = NULL;
+	cache->lru_tail = NULL;
+	cache->count = 0;
+}
+
+/* Frees every cached selector. Clients must have released their handles. */
+void selector_cache_clear(SelectorCache *cache)
+{
+	CompiledSelector *cs = cache->lru_head, *next;
+	for (; cs != NULL; cs = next) {
+		next = cs->lru_next;
+		assertb(cs->refs == 0);
+		delete [] (char *)cs;
+	}
+	selector_cache_init(cache);
+}
+
+/* Unlinks a selector from the cache, freeing it unless it has handles. */
+static void selector_cache_evict(SelectorCache *cache, CompiledSelector *cs)
+{
+	CompiledSelector **link = cache->buckets + 
+		unsigned(cs->hash % SELECTOR_CACHE_BUCKETS);
+	while (*link != cs)
+		link = &(*link)->bucket_next;
+	*link = cs->bucket_next;
+	list_remove((void **)&cache->lru_head, (void **)&cache->lru_tail, cs, 
+		offsetof(CompiledSelector, lru_prev));
+	cache->count--;
+	cs->cached = false;
+	if (cs->refs == 0)
+		delete [] (char *)cs;
+}
+
+/* Returns the compiled form of a selector string, parsing it and adding it to
+ * the cache if it isn't already there. The result is valid until the next 
+ * selector is added to the cache, unless the caller takes a handle. */
+static int find_compiled_selector(CompiledSelector **result, 
+	SelectorCache *cache, const char *s, int length)
+{
+	if (length < 0)
+		length = (int)strlen(s);
+	uint64_t hash = murmur3_64(s, length);
+	CompiledSelector **bucket = cache->buckets + 
+		unsigned(hash % SELECTOR_CACHE_BUCKETS);
+	CompiledSelector *cs;
+	for (cs = *bucket; cs != NULL; cs = cs->bucket_next) {
+		if (cs->hash == hash && cs->length == unsigned(length) && 
+			memcmp(cs->text, s, length) == 0)
+			break;
+	}
+	if (cs != NULL) {
+		if (cs != cache->lru_head) {
+			list_remove((void **)&cache->lru_head, (void **)&cache->lru_tail, 
+				cs, offsetof(CompiledSelector, lru_prev));
+			list_insert_before((void **)&cache->lru_head, 
+				(void **)&cache->lru_tail, cs, cache->lru_head, 
+				offsetof(CompiledSelector, lru_prev));
+		}
+		*result = cs;
+		return STKR_OK;
+	}
+
+	/* Parse the selector into a new entry. Selectors that don't parse aren't
+	 * cached. */
+	char *block = new char[sizeof(CompiledSelector) + length + 1];
+	cs = (CompiledSelector *)block;
+	int rc = parse_selector(&cs->ps, s, length);
+	if (rc < 0) {
+		delete [] block;
+		return rc;
+	}
+	char *text = block + sizeof(CompiledSelector);
+	memcpy(text, s, length);
+	text[length] = '\0';
+	cs->text = text;
+	cs->length = unsigned(length);
+	cs->hash = hash;
+	cs->refs = 0;
+	cs->cached = true;
+	cs->bucket_next = *bucket;
+	*bucket = cs;
+	list_insert_before((void **)&cache->lru_head, (void **)&cache->lru_tail, 
+		cs, cache->lru_head, offsetof(CompiledSelector, lru_prev));
+	if (++cache->count > SELECTOR_CACHE_SIZE)
+		selector_cache_evict(cache, cache->lru_tail);
+	*result = cs;
+	return STKR_OK;
+}
+
+/* Returns a handle to the compiled form of a selector string, which stays 
+ * valid until it is passed to release_selector(). Compiling a selector that
+ * was used recently doesn't parse it again. */
+int compile_selector(CompiledSelector **result, System *system, 
+	const char *selector, int length)
+{
+	*result = NULL;
+	CompiledSelector *cs;
+	int rc = find_compiled_selector(&cs, &system->selector_cache, 
+		selector, length);
+	if (rc < 0)
+		return rc;
+	cs->refs++;
+	*result = cs;
+	return STKR_OK;
+}
+
+void release_selector(System *system, CompiledSelector *selector)
+{
+	system;
+	if (selector == NULL)
+		return;
+	assertb(selector->refs != 0);
+	if (--selector->refs == 0 && !selector->cached)
+		delete [] (char *)selector;
+}
+
+/* Validates the attributes of a new rule, returning the size of the static
+ * attribute buffer needed to hold them. */
+static int measure_rule_attributes(
 	const AttributeAssignment *attributes, 
 	unsigned num_attributes, 
-	unsigned flags, 
-	int priority_key)
+	const AttributeBuffer *packed,
+	unsigned *flags)
 {
-	/* Allocate the rule object, its selectors, and a static attribute buffer 
-	 * big enough to hold the supplied attributes. */
 	unsigned attribute_block_size = 0;
 	for (unsigned i = 0; i < num_attributes; ++i) {
 		if (is_rule_attribute(attributes[i].name)) {
@@ -139,14 +263,45 @@ static int create_rule(
 				return rc;
 			attribute_block_size += (unsigned)rc;
 			if (attributes[i].name == TOKEN_CLASS)
-				flags |= RFLAG_MODIFIES_CLASS;
+				*flags |= RFLAG_MODIFIES_CLASS;
 		}
 	} 
+	if (packed != NULL)
+		attribute_block_size = (unsigned)packed->size;
+	return (int)attribute_block_size;
+}
+
+/* Rounds a size up to the alignment of the rules in a rule block. */
+inline unsigned align_rule_storage(unsigned size)
+{
+	return (size + sizeof(uint64_t) - 1) & ~unsigned(sizeof(uint64_t) - 1);
+}
+
+/* The number of bytes required to store a rule, its keys, its selectors and
+ * its attributes, rounded up to keep the next rule in a block aligned. */
+static unsigned rule_storage_size(const ParsedSelector *ps, 
+	unsigned attribute_block_size)
+{
 	unsigned bytes_required = sizeof(Rule);
 	bytes_required += ps->total_keys * sizeof(uint64_t);
 	bytes_required += ps->num_clauses * sizeof(Selector);
 	bytes_required += attribute_block_size;
-	char *block = new char[bytes_required];
+	return align_rule_storage(bytes_required);
+}
+
+/* Constructs a rule in storage allocated by the caller. */
+static Rule *init_rule(
+	char *block,
+	System *system, 
+	Document *document, 
+	const ParsedSelector *ps,
+	const AttributeAssignment *attributes, 
+	unsigned num_attributes, 
+	const AttributeBuffer *packed,
+	unsigned attribute_block_size,
+	unsigned flags, 
+	int priority_key)
+{
 	Rule *rule = (Rule *)block;
 	block += sizeof(Rule);
 	rule->keys = (uint64_t *)block;
@@ -160,7 +315,8 @@ static int create_rule(
 	rule->priority = priority_key;
 	rule->flags = (unsigned char)flags;
 	rule->revision = 0;
-	if (document != NULL)
+	rule->block = NULL;
+	if ((flags & RFLAG_IN_DOCUMENT_TABLE) != 0)
 		rule->document = document;
 	else
 		rule->system = system;
@@ -172,24 +328,219 @@ static int create_rule(
 		selector->rule = rule;
 		selector->key_offset = (unsigned short)key_offset;
 		selector->num_keys = (unsigned short)ps->keys_per_clause[i];
+		selector->num_ancestor_hashes = 0;
+		for (unsigned j = 1; j < selector->num_keys && 
+			j <= MAX_SELECTOR_ANCESTOR_HASHES; ++j) {
+			selector->ancestor_hashes[selector->num_ancestor_hashes++] = 
+				ancestor_filter_hash(ps->keys[key_offset + j]);
+		}
 		key_offset += ps->keys_per_clause[i];
 	}
 
 	/* Store the supplied attributes in the buffer. */
+	if (packed != NULL && packed->size != 0) {
+		memcpy(rule->attributes.buffer, packed->buffer, packed->size);
+		rule->attributes.size = packed->size;
+		rule->attributes.num_attributes = packed->num_attributes;
+	}
 	for (unsigned i = 0; i < num_attributes; ++i) {
 		if (is_rule_attribute(attributes[i].name))
 			abuf_set(&rule->attributes, attributes[i].name, 
 				&attributes[i].value, attributes[i].op);
 	}
+	return rule;
+}
 
-	*result = rule;
+/* Creates a rule from either a list of attribute assignments or, if 
+ * 'packed' is not null, a copy of an attribute buffer. */
+static int create_rule(
+	Rule **result, 
+	System *system, 
+	Document *document, 
+	const ParsedSelector *ps,
+	const AttributeAssignment *attributes, 
+	unsigned num_attributes, 
+	const AttributeBuffer *packed,
+	unsigned flags, 
+	int priority_key)
+{
+	/* Allocate the rule object, its selectors, and a static attribute buffer 
+	 * big enough to hold the supplied attributes. */
+	int rc = measure_rule_attributes(attributes, num_attributes, packed, 
+		&flags);
+	if (rc < 0)
+		return rc;
+	unsigned attribute_block_size = (unsigned)rc;
+	char *block = new char[rule_storage_size(ps, attribute_block_size)];
+	*result = init_rule(block, system, document, ps, attributes, 
+		num_attributes, packed, attribute_block_size, flags, priority_key);
 	return STKR_OK;
 }
 
+/* Destroys a rule, freeing its storage unless it shares a block with rules 
+ * that are still alive. */
 static void destroy_rule_internal(Rule *rule)
 {
 	abuf_clear(&rule->attributes);
-	delete [] (char *)rule;
+	RuleBlock *block = rule->block;
+	if (block == NULL)
+		delete [] (char *)rule;
+	else if (--block->num_rules == 0)
+		delete [] (char *)block;
+}
+
+static const unsigned RULE_TABLE_INITIAL_CAPACITY = 64;
+
+void rule_table_init(RuleTable *table)
+{
+	table->slots = NULL;
+	table->capacity = 0;
+	table->num_keys = 0;
+	table->num_entries = 0;
+}
+
+/* Returns the slot holding a key, or the empty slot where the key would be
+ * inserted. The table must not be empty. */
+static RuleTableSlot *rule_table_probe(const RuleTable *table, uint64_t key)
+{
+	unsigned mask = table->capacity - 1;
+	unsigned index = unsigned(key) & mask;
+	for (;;) {
+		RuleTableSlot *slot = table->slots + index;
+		if (slot->count == 0 || slot->key == key)
+			return slot;
+		index = (index + 1) & mask;
+	}
+}
+
+/* Returns the slot for a key, or NULL if no selector has the key. */
+static const RuleTableSlot *rule_table_find(const RuleTable *table, 
+	uint64_t key)
+{
+	if (table->num_keys == 0)
+		return NULL;
+	const RuleTableSlot *slot = rule_table_probe(table, key);
+	return slot->count != 0 ? slot : NULL;
+}
+
+/* Reallocates the slot array, keeping the load factor at or below one half. */
+static void rule_table_grow(RuleTable *table)
+{
+	RuleTableSlot *old_slots = table->slots;
+	unsigned old_capacity = table->capacity;
+	table->capacity = old_capacity != 0 ? 2 * old_capacity : 
+		RULE_TABLE_INITIAL_CAPACITY;
+	table->slots = new RuleTableSlot[table->capacity];
+	memset(table->slots, 0, table->capacity * sizeof(RuleTableSlot));
+	for (unsigned i = 0; i < old_capacity; ++i) {
+		if (old_slots[i].count != 0)
+			*rule_table_probe(table, old_slots[i].key) = old_slots[i];
+	}
+	delete [] old_slots;
+}
+
+static void rule_table_insert(RuleTable *table, uint64_t key, 
+	Selector *selector)
+{
+	if (2 * (table->num_keys + 1) > table->capacity)
+		rule_table_grow(table);
+	RuleTableSlot *slot = rule_table_probe(table, key);
+	if (slot->count == 0) {
+		slot->key = key;
+		slot->capacity = 1;
+		slot->selector = selector;
+		table->num_keys++;
+	} else {
+		if (slot->count == slot->capacity) {
+			unsigned new_capacity = slot->capacity == 1 ? 4 : 
+				2 * slot->capacity;
+			Selector **selectors = new Selector *[new_capacity];
+			memcpy(selectors, rule_table_selectors(slot), 
+				slot->count * sizeof(Selector *));
+			if (slot->capacity != 1)
+				delete [] slot->selectors;
+			slot->selectors = selectors;
+			slot->capacity = new_capacity;
+		}
+		slot->selectors[slot->count] = selector;
+	}
+	slot->count++;
+	table->num_entries++;
+}
+
+/* Empties a slot, moving later slots in its probe sequence back so that no 
+ * key is separated from its home slot by an empty one. */
+static void rule_table_erase_slot(RuleTable *table, RuleTableSlot *slot)
+{
+	if (slot->capacity != 1)
+		delete [] slot->selectors;
+	unsigned mask = table->capacity - 1;
+	unsigned hole = unsigned(slot - table->slots);
+	unsigned index = hole;
+	for (;;) {
+		index = (index + 1) & mask;
+		RuleTableSlot *next = table->slots + index;
+		if (next->count == 0)
+			break;
+		/* Can the key move to the hole without passing its home slot? */
+		unsigned home = unsigned(next->key) & mask;
+		if (((index - home) & mask) >= ((index - hole) & mask)) {
+			table->slots[hole] = *next;
+			hole = index;
+		}
+	}
+	memset(table->slots + hole, 0, sizeof(RuleTableSlot));
+	table->num_keys--;
+}
+
+static void rule_table_remove(RuleTable *table, uint64_t key, 
+	const Selector *selector)
+{
+	RuleTableSlot *slot = (RuleTableSlot *)rule_table_find(table, key);
+	if (slot == NULL)
+		return;
+	Selector **selectors = slot->capacity == 1 ? &slot->selector : 
+		slot->selectors;
+	for (unsigned i = 0; i < slot->count; ++i) {
+		if (selectors[i] == selector) {
+			slot->count--;
+			memmove(selectors + i, selectors + i + 1, 
+				(slot->count - i) * sizeof(Selector *));
+			table->num_entries--;
+			if (slot->count == 0)
+				rule_table_erase_slot(table, slot);
+			break;
+		}
+	}
+}
+
+/* Looks up a batch of keys, storing a pointer to the slot for each key, or
+ * NULL if no selector has the key, in 'slots'. */
+static void rule_table_find_all(const RuleTable *table, const uint64_t *keys, 
+	unsigned num_keys, const RuleTableSlot **slots)
+{
+	if (table == NULL || table->num_keys == 0) {
+		memset(slots, 0, num_keys * sizeof(const RuleTableSlot *));
+		return;
+	}
+	for (unsigned i = 0; i < num_keys; ++i) {
+		const RuleTableSlot *slot = rule_table_probe(table, keys[i]);
+		slots[i] = slot->count != 0 ? slot : NULL;
+	}
+}
+
+/* Appends the selectors in a slot to 'out', most recently added first, 
+ * stopping when 'max_count' selectors have been found. Returns the new number
+ * of selectors in 'out'. */
+static unsigned append_slot_selectors(const RuleTableSlot *slot, 
+	const Selector **out, unsigned count, unsigned max_count)
+{
+	if (slot == NULL)
+		return count;
+	Selector * const *selectors = rule_table_selectors(slot);
+	for (unsigned i = slot->count; i-- != 0 && count != max_count; )
+		out[count++] = selectors[i];
+	return count;
 }
 
 /* Inserts a rule into a rule table. The table takes ownership of the rule. */
@@ -199,7 +550,7 @@ static void add_rule_to_table(RuleTable *table, Rule *rule)
 		Selector *selector = rule->selectors + i;
 		for (unsigned j = 0; j < selector->num_keys; ++j) {
 			uint64_t key = rule->keys[selector->key_offset + j];
-			table->insert(RuleTable::value_type(key, selector));
+			rule_table_insert(table, key, selector);
 		}
 	}
 }
@@ -207,18 +558,11 @@ static void add_rule_to_table(RuleTable *table, Rule *rule)
 /* Removes a rule from a rule table. */
 static void remove_rule_from_table(RuleTable *table, Rule *rule)
 {
-	typedef RuleTable::iterator I;
 	for (unsigned i = 0; i < rule->num_selectors; ++i) {
 		Selector *selector = rule->selectors + i;
 		for (unsigned j = 0; j < selector->num_keys; ++j) {
 			uint64_t key = rule->keys[selector->key_offset + j];
-			std::pair<I, I> range = table->equal_range(key);
-			for (I iter = range.first; iter != range.second; ++iter) {
-				if (iter->second == selector) {
-					table->erase(iter);
-					break;
-				}
-			}
+			rule_table_remove(table, key, selector);
 		}
 	}
 }
@@ -226,14 +570,21 @@ static void remove_rule_from_table(RuleTable *table, Rule *rule)
 /* Empties a rule table and frees all rules in contains. */
 void clear_rule_table(RuleTable *table)
 {
-	RuleTable::iterator iter = table->begin();
-	while (iter != table->end()) {
-		Rule *rule = iter->second->rule;
-		if (--rule->total_keys == 0)
-			destroy_rule_internal(rule);
-		++iter;
+	for (unsigned i = 0; i < table->capacity; ++i) {
+		RuleTableSlot *slot = table->slots + i;
+		if (slot->count == 0)
+			continue;
+		Selector * const *selectors = rule_table_selectors(slot);
+		for (unsigned j = 0; j < slot->count; ++j) {
+			Rule *rule = selectors[j]->rule;
+			if (--rule->total_keys == 0)
+				destroy_rule_internal(rule);
+		}
+		if (slot->capacity != 1)
+			delete [] slot->selectors;
 	}
-	table->clear();
+	delete [] table->slots;
+	rule_table_init(table);
 }
 
 /* Makes a key used to sort rules. The "priority" is a user supplied value.
@@ -252,14 +603,42 @@ inline System *rule_get_system(const Rule *rule)
 		rule->document->system : rule->system;
 }
 
+void rule_change_log_init(RuleChangeLog *log)
+{
+	log->position = 0;
+}
+
+/* Records the last key of each of a rule's selectors in the change log of the 
+ * table containing the rule. */
+static void log_rule_change(const Rule *rule, bool rematch)
+{
+	RuleChangeLog *log = ((rule->flags & RFLAG_IN_DOCUMENT_TABLE) != 0) ?
+		&rule->document->rule_log : &rule->system->rule_log;
+	for (unsigned i = 0; i < rule->num_selectors; ++i) {
+		const Selector *selector = rule->selectors + i;
+		RuleChange *change = log->changes + 
+			log->position++ % RULE_CHANGE_LOG_SIZE;
+		change->key = rule->keys[selector->key_offset] & RULE_KEY_NAME_MASK;
+		change->rematch = rematch;
+	}
+}
+
+/* Recovers the priority passed to add_rule() from a rule's priority key. The
+ * order is negative, so shifting it out leaves -1. */
+int get_rule_priority(const Rule *rule)
+{
+	return (rule->priority >> RULE_PRIORITY_SHIFT) + 1;
+}
+
 /* Creates a new rule and adds it to the document or system rule table. */
-int add_rule(
+static int add_rule_internal(
 	Rule **result, 
 	System *system, 
 	Document *document, 
 	const ParsedSelector *ps,
 	const AttributeAssignment *attributes, 
 	unsigned num_attributes,
+	const AttributeBuffer *packed,
 	unsigned flags, 
 	int priority)
 {
@@ -280,7 +659,7 @@ int add_rule(
 	Rule *rule = NULL;
 	if (result != NULL)
 		*result = NULL;
-	int order = -(1 + int(table->size()));
+	int order = -(1 + int(table->num_entries));
 	int priority_key = make_rule_priority_key(priority, order);
 	int rc = create_rule(
 		&rule, 
@@ -289,6 +668,7 @@ int add_rule(
 		ps,
 		attributes, 
 		num_attributes, 
+		packed,
 		flags,
 		priority_key);
 	if (rc < 0)
@@ -305,12 +685,42 @@ int add_rule(
 
 	/* Add the rule. */
 	add_rule_to_table(table, rule);
+	log_rule_change(rule, true);
 	
 	if (result != NULL)
 		*result = rule;
 	return STKR_OK;
 }
 
+int add_rule(
+	Rule **result, 
+	System *system, 
+	Document *document, 
+	const ParsedSelector *ps,
+	const AttributeAssignment *attributes, 
+	unsigned num_attributes,
+	unsigned flags, 
+	int priority)
+{
+	return add_rule_internal(result, system, document, ps, 
+		attributes, num_attributes, NULL, flags, priority);
+}
+
+/* Creates a rule whose attributes are a copy of an existing attribute buffer,
+ * as stored in a compiled document. The attributes are not validated. */
+int add_packed_rule(
+	Rule **result, 
+	System *system, 
+	Document *document, 
+	const ParsedSelector *ps,
+	const AttributeBuffer *attributes,
+	unsigned flags, 
+	int priority)
+{
+	return add_rule_internal(result, system, document, ps, 
+		NULL, 0, attributes, flags, priority);
+}
+
 /* Creates a rule using a selector string. */
 int add_rule(
 	Rule **result, 
@@ -376,11 +786,122 @@ int add_rule_from_attributes(
 		flags, priority);
 }
 
+/* A rule definition validated by add_rules(), with its parsed selector keys
+ * held in temporary arrays until the rule block has been allocated. */
+struct PendingRule {
+	unsigned first_key;
+	unsigned total_keys;
+	unsigned first_clause;
+	unsigned num_clauses;
+	unsigned attribute_block_size;
+	unsigned flags;
+};
+
+/* Creates a batch of rules. The rules, their selectors and their attribute 
+ * buffers are packed into one allocation, and the table revisions and the 
+ * system rule revision counter are advanced once for the whole batch. If any 
+ * definition is invalid, no rules are created. If 'results' is not null, it 
+ * receives a pointer to each rule, or null for every entry on failure. */
+int add_rules(
+	Rule **results,
+	System *system, 
+	Document *document, 
+	const RuleDefinition *definitions,
+	unsigned num_rules)
+{
+	if (num_rules == 0)
+		return STKR_OK;
+	if (results != NULL)
+		std::fill(results, results + num_rules, (Rule *)NULL);
+
+	/* Parse and validate the definitions and measure the block. */
+	std::vector<PendingRule> pending(num_rules);
+	std::vector<uint64_t> keys;
+	std::vector<unsigned> keys_per_clause;
+	ParsedSelector ps;
+	unsigned block_size = align_rule_storage(sizeof(RuleBlock));
+	bool local_changed = false, global_changed = false;
+	for (unsigned i = 0; i < num_rules; ++i) {
+		const RuleDefinition *definition = definitions + i;
+		PendingRule *pr = &pending[i];
+		int rc = parse_selector(&ps, definition->selector, 
+			definition->selector_length);
+		if (rc < 0)
+			return rc;
+		pr->flags = definition->flags;
+		rc = measure_rule_attributes(definition->attributes, 
+			definition->num_attributes, NULL, &pr->flags);
+		if (rc < 0)
+			return rc;
+		pr->attribute_block_size = (unsigned)rc;
+		pr->first_key = (unsigned)keys.size();
+		pr->total_keys = ps.total_keys;
+		pr->first_clause = (unsigned)keys_per_clause.size();
+		pr->num_clauses = ps.num_clauses;
+		keys.insert(keys.end(), ps.keys, ps.keys + ps.total_keys);
+		keys_per_clause.insert(keys_per_clause.end(), ps.keys_per_clause, 
+			ps.keys_per_clause + ps.num_clauses);
+		block_size += rule_storage_size(&ps, pr->attribute_block_size);
+		if (document == NULL || (pr->flags & RFLAG_GLOBAL) != 0)
+			global_changed = true;
+		else
+			local_changed = true;
+	}
+
+	char *storage = new char[block_size];
+	RuleBlock *block = (RuleBlock *)storage;
+	block->num_rules = num_rules;
+	storage += align_rule_storage(sizeof(RuleBlock));
+	if (global_changed)
+		system->rule_table_revision++;
+	if (local_changed)
+		document->flags |= DOCFLAG_RULE_TABLE_CHANGED;
+
+	/* The rules have distinct addresses, so they can share an initial
+	 * revision number. See add_rule_internal(). */
+	unsigned revision = system->rule_revision_counter++;
+
+	/* Construct the rules and add them to the tables. */
+	for (unsigned i = 0; i < num_rules; ++i) {
+		const RuleDefinition *definition = definitions + i;
+		const PendingRule *pr = &pending[i];
+		ps.total_keys = pr->total_keys;
+		ps.num_clauses = pr->num_clauses;
+		memcpy(ps.keys, &keys[pr->first_key], 
+			pr->total_keys * sizeof(uint64_t));
+		memcpy(ps.keys_per_clause, &keys_per_clause[pr->first_clause], 
+			pr->num_clauses * sizeof(unsigned));
+		unsigned flags = pr->flags;
+		RuleTable *table;
+		if (document == NULL || (flags & RFLAG_GLOBAL) != 0) {
+			table = &system->global_rules;
+			flags |= RFLAG_IN_SYSTEM_TABLE;
+		} else {
+			table = &document->rules;
+			flags |= RFLAG_IN_DOCUMENT_TABLE;
+		}
+		int order = -(1 + int(table->num_entries));
+		int priority_key = make_rule_priority_key(definition->priority, order);
+		Rule *rule = init_rule(storage, system, document, &ps, 
+			definition->attributes, definition->num_attributes, NULL, 
+			pr->attribute_block_size, flags, priority_key);
+		storage += rule_storage_size(&ps, pr->attribute_block_size);
+		rule->block = block;
+		rule->revision = revision;
+		add_rule_to_table(table, rule);
+		log_rule_change(rule, true);
+		if (results != NULL)
+			results[i] = rule;
+	}
+	return STKR_OK;
+}
+
 /* Removes a rule from any rule tables that contain it and destroys the rule. */
 void destroy_rule(Rule *rule)
 {
 	System *system = rule_get_system(rule);
 	Document *document = NULL;
+	log_rule_change(rule, true);
 	if ((rule->flags & RFLAG_IN_DOCUMENT_TABLE) != 0) {
 		document = rule->document;
 		remove_rule_from_table(&document->rules, rule);
@@ -404,6 +925,7 @@ static void rule_revised(Rule *rule)
 {
 	rule->revision++;
 	rule_get_system(rule)->rule_revision_counter++;
+	log_rule_change(rule, false);
 }
 
 /* Sets a mask of rule flags to true or false and marks any tables containing
@@ -475,8 +997,11 @@ unsigned make_node_rule_keys(const System *system, int node_token,
 	else if ((node_flags & NFLAG_INTERACTION_HIGHLIGHTED) != 0)
 		class_names[num_classes++] = system->rule_name_highlighted;
 
-	/* Order the classes and pseudo-classes by their hashed names. */
+	/* Order the classes and pseudo-classes by their hashed names, dropping 
+	 * repeats, which would give the node duplicate keys. */
 	std::sort(class_names, class_names + num_classes);
+	num_classes = unsigned(std::unique(class_names, class_names + 
+		num_classes) - class_names);
 
 	/* Output keys that match "*.<classes>" and "<tag>.<classes>" selectors for 
 	 * each subset in the power set of the class names. */
@@ -506,6 +1031,25 @@ unsigned make_node_rule_keys(const System *system, int node_token,
 	return num_keys;
 }
 
+/* True if a node's rule keys and those of its ancestors contain the keys of 
+ * one selector clause. */
+static bool node_matches_clause(const Node *node, const uint64_t *keys, 
+	unsigned num_keys)
+{
+	for (unsigned depth = 0; depth < num_keys; ++depth) {
+		if (node == NULL)
+			return false;
+		unsigned j;
+		for (j = 0; j < node->num_rule_keys; ++j)
+			if (keys[depth] == make_rule_lookup_key(node->rule_keys[j], depth))
+				break;
+		if (j == node->num_rule_keys)
+			return false;
+		node = node->t.parent.node;
+	}
+	return true;
+}
+
 int node_matches_selector(const Document *document, const Node *node, 
 	const ParsedSelector *ps)
 {
@@ -516,30 +1060,14 @@ int node_matches_selector(const Document *document, const Node *node,
 	/* For each clause, walk up the parent chain from 'node'. The clause matches
 	 * if its key at each level is found in the rule key buffer of the 
 	 * corresponding node. */
-	unsigned offset = 0, i, j;
-	for (i = 0; i < ps->num_clauses; ++i) {
-		const Node *n = node;
-		bool clause_match = true;
-		for (unsigned depth = 0; depth < ps->keys_per_clause[i]; ++depth) {
-			if (n == NULL) {
-				clause_match = false;
-				break;
-			}
-			uint64_t key = ps->keys[offset + depth];
-			for (j = 0; j < n->num_rule_keys; ++j)
-				if (key == make_rule_lookup_key(n->rule_keys[j], depth))
-					break;
-			if (j == n->num_rule_keys) {
-				clause_match = false;
-				break;
-			}
-			n = n->t.parent.node;
-		}
-		if (clause_match)
-			break;
+	unsigned offset = 0;
+	for (unsigned i = 0; i < ps->num_clauses; ++i) {
+		if (node_matches_clause(node, ps->keys + offset, 
+			ps->keys_per_clause[i]))
+			return 1;
 		offset += ps->keys_per_clause[i];
 	}
-	return int(i != ps->num_clauses);
+	return 0;
 }
 
 /* Returns 1 if a node matches the supplied rule selector, 0 if it doesn't,
@@ -547,35 +1075,395 @@ int node_matches_selector(const Document *document, const Node *node,
 int node_matches_selector(const Document *document, const Node *node, 
 	const char *selector, int length)
 {
-	ParsedSelector ps;
-	int rc = parse_selector(&ps, selector, length);
+	CompiledSelector *cs;
+	int rc = find_compiled_selector(&cs, &document->system->selector_cache, 
+		selector, length);
 	if (rc < 0)
 		return rc;
-	return node_matches_selector(document, node, &ps);
+	return node_matches_selector(document, node, &cs->ps);
+}
+
+int node_matches_selector(const Document *document, const Node *node, 
+	const CompiledSelector *selector)
+{
+	return node_matches_selector(document, node, &selector->ps);
+}
+
+static const unsigned NODE_INDEX_INITIAL_CAPACITY = 256;
+static const unsigned NODE_INDEX_INITIAL_SLOT_CAPACITY = 4;
+
+void node_index_init(NodeIndex *index)
+{
+	index->slots = NULL;
+	index->capacity = 0;
+	index->num_keys = 0;
+	index->enabled = false;
+	index->stale = NULL;
+	index->num_stale = 0;
+	index->stale_capacity = 0;
+}
+
+/* Frees the index, which must not contain any nodes, and disables it. */
+void node_index_clear(NodeIndex *index)
+{
+	assertb(index->num_keys == 0 && index->num_stale == 0);
+	delete [] index->slots;
+	delete [] index->stale;
+	node_index_init(index);
+}
+
+/* Returns the slot holding a key, or the empty slot where the key would be
+ * inserted. The index must not be empty. */
+static NodeIndexSlot *node_index_probe(const NodeIndex *index, uint64_t key)
+{
+	unsigned mask = index->capacity - 1;
+	unsigned i = unsigned(key) & mask;
+	for (;;) {
+		NodeIndexSlot *slot = index->slots + i;
+		if (slot->count == 0 || slot->key == key)
+			return slot;
+		i = (i + 1) & mask;
+	}
+}
+
+/* Returns the slot for a key, or NULL if no node has the key. */
+static const NodeIndexSlot *node_index_find(const NodeIndex *index, 
+	uint64_t key)
+{
+	if (index->num_keys == 0)
+		return NULL;
+	const NodeIndexSlot *slot = node_index_probe(index, key);
+	return slot->count != 0 ? slot : NULL;
+}
+
+/* Reallocates the slot array, keeping the load factor at or below one half. */
+static void node_index_grow(NodeIndex *index)
+{
+	NodeIndexSlot *old_slots = index->slots;
+	unsigned old_capacity = index->capacity;
+	index->capacity = old_capacity != 0 ? 2 * old_capacity : 
+		NODE_INDEX_INITIAL_CAPACITY;
+	index->slots = new NodeIndexSlot[index->capacity];
+	memset(index->slots, 0, index->capacity * sizeof(NodeIndexSlot));
+	for (unsigned i = 0; i < old_capacity; ++i) {
+		if (old_slots[i].count != 0)
+			*node_index_probe(index, old_slots[i].key) = old_slots[i];
+	}
+	delete [] old_slots;
+}
+
+/* Empties a slot, moving later slots in its probe sequence back. See 
+ * rule_table_erase_slot(). */
+static void node_index_erase_slot(NodeIndex *index, NodeIndexSlot *slot)
+{
+	delete [] slot->nodes;
+	unsigned mask = index->capacity - 1;
+	unsigned hole = unsigned(slot - index->slots);
+	unsigned i = hole;
+	for (;;) {
+		i = (i + 1) & mask;
+		NodeIndexSlot *next = index->slots + i;
+		if (next->count == 0)
+			break;
+		unsigned home = unsigned(next->key) & mask;
+		if (((i - home) & mask) >= ((i - hole) & mask)) {
+			index->slots[hole] = *next;
+			hole = i;
+		}
+	}
+	memset(index->slots + hole, 0, sizeof(NodeIndexSlot));
+	index->num_keys--;
+}
+
+/* Adds a node to the slot of each of its rule keys. */
+void node_index_add(NodeIndex *index, Node *node)
+{
+	assertb(node->indexed == 0);
+	node->indexed = 1;
+	for (unsigned i = 0; i < node->num_rule_keys; ++i) {
+		if (2 * (index->num_keys + 1) > index->capacity)
+			node_index_grow(index);
+		uint64_t key = node->rule_keys[i] & RULE_KEY_NAME_MASK;
+		NodeIndexSlot *slot = node_index_probe(index, key);
+		if (slot->count == 0) {
+			slot->key = key;
+			slot->capacity = NODE_INDEX_INITIAL_SLOT_CAPACITY;
+			slot->nodes = new Node *[slot->capacity];
+			index->num_keys++;
+		} else if (slot->count == slot->capacity) {
+			Node **nodes = new Node *[2 * slot->capacity];
+			memcpy(nodes, slot->nodes, slot->count * sizeof(Node *));
+			delete [] slot->nodes;
+			slot->nodes = nodes;
+			slot->capacity *= 2;
+		}
+		node->index_positions[i] = slot->count;
+		slot->nodes[slot->count++] = node;
+	}
+}
+
+/* Removes a node from the slots of its rule keys, moving the last node in each
+ * slot into the position the node vacates. */
+void node_index_remove(NodeIndex *index, Node *node)
+{
+	for (unsigned i = 0; i < node->num_rule_keys; ++i) {
+		uint64_t key = node->rule_keys[i] & RULE_KEY_NAME_MASK;
+		NodeIndexSlot *slot = (NodeIndexSlot *)node_index_find(index, key);
+		unsigned position = node->index_positions[i];
+		Node *last = slot->nodes[--slot->count];
+		slot->nodes[position] = last;
+		for (unsigned j = 0; last != node && j < last->num_rule_keys; ++j) {
+			if ((last->rule_keys[j] & RULE_KEY_NAME_MASK) == key) {
+				last->index_positions[j] = position;
+				break;
+			}
+		}
+		if (slot->count == 0)
+			node_index_erase_slot(index, slot);
+	}
+	node->indexed = 0;
+}
+
+/* Adds an indexed node to the stale list if it isn't already there. Called
+ * wherever a node is flagged in a way that can change its rule keys or those
+ * of its descendants. */
+void node_index_mark_stale(NodeIndex *index, Node *node)
+{
+	if (node->indexed == 0 || node->stale != 0)
+		return;
+	if (index->num_stale == index->stale_capacity) {
+		index->stale_capacity = index->stale_capacity != 0 ? 
+			2 * index->stale_capacity : NODE_INDEX_INITIAL_CAPACITY;
+		Node **stale = new Node *[index->stale_capacity];
+		if (index->num_stale != 0)
+			memcpy(stale, index->stale, index->num_stale * sizeof(Node *));
+		delete [] index->stale;
+		index->stale = stale;
+	}
+	node->stale = 1;
+	index->stale[index->num_stale++] = node;
+}
+
+/* Removes the nodes whose stale bits have been cleared from the stale list. */
+static void node_index_compact_stale(NodeIndex *index)
+{
+	unsigned j = 0;
+	for (unsigned i = 0; i < index->num_stale; ++i)
+		if (index->stale[i]->stale != 0)
+			index->stale[j++] = index->stale[i];
+	index->num_stale = j;
+}
+
+/* Indexes a subtree that has been attached to an indexed node. */
+void node_index_add_subtree(NodeIndex *index, Node *root)
+{
+	for (Node *node = root; node != NULL; 
+		node = (Node *)tree_next(&root->t, &node->t)) {
+		node_index_add(index, node);
+		if (must_update_rule_keys(node))
+			node_index_mark_stale(index, node);
+	}
+}
+
+/* Removes a subtree that is being detached from the tree from the index. */
+void node_index_remove_subtree(NodeIndex *index, Node *root)
+{
+	bool was_stale = false;
+	for (Node *node = root; node != NULL; 
+		node = (Node *)tree_next(&root->t, &node->t)) {
+		was_stale |= node->stale != 0;
+		node->stale = 0;
+		node_index_remove(index, node);
+	}
+	if (was_stale)
+		node_index_compact_stale(index);
+}
+
+/* Indexes the document's tree if this hasn't already been done. From then on,
+ * the index is maintained as the tree changes. */
+static void enable_node_index(Document *document)
+{
+	NodeIndex *index = &document->node_index;
+	if (!index->enabled) {
+		index->enabled = true;
+		node_index_add_subtree(index, document->root);
+	}
+}
+
+/* True if a document update is part way through its pre-layout stage. Nodes
+ * rematched by such an update can have descendants whose rematch is pending
+ * only in the update's iterator frames. */
+static bool pre_layout_in_progress(const Document *document)
+{
+	const IncrementalUpdateState *s = document->update;
+	return s != NULL && s->stage == DUS_PRE_LAYOUT && 
+		s->iterator.flags != TIF_END;
+}
+
+/* True if the subtree of a node on the stale list must be rematched before
+ * the index can be trusted. */
+static bool must_refresh_stale_node(const Node *node, bool in_progress)
+{
+	static const unsigned STALE_MASK = NFLAG_UPDATE_RULE_KEYS | 
+		NFLAG_UPDATE_MATCHED_RULES | NFLAG_UPDATE_CHILD_RULES;
+	return in_progress || (node->t.flags & STALE_MASK) != 0 || 
+		must_update_rule_keys(node);
+}
+
+/* True if a listed ancestor of a node will refresh the node's subtree. */
+static bool has_stale_ancestor(const Node *node, bool in_progress)
+{
+	for (node = node->t.parent.node; node != NULL; node = node->t.parent.node)
+		if (node->stale != 0 && must_refresh_stale_node(node, in_progress))
+			return true;
+	return false;
+}
+
+/* Makes the node index of a document ready to answer a query. The first query
+ * indexes the whole tree. After that, only the subtrees of nodes on the stale
+ * list can have stale index entries. The list doesn't depend on the dirty 
+ * bits, which an interrupted update may already have cleared above nodes it 
+ * hasn't rematched yet. Listed nodes rematched by a completed update have no 
+ * flags left and are just dropped. */
+static void prepare_node_index(Document *document)
+{
+	enable_node_index(document);
+	NodeIndex *index = &document->node_index;
+	bool in_progress = pre_layout_in_progress(document);
+	/* Rematching lists more nodes, but only inside subtrees being refreshed,
+	 * which the ancestor test skips. */
+	for (unsigned i = 0; i < index->num_stale; ++i) {
+		Node *root = index->stale[i];
+		if (!must_refresh_stale_node(root, in_progress) || 
+			has_stale_ancestor(root, in_progress))
+			continue;
+		if (must_update_rule_keys(root))
+			update_matched_rules(document, root);
+		for (Node *node = (Node *)tree_next(&root->t, &root->t); 
+			node != NULL; node = (Node *)tree_next(&root->t, &node->t))
+			update_matched_rules(document, node);
+	}
+	for (unsigned i = 0; i < index->num_stale; ++i)
+		index->stale[i]->stale = 0;
+	index->num_stale = 0;
+}
+
+/* Drops the nodes a completed update has rematched from the stale list, so 
+ * that the list stays short when there are no queries to empty it. */
+void node_index_trim_stale(NodeIndex *index)
+{
+	for (unsigned i = 0; i < index->num_stale; ++i) {
+		Node *node = index->stale[i];
+		if (!must_refresh_stale_node(node, false))
+			node->stale = 0;
+	}
+	node_index_compact_stale(index);
+}
+
+/* True if 'node' is 'root' or a descendant of it no more than 'max_depth' 
+ * levels down, with a negative maximum meaning any depth. */
+static bool is_within_subtree(const Node *root, const Node *node, 
+	int max_depth)
+{
+	for (unsigned depth = 0; node != NULL; ++depth) {
+		if (node == root)
+			return true;
+		if (depth == (unsigned)max_depth)
+			return false;
+		node = node->t.parent.node;
+	}
+	return false;
 }
 
-/* Recursively matches nodes against a selector. */
+/* Matches nodes in the subtree of 'root' against a selector by walking the
+ * subtree. The walk keeps track of its depth so that it doesn't descend 
+ * below 'max_depth'. */
+static int match_nodes_by_walk(const Document *document, const Node *root, 
+	const ParsedSelector *ps, const Node **matched_nodes, 
+	unsigned max_matched, int max_depth)
+{
+	unsigned num_matched = 0;
+	unsigned depth = 0;
+	const Node *node = root;
+	for (;;) {
+		if (node_matches_selector(document, node, ps) == 1) {
+			if (num_matched < max_matched)
+				matched_nodes[num_matched] = node;
+			num_matched++;
+		}
+		if (node->t.first.node != NULL && depth != (unsigned)max_depth) {
+			node = node->t.first.node;
+			depth++;
+			continue;
+		}
+		while (node != root && node->t.next.node == NULL) {
+			node = node->t.parent.node;
+			depth--;
+		}
+		if (node == root)
+			break;
+		node = node->t.next.node;
+	}
+	return (int)num_matched;
+}
+
+/* Matches nodes in the subtree of 'root' against a selector. Candidates for
+ * each clause are the nodes indexed under the clause's last key, which are 
+ * then checked against the rest of the clause and against earlier clauses,
+ * so that a node matching several clauses is counted once. Returns the 
+ * number of nodes matched. The first 'max_matched' of them in document order
+ * are stored in 'matched_nodes', as they would be by a walk of the subtree. 
+ * Subtrees not attached to the document are walked instead. */
 int match_nodes(const Document *document, const Node *root, 
 	const ParsedSelector *ps, const Node **matched_nodes, 
 	unsigned max_matched, int max_depth)
 {
 	if (root == NULL)
 		root = document->root;
+	Document *d = (Document *)document;
+	prepare_node_index(d);
+	if (root->indexed == 0) {
+		return match_nodes_by_walk(document, root, ps, matched_nodes, 
+			max_matched, max_depth);
+	}
 
-	int depth = 0;
+	if (max_matched == 0)
+		matched_nodes = NULL;
+	std::vector<const Node *> candidates;
 	unsigned num_matched = 0;
-	const Node *node = root;
-	do {
-		int rc = node_matches_selector(document, node, ps);
-		if (rc == 1) {
-			if (num_matched != max_matched)
-				matched_nodes[num_matched] = node;
+	unsigned offset = 0;
+	for (unsigned i = 0; i < ps->num_clauses; ++i) {
+		const uint64_t *keys = ps->keys + offset;
+		unsigned num_keys = ps->keys_per_clause[i];
+		const NodeIndexSlot *slot = node_index_find(&d->node_index, keys[0]);
+		for (unsigned j = 0; slot != NULL && j < slot->count; ++j) {
+			const Node *node = slot->nodes[j];
+			if (!node_matches_clause(node, keys, num_keys) || 
+				!is_within_subtree(root, node, max_depth))
+				continue;
+			unsigned earlier_offset = 0, k;
+			for (k = 0; k < i; ++k) {
+				if (node_matches_clause(node, ps->keys + earlier_offset, 
+					ps->keys_per_clause[k]))
+					break;
+				earlier_offset += ps->keys_per_clause[k];
+			}
+			if (k != i)
+				continue;
+			if (matched_nodes != NULL)
+				candidates.push_back(node);
 			num_matched++;
 		}
-		node = ((unsigned)depth < (unsigned)max_depth) ? 
-			(const Node *)tree_next(&root->t, &node->t) : 
-			(const Node *)tree_next_up(&root->t, &node->t);
-	} while (node != NULL);
+		offset += num_keys;
+	}
+
+	/* The index lists nodes in no particular order. */
+	if (matched_nodes != NULL) {
+		std::sort(candidates.begin(), candidates.end(), node_before);
+		unsigned num_stored = std::min(num_matched, max_matched);
+		for (unsigned i = 0; i < num_stored; ++i)
+			matched_nodes[i] = candidates[i];
+	}
 	return (int)num_matched;
 }
 
@@ -586,73 +1474,243 @@ int match_nodes(const Document *document, const Node *root,
 	const Node **matched_nodes, unsigned max_matched,
 	int max_depth)
 {
-	ParsedSelector ps;
-	int rc = parse_selector(&ps, selector, selector_length);
+	CompiledSelector *cs;
+	int rc = find_compiled_selector(&cs, &document->system->selector_cache, 
+		selector, selector_length);
 	if (rc < 0)
 		return rc;
-	return match_nodes(document, root, &ps, matched_nodes, max_matched, max_depth);
+	return match_nodes(document, root, &cs->ps, matched_nodes, max_matched, 
+		max_depth);
+}
+
+int match_nodes(const Document *document, const Node *root, 
+	const CompiledSelector *selector, const Node **matched_nodes, 
+	unsigned max_matched, int max_depth)
+{
+	return match_nodes(document, root, &selector->ps, matched_nodes, 
+		max_matched, max_depth);
+}
+
+/* Appends the changes logged since 'position' to 'changes'. Returns false if
+ * some have been overwritten. */
+static bool read_rule_changes(const RuleChangeLog *log, unsigned position, 
+	RuleChange *changes, unsigned *num_changes)
+{
+	if (log->position - position > RULE_CHANGE_LOG_SIZE)
+		return false;
+	for (unsigned i = position; i != log->position; ++i)
+		changes[(*num_changes)++] = log->changes[i % RULE_CHANGE_LOG_SIZE];
+	return true;
+}
+
+/* Orders rule changes by key. */
+static bool rule_change_less(const RuleChange &a, const RuleChange &b)
+{
+	return a.key < b.key;
+}
+
+/* True if a node has one of the first 'num_keys' keys in a sorted array of 
+ * rule changes. */
+static bool has_changed_key(const Node *node, const RuleChange *changes, 
+	unsigned num_keys)
+{
+	for (unsigned i = 0; i < node->num_rule_keys; ++i) {
+		RuleChange key;
+		key.key = node->rule_keys[i] & RULE_KEY_NAME_MASK;
+		const RuleChange *change = std::lower_bound(changes, 
+			changes + num_keys, key, rule_change_less);
+		if (change != changes + num_keys && change->key == key.key)
+			return true;
+	}
+	return false;
+}
+
+/* Marks the nodes that may be affected by the rules added, removed or revised 
+ * since the last call. A node can only match a selector if it has the 
+ * selector's last key. Rematching a node rematches its descendants, which
+ * takes care of selectors that match ancestors. Returns false if some changes 
+ * weren't logged, in which case any node may be affected. */
+bool invalidate_changed_rules(Document *document)
+{
+	System *system = document->system;
+	RuleChange changes[2 * RULE_CHANGE_LOG_SIZE];
+	unsigned num_changes = 0;
+	bool logged = (document->flags & DOCFLAG_RULE_LOG_INVALID) == 0 &&
+		read_rule_changes(&document->rule_log, document->rule_log_position, 
+			changes, &num_changes) &&
+		read_rule_changes(&system->rule_log, 
+			document->global_rule_log_position, changes, &num_changes);
+	document->rule_log_position = document->rule_log.position;
+	document->global_rule_log_position = system->rule_log.position;
+	document->flags &= ~DOCFLAG_RULE_LOG_INVALID;
+	if (!logged)
+		return false;
+	if (num_changes == 0 || document->root == NULL)
+		return true;
+
+	/* Sort the changes by key, merging changes to the same key. */
+	std::sort(changes, changes + num_changes, rule_change_less);
+	unsigned num_keys = 0;
+	for (unsigned i = 0; i < num_changes; ++i) {
+		if (num_keys != 0 && changes[num_keys - 1].key == changes[i].key)
+			changes[num_keys - 1].rematch |= changes[i].rematch;
+		else
+			changes[num_keys++] = changes[i];
+	}
+
+	/* Mark the nodes indexed under each changed key. Nodes whose rules have 
+	 * only been revised just need to be visited to check their rule slots. A
+	 * node is counted under the first of its keys that changed. */
+	enable_node_index(document);
+	for (unsigned i = 0; i < num_keys; ++i) {
+		const NodeIndexSlot *slot = node_index_find(&document->node_index, 
+			changes[i].key);
+		for (unsigned j = 0; slot != NULL && j < slot->count; ++j) {
+			Node *node = slot->nodes[j];
+			if (changes[i].rematch) {
+				node->t.flags |= NFLAG_UPDATE_MATCHED_RULES;
+				node_index_mark_stale(&document->node_index, node);
+			}
+			mark_node_dirty(node);
+			if (!has_changed_key(node, changes, i))
+				document->update_stats.rules_invalidated++;
+		}
+	}
+	return true;
+}
+
+void ancestor_filter_clear(AncestorFilter *filter)
+{
+	memset(filter->counts, 0, sizeof(filter->counts));
+}
+
+inline void ancestor_filter_increment(AncestorFilter *filter, unsigned index)
+{
+	uint8_t *count = filter->counts + (index & (ANCESTOR_FILTER_SIZE - 1));
+	if (*count != UINT8_MAX)
+		++*count;
+}
+
+inline void ancestor_filter_decrement(AncestorFilter *filter, unsigned index)
+{
+	uint8_t *count = filter->counts + (index & (ANCESTOR_FILTER_SIZE - 1));
+	if (*count != UINT8_MAX && *count != 0)
+		--*count;
+}
+
+/* Adds a node's rule keys to the filter before its children are matched. */
+void ancestor_filter_push(AncestorFilter *filter, const Node *node)
+{
+	for (unsigned i = 0; i < (unsigned)node->num_rule_keys; ++i) {
+		uint32_t hash = ancestor_filter_hash(node->rule_keys[i]);
+		ancestor_filter_increment(filter, hash);
+		ancestor_filter_increment(filter, hash >> ANCESTOR_FILTER_BITS);
+	}
+}
+
+/* Removes the keys added by ancestor_filter_push(). The node's keys must not
+ * have changed in between. */
+void ancestor_filter_pop(AncestorFilter *filter, const Node *node)
+{
+	for (unsigned i = 0; i < (unsigned)node->num_rule_keys; ++i) {
+		uint32_t hash = ancestor_filter_hash(node->rule_keys[i]);
+		ancestor_filter_decrement(filter, hash);
+		ancestor_filter_decrement(filter, hash >> ANCESTOR_FILTER_BITS);
+	}
+}
+
+/* False if some ancestor key of a selector is certainly not a key of any of 
+ * the ancestors in the filter. */
+static bool ancestor_filter_may_match(const AncestorFilter *filter, 
+	const Selector *selector)
+{
+	static const unsigned MASK = ANCESTOR_FILTER_SIZE - 1;
+	for (unsigned i = 0; i < selector->num_ancestor_hashes; ++i) {
+		uint32_t hash = selector->ancestor_hashes[i];
+		if (filter->counts[hash & MASK] == 0 || 
+			filter->counts[(hash >> ANCESTOR_FILTER_BITS) & MASK] == 0)
+			return false;
+	}
+	return true;
 }
 
 /* Updates the array of matched rules for a node by looking up its rule keys
- * in global and local rule tables. */
+ * in global and local rule tables. If a filter is supplied, it must contain
+ * the keys of exactly the node's ancestors. */
 unsigned match_rules(Document *document, Node *node, 
 	const Rule **matched, unsigned max_rules,
 	const RuleTable *local_table, 
-	const RuleTable *global_table)
+	const RuleTable *global_table,
+	const AncestorFilter *filter)
 {
 	static const unsigned MAX_MATCH_KEYS = 256;
 	static const unsigned LEVEL_MAX = 32;
 
-	document;
-
 	/* Starting at the node, walk up the parent chain, refining the set of
 	 * matched selectors at each step. */
-	const Selector *buffers[3][LEVEL_MAX];
-	const Selector **a = buffers[0], **b = buffers[1], **c = buffers[2];
+	const Selector *buffers[2][LEVEL_MAX];
+	uint64_t lookup_keys[MAX_NODE_RULE_KEYS];
+	const RuleTableSlot *local_slots[MAX_NODE_RULE_KEYS];
+	const RuleTableSlot *global_slots[MAX_NODE_RULE_KEYS];
+	const Selector **a = buffers[0], **b = buffers[1];
 	const Rule *matched_set[LEVEL_MAX];
 	unsigned len_a = 0, len_b = 0;
+	unsigned num_candidates = 0;
 	unsigned match_count = 0;
 	unsigned depth = 0;
 	Node *n = node;
 	do {
-		/* Look up each of the node's keys in the table, appending the 
-		 * discovered selectors to the level's match buffer 'A'. */
-		len_a = 0;
-		for (unsigned i = 0; i < (unsigned)n->num_rule_keys; ++i) {
-			uint64_t key = make_rule_lookup_key(n->rule_keys[i], depth);
-			typedef RuleTable::const_iterator I;
-			std::pair<I, I> range;
-			I iter;
-			if (local_table != NULL) {
-				range = local_table->equal_range(key);
-				for (iter = range.first; iter != range.second && 
-					len_a != LEVEL_MAX; ++iter) {
-					a[len_a++] = iter->second;
-				}
-			}
-			if (global_table != NULL) {
-				range = global_table->equal_range(key);
-				for (iter = range.first; iter != range.second && 
-					len_a != LEVEL_MAX; ++iter) {
-						a[len_a++] = iter->second;
-				}
+		unsigned num_keys = (unsigned)n->num_rule_keys;
+		for (unsigned i = 0; i < num_keys; ++i)
+			lookup_keys[i] = make_rule_lookup_key(n->rule_keys[i], depth);
+		if (depth == 0) {
+			/* Look up each of the node's keys in the tables, appending the 
+			 * discovered selectors to the candidate buffer 'A'. */
+			rule_table_find_all(local_table, lookup_keys, num_keys, 
+				local_slots);
+			rule_table_find_all(global_table, lookup_keys, num_keys, 
+				global_slots);
+			len_a = 0;
+			for (unsigned i = 0; i < num_keys && len_a != LEVEL_MAX; ++i) {
+				len_a = append_slot_selectors(local_slots[i], a, len_a, 
+					LEVEL_MAX);
+				len_a = append_slot_selectors(global_slots[i], a, len_a, 
+					LEVEL_MAX);
 			}
-			if (len_a == LEVEL_MAX)
-				break;
-		}
 
-		/* Eliminate duplicates in A. */
-		std::sort(a, a + len_a);
-		std::unique(a, a + len_a);
+			/* Eliminate duplicates in A. */
+			std::sort(a, a + len_a);
+			len_a = unsigned(std::unique(a, a + len_a) - a);
+			num_candidates = len_a;
 
-		/* Intersect set A with the working result B. */
-		if (depth != 0) {
-			std::sort(b, b + len_b);
-			len_b = std::set_intersection(a, a + len_a, b, b + len_b, c) - c;
-			std::swap(b, c);
-		} else {
+			/* Discard selectors that need a key no ancestor has. */
+			if (filter != NULL) {
+				unsigned len_filtered = 0;
+				for (unsigned i = 0; i < len_a; ++i) {
+					if (ancestor_filter_may_match(filter, a[i]))
+						a[len_filtered++] = a[i];
+				}
+				document->update_stats.rules_filtered += len_a - len_filtered;
+				len_a = len_filtered;
+			}
 			std::swap(a, b);
 			len_b = len_a;
+		} else {
+			/* Keep the selectors in the working result B whose key for this
+			 * level is one of the node's. The candidates are already known, 
+			 * so this is cheaper than looking up the node's keys. */
+			std::sort(b, b + len_b);
+			unsigned len_kept = 0;
+			for (unsigned i = 0; i < len_b; ++i) {
+				const Selector *selector = b[i];
+				uint64_t key = selector->rule->keys[selector->key_offset + depth];
+				unsigned j = 0;
+				while (j != num_keys && lookup_keys[j] != key)
+					++j;
+				if (j != num_keys)
+					b[len_kept++] = selector;
+			}
+			len_b = len_kept;
 		}
 
 		/* Move any selectors that have fully matched from B to the result 
@@ -669,6 +1727,10 @@ unsigned match_rules(Document *document, Node *node,
 		++depth;
 	} while (n != NULL && depth != MAX_SELECTOR_DEPTH && 
 		match_count != MAX_MATCH_KEYS && len_b != 0);
+
+	document->update_stats.rules_matched += match_count;
+	document->update_stats.rules_rejected += num_candidates > match_count ?
+		num_candidates - match_count : 0;
 		
 	/* Copy the matched rules to the output buffer, most important first.
 	 * Lower priority numbers indicate higher priority. */
@@ -686,19 +1748,23 @@ void dump_rule_table(const Document *document, bool global)
 {
 	const RuleTable *table = global ? &document->system->global_rules : 
 		&document->rules;
-	RuleTable::const_iterator iter;
-	dmsg("RULE TABLE %x, %u entries\n", table, table->size());
-	for (iter = table->begin(); iter != table->end(); ++iter) {
-		const Selector *selector = iter->second;
-		const Rule *rule = selector->rule;
-		dmsg("\t%llXh => selector [", iter->first);
-		for (unsigned i = 0; i < selector->num_keys; ++i) {
-			if (i != 0)
-				dmsg(", ");
-			dmsg("%llXh", rule->keys[selector->key_offset + i]);
+	dmsg("RULE TABLE %x, %u entries\n", table, table->num_entries);
+	for (unsigned slot_index = 0; slot_index < table->capacity; ++slot_index) {
+		const RuleTableSlot *slot = table->slots + slot_index;
+		Selector * const *selectors = rule_table_selectors(slot);
+		for (unsigned k = 0; k < slot->count; ++k) {
+			const Selector *selector = selectors[k];
+			const Rule *rule = selector->rule;
+			dmsg("\t%llXh => selector [", slot->key);
+			for (unsigned i = 0; i < selector->num_keys; ++i) {
+				if (i != 0)
+					dmsg(", ");
+				dmsg("%llXh", rule->keys[selector->key_offset + i]);
+			}
+			dmsg("] for rule %Xh: num_selectors=%u total_keys=%u "
+				"priority=%d\n", rule, rule->num_selectors, rule->total_keys,
+				rule->priority);
 		}
-		dmsg("] for rule %Xh: num_selectors=%u total_keys=%u priority=%d\n", 
-			rule, rule->num_selectors, rule->total_keys, rule->priority);
 	}
 	dmsg("END RULE TABLE\n");
 }
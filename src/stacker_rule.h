@@ -1,7 +1,6 @@
 #pragma once
 
 #include <cstdint>
-#include <unordered_map>
 
 #include "stacker.h"
 #include "stacker_attribute_buffer.h"
@@ -15,10 +14,77 @@ struct Node;
 const unsigned MAX_RULE_CLASSES   = 4;
 const unsigned MAX_NODE_RULE_KEYS = 256;
 
+const unsigned ANCESTOR_FILTER_BITS         = 12;
+const unsigned ANCESTOR_FILTER_SIZE         = 1 << ANCESTOR_FILTER_BITS;
+const unsigned MAX_SELECTOR_ANCESTOR_HASHES = 4;
+
+const unsigned RULE_CHANGE_LOG_SIZE = 256;
+
+const unsigned SELECTOR_CACHE_SIZE    = 64;
+const unsigned SELECTOR_CACHE_BUCKETS = 128;
+
 struct Selector {
 	struct Rule *rule;
 	unsigned short key_offset;
 	unsigned short num_keys;
+	/* Ancestor filter hashes of up to the first few keys above the last. */
+	unsigned short num_ancestor_hashes;
+	uint32_t ancestor_hashes[MAX_SELECTOR_ANCESTOR_HASHES];
+};
+
+/* A counting Bloom filter of the rule keys of the ancestors of the node being
+ * matched. A selector whose ancestor keys aren't all in the filter can't
+ * match, and is rejected without walking up the tree. Counters saturate, and
+ * a saturated counter is never decremented. */
+struct AncestorFilter {
+	uint8_t counts[ANCESTOR_FILTER_SIZE];
+};
+
+/* The last key of the selector of a rule that has been added, removed or 
+ * revised. Only nodes that have the key can match the selector. */
+struct RuleChange {
+	uint64_t key;  /* Without a level number. */
+	bool rematch;  /* Nodes must rematch rules, not just check revisions. */
+};
+
+/* The most recent rule changes affecting a rule table. The position counts 
+ * every change ever logged, so a reader that remembers the position it read 
+ * up to can tell whether changes it hasn't seen have been overwritten. */
+struct RuleChangeLog {
+	RuleChange changes[RULE_CHANGE_LOG_SIZE];
+	unsigned position;
+};
+
+/* A parsed selector and the string it was parsed from. The string follows 
+ * the structure in the same allocation. */
+struct CompiledSelector {
+	ParsedSelector ps;
+	uint64_t hash;
+	unsigned length;
+	unsigned refs;      /* Handles returned by compile_selector(). */
+	bool cached;        /* The selector is in the system's selector cache. */
+	CompiledSelector *bucket_next;
+	CompiledSelector *lru_prev;
+	CompiledSelector *lru_next;
+	const char *text;
+};
+
+/* Recently used selectors, by selector string, so that clients re-running 
+ * the same selectors don't parse them every time. Entries are in a chained
+ * hash table and a list ordered from most to least recently used. When the 
+ * cache is full, the least recently used entry is evicted. An evicted entry
+ * that still has handles is freed when the last handle is released. */
+struct SelectorCache {
+	CompiledSelector *buckets[SELECTOR_CACHE_BUCKETS];
+	CompiledSelector *lru_head;
+	CompiledSelector *lru_tail;
+	unsigned count;
+};
+
+/* A single allocation holding a batch of rules created by add_rules(). The
+ * rules follow the header. The block is freed with the last of its rules. */
+struct RuleBlock {
+	unsigned num_rules; /* Rules in the block not yet destroyed. */
 };
 
 struct Rule {
@@ -29,6 +95,7 @@ struct Rule {
 	unsigned char flags;
 	int priority;
 	unsigned revision;
+	RuleBlock *block; /* NULL if the rule was allocated by itself. */
 	union {
 		System *system;
 		Document *document;
@@ -36,8 +103,60 @@ struct Rule {
 	AttributeBuffer attributes;
 };
 
-typedef std::unordered_multimap<uint64_t, Selector *, 
-	std::identity<uint64_t>> RuleTable;
+/* A slot in a rule table. The selectors that have the slot's key are stored
+ * together, in the slot itself if the slot has room for only one. */
+struct RuleTableSlot {
+	uint64_t key;
+	unsigned count;    /* Zero if the slot is empty. */
+	unsigned capacity;
+	union {
+		Selector *selector;   /* If capacity is 1. */
+		Selector **selectors; /* If capacity is greater than 1. */
+	};
+};
+
+/* Maps rule lookup keys to selectors. This is an open addressing table with
+ * linear probing. Rule keys are already hashed, so the low bits of a key are
+ * used as-is to find its home slot. */
+struct RuleTable {
+	RuleTableSlot *slots;
+	unsigned capacity;    /* Zero or a power of two. */
+	unsigned num_keys;    /* Occupied slots. */
+	unsigned num_entries; /* Selectors in all slots. */
+};
+
+inline Selector * const *rule_table_selectors(const RuleTableSlot *slot)
+{
+	return slot->capacity == 1 ? &slot->selector : slot->selectors;
+}
+
+/* The nodes in a document that have a particular rule key. */
+struct NodeIndexSlot {
+	uint64_t key;      /* Without a level number. */
+	unsigned count;    /* Zero if the slot is empty. */
+	unsigned capacity;
+	Node **nodes;
+};
+
+/* An inverted index from rule keys to the nodes in a document's tree that 
+ * have them, used to answer match_nodes() queries and to find the nodes 
+ * affected by rule changes without visiting the whole tree. The index is built
+ * by the first query or rule change and maintained from then on as nodes 
+ * enter and leave the tree and as their keys change. Each indexed node
+ * stores the position it occupies in the slot of each of its keys, so it can
+ * be removed in constant time. The table uses the same open addressing 
+ * scheme as RuleTable. Indexed nodes whose rule keys may have changed since
+ * the last query are kept in a separate stale list, which the next query 
+ * empties and each completed update trims. */
+struct NodeIndex {
+	NodeIndexSlot *slots;
+	unsigned capacity; /* Zero or a power of two. */
+	unsigned num_keys; /* Occupied slots. */
+	bool enabled;      /* False until a query builds the index. */
+	Node **stale;
+	unsigned num_stale;
+	unsigned stale_capacity;
+};
 
 int add_rule_from_attributes(
 	Rule **result, 
@@ -47,6 +166,16 @@ int add_rule_from_attributes(
 	unsigned num_attributes,
 	unsigned flags = RFLAG_ENABLED, 
 	int priority = 0);
+int add_packed_rule(
+	Rule **result, 
+	System *system, 
+	Document *document, 
+	const ParsedSelector *ps,
+	const AttributeBuffer *attributes,
+	unsigned flags, 
+	int priority);
+int get_rule_priority(const Rule *rule);
+void rule_table_init(RuleTable *table);
 void clear_rule_table(RuleTable *table);
 unsigned make_node_rule_keys(const System *system, 
 	int node_token, unsigned node_flags, const char *cls, 
@@ -54,7 +183,23 @@ unsigned make_node_rule_keys(const System *system,
 unsigned match_rules(Document *document, Node *node, 
 	const Rule **matched, unsigned max_rules,
 	const RuleTable *local_table = NULL, 
-	const RuleTable *global_table = NULL);
+	const RuleTable *global_table = NULL,
+	const AncestorFilter *filter = NULL);
+void rule_change_log_init(RuleChangeLog *log);
+void selector_cache_init(SelectorCache *cache);
+void selector_cache_clear(SelectorCache *cache);
+void node_index_init(NodeIndex *index);
+void node_index_clear(NodeIndex *index);
+void node_index_add(NodeIndex *index, Node *node);
+void node_index_remove(NodeIndex *index, Node *node);
+void node_index_add_subtree(NodeIndex *index, Node *root);
+void node_index_remove_subtree(NodeIndex *index, Node *root);
+void node_index_mark_stale(NodeIndex *index, Node *node);
+void node_index_trim_stale(NodeIndex *index);
+bool invalidate_changed_rules(Document *document);
+void ancestor_filter_clear(AncestorFilter *filter);
+void ancestor_filter_push(AncestorFilter *filter, const Node *node);
+void ancestor_filter_pop(AncestorFilter *filter, const Node *node);
 
 } // namespace stkr
 
@@ -3,31 +3,61 @@
 #include <cstdlib>
 #include <cstdio>
 
+#if defined(_MSC_VER)
+	#include <malloc.h>
+#else
+	#include <csignal>
+#endif
+
 namespace stkr {
 
-#pragma warning(disable: 4505) // unreferenced local function has been removed
+#if defined(_MSC_VER)
+	#pragma warning(disable: 4505) // unreferenced local function has been removed
 
-#if defined(NDEBUG)
-	#pragma warning(disable: 4100) // unreferenced formal parameter
-	#pragma warning(disable: 4189) // local variable is initialized but not referenced
-	#pragma warning(disable: 4530) // C++ exception handler used but unwind semantics disabled
+	#if defined(NDEBUG)
+		#pragma warning(disable: 4100) // unreferenced formal parameter
+		#pragma warning(disable: 4189) // local variable is initialized but not referenced
+		#pragma warning(disable: 4530) // C++ exception handler used but unwind semantics disabled
+	#endif
+
+	#pragma warning(disable: 4127) // conditional expression is constant
 #endif
 
 #if defined(_MSC_VER) && !defined(snprintf)
 	#define snprintf _snprintf
 #endif
 
+/* Stops in the debugger if one is attached. Elsewhere, SIGTRAP terminates
+ * the process with a core dump. */
+#if defined(_MSC_VER) && defined(_M_IX86)
+	#define debug_break() __asm { int 3 }
+#elif defined(_MSC_VER)
+	#define debug_break() __debugbreak()
+#else
+	#define debug_break() raise(SIGTRAP)
+#endif
+
 // #define ensure(p) ((p) ? (void)0 : abort())
-#define ensure(p) if (!(p)) { __asm { int 3 }; exit(1); }
-#pragma warning(disable: 4127) // conditional expression is constant
+#define ensure(p) if (!(p)) { debug_break(); exit(1); }
 #if defined(NDEBUG)
 	#define assertb(p)
 #else
-	#define assertb(p) if (!(p)) { __asm { int 3 }; }
+	#define assertb(p) if (!(p)) { debug_break(); }
+#endif
+
+/* Heap consistency checks are only available from the MSVC CRT. */
+#if defined(_MSC_VER)
+	#define assert_heap() assertb(_heapchk() == _HEAPOK)
+#else
+	#define assert_heap()
 #endif
 
-#define docmsgp(flag, fmt, ...) if (get_flags(document) & flag) document_dump(document, (fmt), __VA_ARGS__);
-#define dmsg(fmt, ...) docmsgp(-1, fmt, __VA_ARGS__)
-#define lmsg(fmt, ...) docmsgp(DOCFLAG_DEBUG_LAYOUT, fmt, __VA_ARGS__);
+#if defined(_MSC_VER)
+	#define docmsgp(flag, fmt, ...) if (get_flags(document) & flag) document_dump(document, (fmt), __VA_ARGS__);
+#else
+	#define docmsgp(flag, fmt, ...) if (get_flags(document) & flag) document_dump(document, (fmt), ##__VA_ARGS__);
+#endif
+#define dmsg(fmt, ...) docmsgp(-1, fmt, ##__VA_ARGS__)
+#define lmsg(fmt, ...) docmsgp(DOCFLAG_DEBUG_LAYOUT, fmt, ##__VA_ARGS__);
 
 } // namespace stkr
@@ -258,6 +258,9 @@ System *create_system(unsigned flags, BackEnd *back_end, UrlCache *url_cache,
 	system->url_cache = url_cache;
 	system->rule_table_revision = 0;
 	system->rule_revision_counter = 0;
+	rule_table_init(&system->global_rules);
+	rule_change_log_init(&system->rule_log);
+	selector_cache_init(&system->selector_cache);
 	system->total_boxes = 0;
 	system->total_nodes = 0;
 	initialize_font_cache(system);
@@ -272,6 +275,7 @@ void destroy_system(System *system)
 	assertb(system->total_nodes == 0);
 	assertb(system->total_boxes == 0);
 	clear_rule_table(&system->global_rules);
+	selector_cache_clear(&system->selector_cache);
 	for (unsigned i = 0; i < system->font_cache_entries; ++i)
 		platform_release_font(system->back_end, system->font_cache[i].handle);
 	deinitialize_url_notifications(system, system->url_cache);
@@ -56,12 +56,14 @@ struct System {
 	
 	/* Rules. */
 	RuleTable global_rules;
+	RuleChangeLog rule_log;
 	unsigned rule_table_revision;
 	unsigned rule_revision_counter;
 	uint64_t rule_name_all;                    // *
 	uint64_t rule_name_highlighted;            // :highlighted
 	uint64_t rule_name_active;                 // :active
 	uint64_t token_rule_names[NUM_KEYWORDS];   // Hashed names of all keywords.
+	SelectorCache selector_cache;
 
 	/* URL cache. */
 	urlcache::UrlCache *url_cache;
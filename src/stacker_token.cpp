@@ -177,17 +177,117 @@ bool is_keyword(int token)
 	return token >= TOKEN_KEYWORD_FIRST && token < TOKEN_KEYWORD_LAST;
 }
 
+/* Keywords are found with a perfect hash built from TOKEN_STRINGS the first
+ * time one is looked up. A keyword's FNV-1a hash selects a bucket, and the 
+ * bucket's displacement, chosen when the table is built so that no two 
+ * keywords share a slot, mixes the hash into a slot index. A lookup is then
+ * one hash, two table reads and one comparison, however many keywords there
+ * are. */
+const unsigned KEYWORD_HASH_BUCKETS = 64;
+const unsigned KEYWORD_HASH_SLOTS   = 256;
+const unsigned KEYWORD_SLOT_EMPTY   = 0xFF;
+
+struct KeywordTable {
+	uint8_t displacements[KEYWORD_HASH_BUCKETS];
+	uint8_t slots[KEYWORD_HASH_SLOTS];
+	uint8_t lengths[NUM_KEYWORDS];
+	unsigned max_length;
+};
+
+static uint32_t keyword_hash(const char *s, unsigned length)
+{
+	uint32_t h = 2166136261u;
+	for (unsigned i = 0; i < length; ++i)
+		h = (h ^ (uint8_t)s[i]) * 16777619u;
+	return h;
+}
+
+static unsigned keyword_slot(uint32_t h, unsigned displacement)
+{
+	return ((h ^ (displacement * 0x45D9F3Bu)) * 0x9E3779B1u) >> 24;
+}
+
+static void build_keyword_table(KeywordTable *table)
+{
+	static_assert(NUM_KEYWORDS < KEYWORD_SLOT_EMPTY, 
+		"Too many keywords for the keyword hash table.");
+	static_assert(KEYWORD_HASH_SLOTS == 1 << 8, 
+		"keyword_slot() produces an 8-bit index.");
+
+	/* Hash the keywords and sort them into buckets. */
+	uint32_t hashes[NUM_KEYWORDS];
+	uint8_t bucket_sizes[KEYWORD_HASH_BUCKETS] = { 0 };
+	table->max_length = 0;
+	for (unsigned i = 0; i < NUM_KEYWORDS; ++i) {
+		const char *ts = TOKEN_STRINGS[TOKEN_KEYWORD_FIRST + i];
+		assertb(ts != NULL);
+		unsigned length = (unsigned)strlen(ts);
+		assertb(length <= UINT8_MAX);
+		table->lengths[i] = (uint8_t)length;
+		if (length > table->max_length)
+			table->max_length = length;
+		hashes[i] = keyword_hash(ts, length);
+		bucket_sizes[hashes[i] % KEYWORD_HASH_BUCKETS]++;
+	}
+	memset(table->displacements, 0, sizeof(table->displacements));
+	memset(table->slots, KEYWORD_SLOT_EMPTY, sizeof(table->slots));
+
+	/* Place the buckets largest first, giving each the smallest displacement
+	 * that puts all of its keywords in empty slots. */
+	for (unsigned size = NUM_KEYWORDS; size != 0; --size) {
+		for (unsigned b = 0; b < KEYWORD_HASH_BUCKETS; ++b) {
+			if (bucket_sizes[b] != size)
+				continue;
+			unsigned d;
+			for (d = 0; d != KEYWORD_SLOT_EMPTY; ++d) {
+				unsigned placed = 0, i;
+				for (i = 0; i < NUM_KEYWORDS; ++i) {
+					if (hashes[i] % KEYWORD_HASH_BUCKETS != b)
+						continue;
+					unsigned slot = keyword_slot(hashes[i], d);
+					if (table->slots[slot] != KEYWORD_SLOT_EMPTY)
+						break;
+					table->slots[slot] = (uint8_t)i;
+					placed++;
+				}
+				if (placed == size)
+					break;
+				/* Undo a partial placement. */
+				for (unsigned j = 0; j < i; ++j) {
+					if (hashes[j] % KEYWORD_HASH_BUCKETS == b)
+						table->slots[keyword_slot(hashes[j], d)] = 
+							KEYWORD_SLOT_EMPTY;
+				}
+			}
+			ensure(d != KEYWORD_SLOT_EMPTY);
+			table->displacements[b] = (uint8_t)d;
+		}
+	}
+}
+
+static const KeywordTable *get_keyword_table()
+{
+	struct Builder {
+		KeywordTable table;
+		Builder() { build_keyword_table(&table); }
+	};
+	static const Builder builder;
+	return &builder.table;
+}
+
 /* Finds the token corresponding to a keyword string. */
 int find_keyword(const char *s, unsigned length)
 {
-	for (unsigned i = TOKEN_KEYWORD_FIRST; i != TOKEN_KEYWORD_LAST; ++i) {
-		assertb(TOKEN_STRINGS[i] != NULL);
-		const char *ts = TOKEN_STRINGS[i];
-		unsigned slen = strlen(ts);
-		if (slen == length && 0 == memcmp(ts, s, slen))
-			return (int)i;
-	}
-	return TOKEN_INVALID;
+	const KeywordTable *table = get_keyword_table();
+	if (length > table->max_length)
+		return TOKEN_INVALID;
+	uint32_t h = keyword_hash(s, length);
+	unsigned d = table->displacements[h % KEYWORD_HASH_BUCKETS];
+	unsigned i = table->slots[keyword_slot(h, d)];
+	if (i == KEYWORD_SLOT_EMPTY || table->lengths[i] != length ||
+		0 != memcmp(TOKEN_STRINGS[TOKEN_KEYWORD_FIRST + i], s, length))
+		return TOKEN_INVALID;
+	return (int)(TOKEN_KEYWORD_FIRST + i);
 }
 
 /* True if 'token' is the value for a multiple choice attribute semantic. */
@@ -203,6 +203,17 @@ void tree_iterator_set_buffer(TreeIterator *ti, uint8_t *buffer,
 	ti->stack = buffer;
 }
 
+/* Updates an iterator using a supplied buffer after the buffer's contents have 
+ * been copied to a new address. */
+void tree_iterator_relocate_buffer(TreeIterator *ti, const uint8_t *old_buffer,
+	uint8_t *new_buffer)
+{
+	if (ti->using_heap || ti->stack != old_buffer)
+		return;
+	ti->frame = new_buffer + (ti->frame - ti->stack);
+	ti->stack = new_buffer;
+}
+
 /* Prepares a tree iterator for callback based preorder and/or postorder 
  * traversal. */
 unsigned tree_iterator_begin(
@@ -107,5 +107,7 @@ void *tree_iterator_pop(TreeIterator *ti);
 void *tree_iterator_peek(TreeIterator *ti, unsigned n = 0);
 void tree_iterator_set_buffer(TreeIterator *ti, 
 	uint8_t *buffer, unsigned buffer_size);
+void tree_iterator_relocate_buffer(TreeIterator *ti, const uint8_t *old_buffer,
+	uint8_t *new_buffer);
 
 } // namespace stkr
@@ -469,12 +469,16 @@ static void add_simple_text_command(View *view, int x0, int y0,
 	/* Measure the text if advances were not supplied. */
 	const unsigned *adv = advances;
 	if (adv == NULL) {
+		UpdateStats *stats = &view->document->update_stats;
+		stats->text_measurements++;
+		stats->characters_measured += length;
 		adv = new unsigned[length];
 		num_characters = measure_text(system, font_id, text, length, 
 			(unsigned *)adv);
 	}
 
 	/* Build the draw-text command. */
+	int dx = 0;
 	unsigned encoded_code_units = utf8_transcode(text, length, NULL, 
 		system->encoding);
 	TextCommandData *td = view_add_text_command(view, encoded_code_units, 
@@ -485,7 +489,6 @@ static void add_simple_text_command(View *view, int x0, int y0,
 	*(uint32_t *)td->colors = color;
 	*(uint32_t *)td->color_code_unit_counts = length;
 	*(uint32_t *)td->color_character_counts = num_characters;
-	int dx = 0;
 	for (unsigned i = 0; i < num_characters; ++i) {
 		((int *)td->x_positions)[i] = x0 + 
 			round_fixed_to_int(dx, TEXT_METRIC_PRECISION);
@@ -517,6 +520,8 @@ static void view_draw_box_label(View *view, const char *label,
 	System *system = view->document->system;
 	int16_t label_font_id = get_debug_label_font_id(system);
 	unsigned text_width, text_height, *advances = NULL;
+	view->document->update_stats.text_measurements++;
+	view->document->update_stats.characters_measured += length;
 	unsigned num_characters = measure_text_rectangle(system, label_font_id, 
 		label, length, &text_width, &text_height, &advances);
 
@@ -1044,11 +1049,18 @@ static void view_insert_dependent_commands(View *view)
 /* Rebuilds the view's command list. */
 static void view_build_commands(View *view)
 {
+	const Document *document = view->document;
 	view->flags &= ~VFLAG_REBUILD_COMMANDS;
 	do {
+		trace_begin(document, "view_build_box_commands");
 		view_build_box_commands(view);
+		trace_end(document);
+		trace_begin(document, "view_sort_commands");
 		view_sort_commands(view);
+		trace_end(document);
+		trace_begin(document, "view_insert_dependent_commands");
 		view_insert_dependent_commands(view);
+		trace_end(document);
 	} while (view_grow_buffers(view));
 }
 
@@ -1058,8 +1070,11 @@ void update_view(View *view)
 	if (view->layout_clock == document->update_clock && 
 		(view->flags & VFLAG_REBUILD_COMMANDS) == 0)
 		return;
+	trace_begin(document, "update_view");
 	view_update_box_list(view);
 	view_build_commands(view);
+	trace_end(document);
+	document->update_stats.draw_commands += view->num_headers;
 	view->layout_clock = document->update_clock;
 	view->paint_clock++;
 }
@@ -47,6 +47,59 @@ bool platform_check_timeout(TimerValue start, uintptr_t timeout)
 	return delta >= timeout_ticks;
 }
 
+uint64_t platform_query_microseconds(void)
+{
+	LARGE_INTEGER frequency, now;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	return uint64_t(now.QuadPart / frequency.QuadPart) * 1000000 + 
+		uint64_t(now.QuadPart % frequency.QuadPart) * 1000000 / 
+		frequency.QuadPart;
+}
+
+/*
+ * Files
+ */
+
+bool platform_map_file(MappedFile *file, const char *path)
+{
+	file->data = NULL;
+	file->size = 0;
+	file->handle = NULL;
+	HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, 
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(handle, &size) && size.QuadPart > 0 && 
+		size.QuadPart <= UINT32_MAX)
+		mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle); /* The mapping keeps the file open. */
+	if (mapping == NULL)
+		return false;
+	const void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == NULL) {
+		CloseHandle(mapping);
+		return false;
+	}
+	file->data = data;
+	file->size = unsigned(size.QuadPart);
+	file->handle = mapping;
+	return true;
+}
+
+void platform_unmap_file(MappedFile *file)
+{
+	if (file->data != NULL) {
+		UnmapViewOfFile(file->data);
+		CloseHandle((HANDLE)file->handle);
+	}
+	file->data = NULL;
+	file->size = 0;
+	file->handle = NULL;
+}
+
 } // namespace stkr
 
 #endif // defined(STACKER_WIN32)
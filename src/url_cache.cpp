@@ -8,11 +8,24 @@
 #include <algorithm>
 #include <unordered_map>
 
-#define NOMINMAX
-#include <Windows.h>
-#include <curl/curl.h>
-
-#pragma warning(disable: 4505) // unreferenced local function has been removed
+#if defined(_WIN32)
+	#define NOMINMAX
+	#include <Windows.h>
+#else
+	#include <cstring>
+	#include <mutex>
+	#include <unistd.h>
+#endif
+
+/* Builds without libcurl can serve local and inserted URLs only. Remote 
+ * requests fail as soon as they reach the front of the fetch queue. */
+#if !defined(URLCACHE_NO_CURL)
+	#include <curl/curl.h>
+#endif
+
+#if defined(_MSC_VER)
+	#pragma warning(disable: 4505) // unreferenced local function has been removed
+#endif
 
 #define ensure(p) ((p) ? (void)0 : abort())
 
@@ -59,6 +72,7 @@ struct FetchSlot {
 	char *buffer;
 	unsigned capacity;
 	unsigned data_size;
+	unsigned notified_size; // Data size at the last URL_NOTIFY_DATA.
 	Cache *cache; // For CURL callback.
 };
 
@@ -68,8 +82,14 @@ struct NotifySink {
 };
 
 struct Cache {
+#if defined(_WIN32)
 	CRITICAL_SECTION lock;
+#else
+	std::recursive_mutex lock;
+#endif
+#if !defined(URLCACHE_NO_CURL)
 	CURLM *curl_multi_handle;
+#endif
 	EntryHash entries;
 	FetchSlot fetch_slots[MAX_FETCH_SLOTS];
 	unsigned num_fetch_slots;
@@ -370,20 +390,20 @@ ParsedUrl *parse_url(const char *url, int length, void *buffer,
 	}
 	
 	char *q = result->url;
+	const char *p = url, *end = url + length;
+	const char *scheme = NULL;
+	bool treat_as_host_name = false;
 	if (too_long) {
 		code = URLPARSE_TOO_LONG;
 		goto done;
 	}
 
 	/* Scan over what might be the scheme or the first part of the host. */
-	const char *p = url, *end = url + length;
-	bool treat_as_host_name = false;
 	while (p != end && *p != ':' && *p != '/') {
 		treat_as_host_name |= (*p == '.');
 		++p;
 	}
 
-	const char *scheme = NULL;
 	if (p + 3 <= end && *p == ':' && p[1] == '/' && p[2] == '/') {
 		/* There must be something both before and after "://" for the URL to 
 		 * make sense. */
@@ -684,19 +704,29 @@ static bool default_local_fetch_callback(void *, const ParsedUrl *url,
 	return true;
 }
 
-static size_t handle_curl_write(char *data, size_t size, size_t count, 
-	FetchSlot *slot);
-
 static void cache_lock(Cache *cache)
 {
+#if defined(_WIN32)
 	EnterCriticalSection(&cache->lock);
+#else
+	cache->lock.lock();
+#endif
 }
 
 static void cache_unlock(Cache *cache)
 {
+#if defined(_WIN32)
 	LeaveCriticalSection(&cache->lock);
+#else
+	cache->lock.unlock();
+#endif
 }
 
+#if !defined(URLCACHE_NO_CURL)
+
+static size_t handle_curl_write(char *data, size_t size, size_t count, 
+	FetchSlot *slot);
+
 static void cache_initialize_fetch_slots(Cache *cache)
 {
 	cache->curl_multi_handle = curl_multi_init();
@@ -705,6 +735,7 @@ static void cache_initialize_fetch_slots(Cache *cache)
 		FetchSlot *slot = cache->fetch_slots + i;
 		slot->buffer = NULL;
 		slot->data_size = 0;
+		slot->notified_size = 0;
 		slot->capacity = 0;
 		slot->curl_handle = NULL;
 		slot->key = 0ULL;
@@ -737,6 +768,19 @@ static void cache_deinitialize_fetch_slots(Cache *cache)
 	curl_multi_cleanup(cache->curl_multi_handle);
 }
 
+#else
+
+static void cache_initialize_fetch_slots(Cache *cache)
+{
+	cache->num_fetch_slots = 0;
+}
+
+static void cache_deinitialize_fetch_slots(Cache *)
+{
+}
+
+#endif // !defined(URLCACHE_NO_CURL)
+
 static unsigned cache_notify_handle(const Cache *cache, const Handle *handle,
 	UrlNotification type, unsigned defval = 0)
 {
@@ -1252,6 +1296,33 @@ static void cache_unlock_handle(Cache *cache, UrlHandle handle)
 	cache_unlock(cache);
 }
 
+/* Returns the data received so far by a fetch in progress for a handle's
+ * entry, or NULL if the entry isn't being fetched. The data remains valid
+ * until the next cache update. */
+static const void *cache_received_data(Cache *cache, const Handle *handle, 
+	unsigned *out_size)
+{
+	const void *data = NULL;
+	unsigned size = 0;
+	cache_lock(cache);
+	const Entry *entry = handle != NULL ? handle->entry : NULL;
+	if (entry != NULL && entry->fetch_state == URL_FETCH_IN_PROGRESS) {
+		for (unsigned i = 0; i < cache->num_fetch_slots; ++i) {
+			const FetchSlot *slot = cache->fetch_slots + i;
+			if (slot->state == URL_FETCH_IN_PROGRESS && 
+				slot->key == entry->key) {
+				data = slot->buffer;
+				size = slot->data_size;
+				break;
+			}
+		}
+	}
+	cache_unlock(cache);
+	if (out_size != NULL)
+		*out_size = size;
+	return data;
+}
+
 /* Returns a handle's user data pointer. */
 static void *cache_get_user_data(Cache *cache, UrlHandle handle)
 {
@@ -1340,6 +1411,8 @@ done:
 	return success;
 }
 
+#if !defined(URLCACHE_NO_CURL)
+
 static void cache_handle_response_data(Cache *cache, unsigned slot_number,
 	const void *data, unsigned data_size)
 {
@@ -1416,6 +1489,19 @@ static void cache_update_fetch_slots(Cache *cache)
 		rc = curl_multi_perform(cache->curl_multi_handle, &running_handles);
 	} while (rc == CURLM_CALL_MULTI_PERFORM);
 
+	/* Tell handles about data received since the last update, so that 
+	 * clients can consume it before the fetch completes. */
+	for (unsigned i = 0; i < cache->num_fetch_slots; ++i) {
+		FetchSlot *slot = cache->fetch_slots + i;
+		if (slot->state != URL_FETCH_IN_PROGRESS || 
+			slot->data_size == slot->notified_size)
+			continue;
+		slot->notified_size = slot->data_size;
+		Entry *entry = cache_get(cache, slot->key);
+		if (entry != NULL)
+			cache_notify_handles(cache, entry, URL_NOTIFY_DATA);
+	}
+
 	/* Dequeue completion messages and notify the corresponding HttpDownloader 
 	 * instance. */
 	CURLMsg *message;
@@ -1460,6 +1546,7 @@ static void cache_populate_fetch_slots(Cache *cache)
 		if (rc == CURLM_OK) {
 			slot->key = entry->key;
 			slot->data_size = 0;
+			slot->notified_size = 0;
 			slot->state = URL_FETCH_IN_PROGRESS;
 			entry->fetch_state = URL_FETCH_IN_PROGRESS;
 		} else {
@@ -1469,6 +1556,28 @@ static void cache_populate_fetch_slots(Cache *cache)
 	}
 }
 
+#else
+
+static void cache_update_fetch_slots(Cache *)
+{
+}
+
+/* With no transport, every queued entry fails immediately. */
+static void cache_populate_fetch_slots(Cache *cache)
+{
+	for (unsigned j = NUM_PRIORITY_LEVELS - 1; j != URLP_NO_FETCH; --j) {
+		Entry *entry;
+		while ((entry = cache->fetch_head[j]) != NULL && 
+			entry->lock_count == 0) {
+			cache_add_entry_to_fetch_queue(cache, entry, URLP_NO_FETCH);
+			entry->fetch_state = URL_FETCH_FAILED;
+			cache_notify_handles(cache, entry, URL_NOTIFY_FETCH);
+		}
+	}
+}
+
+#endif // !defined(URLCACHE_NO_CURL)
+
 static void cache_evict_lru(Cache *cache)
 {
 	const unsigned MAX_EVICTABLE = 32;
@@ -1681,7 +1790,9 @@ static void cache_update(Cache *cache)
 static void cache_initialize(Cache *cache, unsigned memory_limit,
 	unsigned num_fetch_slots)
 {
+#if defined(_WIN32)
 	InitializeCriticalSection(&cache->lock);
+#endif
 	cache->num_fetch_slots = num_fetch_slots;
 	cache->memory_limit = memory_limit;
 	cache->fetch_local = &default_local_fetch_callback;
@@ -1707,7 +1818,9 @@ static void cache_deinitialize(Cache *cache)
 	cache_clear(cache);
 	cache_deinitialize_fetch_slots(cache);
 	cache_unlock(cache);
+#if defined(_WIN32)
 	DeleteCriticalSection(&cache->lock);
+#endif
 }
 
 /*
@@ -1831,6 +1944,11 @@ void UrlCache::unlock(UrlHandle handle)
 	cache_unlock_handle(cache, handle);
 }
 
+const void *UrlCache::received(UrlHandle handle, unsigned *out_size)
+{
+	return cache_received_data(cache, (const Handle *)handle, out_size);
+}
+
 UrlKey UrlCache::key(const char *url, int length) const
 {
 	return cache_make_key(url, length);
@@ -2100,7 +2218,11 @@ static void unit_test_cache(FILE *os)
 			}
 		}
 		cache->update();
+#if defined(_WIN32)
 		Sleep(POLL_INTERVAL_MSEC);
+#else
+		usleep(POLL_INTERVAL_MSEC * 1000);
+#endif
 	}
 	delete cache;
 }
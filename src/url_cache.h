@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 namespace urlcache {
 
 enum MimeType {
@@ -16,7 +18,7 @@ enum MimeType {
 	NUM_SUPPORTED_MIME_TYPES = MIMETYPE_NONE
 };
 
-enum UrlFetchPriority {
+enum UrlFetchPriority : int {
 	URLP_UNSET = -1,
 	URLP_NO_FETCH,
 	URLP_NORMAL,
@@ -37,7 +39,8 @@ enum UrlFetchState {
 
 enum UrlNotification {
 	URL_NOTIFY_FETCH,
-	URL_NOTIFY_EVICT
+	URL_NOTIFY_EVICT,
+	URL_NOTIFY_DATA   // More data has been received for a fetch in progress.
 };
 
 enum UrlFlag {
@@ -75,7 +78,7 @@ struct ParsedUrl {
 	char url[1];
 };
 
-typedef unsigned long long UrlKey;
+typedef uint64_t UrlKey;
 typedef void *UrlHandle;
 
 typedef unsigned (*NotifyCallback)(UrlHandle handle, UrlNotification type, 
@@ -168,6 +171,7 @@ public:
 	const void *lock(UrlHandle handle, unsigned *out_size = 0, 
 		MimeType *out_mime_type = 0);
 	void unlock(UrlHandle handle);
+	const void *received(UrlHandle handle, unsigned *out_size);
 	UrlFetchState query(UrlHandle handle, unsigned *out_size = 0,
 		MimeType *out_mime_type = 0, UrlFetchPriority *out_priority = 0,
 		void **out_user_data = 0);